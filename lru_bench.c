@@ -0,0 +1,1002 @@
+/* lru_bench.c - Throughput, hit rate and latency benchmark for lru_cache
+ *
+ * Drives get, put and delete from several threads over a synthetic key
+ * stream (uniform, Zipfian or sequential scan) or replays a recorded key
+ * trace, one key per line.  Reads are cache-aside: a miss is followed by
+ * a put of the key, so the hit rate reflects the eviction policy.  Reads
+ * can also be batched through get_many, or the whole run pointed at a
+ * LRU_CACHE_DEFINE cache with 8-byte keys and values.
+ */
+
+#include "lru_cache.h"
+#include "lru_cache_define.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+typedef enum
+{
+        BENCH_UNIFORM,
+        BENCH_ZIPF,
+        BENCH_SCAN
+} bench_distribution_t;
+
+typedef struct bench_config
+{
+        size_t  threads;
+        size_t  ops;
+        size_t  capacity;
+        size_t  keyspace;
+        size_t  key_size;
+        size_t  value_size;
+        unsigned int read_percent;
+        unsigned int delete_percent;
+        bench_distribution_t distribution;
+        double  zipf_theta;
+        unsigned int flags;
+        size_t  shards;
+        size_t  batch;
+        bool    slab;
+        bool    fixed;
+        bool    prefill;
+        bool    latency;
+        const char *trace_path;
+        const char *tier_path;
+        size_t  tier_capacity;
+        uint64_t seed;
+} bench_config_t;
+
+/* Zipfian ranks following Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases", as used by YCSB.
+ */
+typedef struct bench_zipf
+{
+        size_t  n;
+        double  theta;
+        double  alpha;
+        double  zetan;
+        double  eta;
+} bench_zipf_t;
+
+typedef struct bench_trace
+{
+        char   *data;
+        const char **keys;
+        size_t *key_sizes;
+        size_t  count;
+} bench_trace_t;
+
+/* Per-thread arrays for one get_many/put_many round. */
+typedef struct bench_batch
+{
+        char   *keys;
+        const void **key_ptrs;
+        size_t *key_sizes;
+        void  **values;
+        const void **value_ptrs;
+        size_t *value_sizes;
+        int    *results;
+} bench_batch_t;
+
+typedef struct bench_thread
+{
+        pthread_t thread;
+        size_t  id;
+        uint64_t rng;
+        uint64_t ops;
+} bench_thread_t;
+
+static bench_config_t config = {
+        .threads = 1,
+        .ops = 1000000,
+        .capacity = 100000,
+        .keyspace = 1000000,
+        .key_size = 16,
+        .value_size = 100,
+        .read_percent = 90,
+        .delete_percent = 0,
+        .distribution = BENCH_ZIPF,
+        .zipf_theta = 0.99,
+        .flags = LRU_CACHE_FLAG_NONE,
+        .shards = 0,
+        .batch = 0,
+        .slab = false,
+        .fixed = false,
+        .prefill = false,
+        .latency = true,
+        .trace_path = NULL,
+        .tier_path = NULL,
+        .tier_capacity = (size_t) 1 << 30,
+        .seed = 42,
+};
+
+LRU_CACHE_DEFINE (bench_fixed, uint64_t, uint64_t, lru_hash_u64,
+                  LRU_EQ_SCALAR)
+
+static lru_cache_t *cache;
+static lru_sharded_cache_t *sharded;
+static bench_fixed_t *fixed;
+static bench_zipf_t zipf;
+static bench_trace_t trace;
+
+static uint64_t
+next_random (uint64_t *state)
+{
+        uint64_t x;
+
+        x = *state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *state = x;
+
+        return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+next_unit (uint64_t *state)
+{
+        return (next_random (state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void
+zipf_init (bench_zipf_t *z, size_t n, double theta)
+{
+        double  zeta2;
+        size_t  i;
+
+        z->n = n;
+        z->theta = theta;
+        z->zetan = 0;
+        for (i = 1; i <= n; i++)
+                z->zetan += 1.0 / pow ((double) i, theta);
+
+        zeta2 = 1.0 + 1.0 / pow (2.0, theta);
+        z->alpha = 1.0 / (1.0 - theta);
+        z->eta = (1.0 - pow (2.0 / n, 1.0 - theta)) /
+                (1.0 - zeta2 / z->zetan);
+}
+
+static size_t
+zipf_next (const bench_zipf_t *z, uint64_t *state)
+{
+        double  u;
+        double  uz;
+        size_t  rank;
+
+        u = next_unit (state);
+        uz = u * z->zetan;
+
+        if (uz < 1.0)
+                return 0;
+
+        if (uz < 1.0 + pow (0.5, z->theta))
+                return 1;
+
+        rank = (size_t) (z->n * pow (z->eta * u - z->eta + 1.0, z->alpha));
+
+        return rank < z->n ? rank : z->n - 1;
+}
+
+/* Spreads popular ranks over the key space so the hottest keys are not
+ * also numerically adjacent.
+ */
+static uint64_t
+scramble (uint64_t rank)
+{
+        rank ^= rank >> 33;
+        rank *= 0xff51afd7ed558ccdULL;
+        rank ^= rank >> 33;
+
+        return rank;
+}
+
+static size_t
+next_index (bench_thread_t *thread)
+{
+        switch (config.distribution)
+        {
+        case BENCH_UNIFORM:
+                return next_random (&thread->rng) % config.keyspace;
+
+        case BENCH_ZIPF:
+                return scramble (zipf_next (&zipf, &thread->rng)) %
+                        config.keyspace;
+
+        case BENCH_SCAN:
+        default:
+                return (thread->id * (config.keyspace / config.threads) +
+                        thread->ops) % config.keyspace;
+        }
+}
+
+static size_t
+count_digits (size_t value)
+{
+        size_t  digits;
+
+        for (digits = 1; value >= 10; value /= 10)
+                digits++;
+
+        return digits;
+}
+
+/* Writes index in decimal padded with 'k' to key_size bytes, with no
+ * terminator; parse_args() ensures every index in the key space fits.
+ */
+static void
+make_key (char *buffer, size_t index)
+{
+        char    digits[32];
+        int     length;
+
+        length = snprintf (digits, sizeof (digits), "%zu", index);
+        memset (buffer, 'k', config.key_size);
+        memcpy (buffer, digits, (size_t) length);
+}
+
+static int
+bench_get (const void *key, size_t key_size)
+{
+        void   *value;
+        size_t  value_size;
+        int     result;
+
+        if (sharded != NULL)
+                result = lru_sharded_cache_get (sharded, key, key_size,
+                                                &value, &value_size);
+        else
+                result = lru_cache_get (cache, key, key_size, &value,
+                                        &value_size);
+
+        if (result == LRU_SUCCESS)
+                free (value);
+
+        return result;
+}
+
+static int
+bench_put (const void *key, size_t key_size, const void *value,
+           size_t value_size)
+{
+        if (sharded != NULL)
+                return lru_sharded_cache_put (sharded, key, key_size, value,
+                                              value_size);
+
+        return lru_cache_put (cache, key, key_size, value, value_size);
+}
+
+static int
+bench_delete (const void *key, size_t key_size)
+{
+        if (sharded != NULL)
+                return lru_sharded_cache_delete (sharded, key, key_size);
+
+        return lru_cache_delete (cache, key, key_size);
+}
+
+static void
+bench_get_many (size_t count, bench_batch_t *batch)
+{
+        if (sharded != NULL)
+                lru_sharded_cache_get_many (sharded, count, batch->key_ptrs,
+                                            batch->key_sizes, batch->values,
+                                            NULL, batch->results);
+        else
+                lru_cache_get_many (cache, count, batch->key_ptrs,
+                                    batch->key_sizes, batch->values, NULL,
+                                    batch->results);
+}
+
+static void
+bench_put_many (size_t count, bench_batch_t *batch)
+{
+        if (sharded != NULL)
+                lru_sharded_cache_put_many (sharded, count, batch->key_ptrs,
+                                            batch->key_sizes,
+                                            batch->value_ptrs,
+                                            batch->value_sizes, NULL);
+        else
+                lru_cache_put_many (cache, count, batch->key_ptrs,
+                                    batch->key_sizes, batch->value_ptrs,
+                                    batch->value_sizes, NULL);
+}
+
+static void
+run_synthetic (bench_thread_t *thread, char *key, char *value)
+{
+        unsigned int roll;
+        size_t  i;
+
+        for (i = 0; i < config.ops; i++)
+        {
+                make_key (key, next_index (thread));
+                roll = next_random (&thread->rng) % 100;
+
+                if (roll < config.read_percent)
+                {
+                        if (bench_get (key, config.key_size) ==
+                            LRU_ERROR_NOT_FOUND)
+                                bench_put (key, config.key_size, value,
+                                           config.value_size);
+                }
+                else if (roll < config.read_percent + config.delete_percent)
+                        bench_delete (key, config.key_size);
+                else
+                        bench_put (key, config.key_size, value,
+                                   config.value_size);
+
+                thread->ops++;
+        }
+}
+
+/* Looks up the first count keys of the batch at once and puts the
+ * misses back in a second call, the batched form of a cache-aside read.
+ */
+static void
+flush_batch (bench_batch_t *batch, size_t count)
+{
+        size_t  misses;
+        size_t  i;
+
+        for (i = 0; i < count; i++)
+                batch->key_ptrs[i] = batch->keys + i * config.key_size;
+
+        bench_get_many (count, batch);
+
+        misses = 0;
+        for (i = 0; i < count; i++)
+        {
+                if (batch->results[i] == LRU_SUCCESS)
+                        free (batch->values[i]);
+                else if (batch->results[i] == LRU_ERROR_NOT_FOUND)
+                        batch->key_ptrs[misses++] = batch->key_ptrs[i];
+        }
+
+        if (misses > 0)
+                bench_put_many (misses, batch);
+}
+
+/* As run_synthetic, but reads are queued and issued config.batch at a
+ * time; puts and deletes still go one by one.
+ */
+static void
+run_batched (bench_thread_t *thread, bench_batch_t *batch, char *key,
+             char *value)
+{
+        unsigned int roll;
+        size_t  pending;
+        size_t  index;
+        size_t  i;
+
+        pending = 0;
+        for (i = 0; i < config.ops; i++)
+        {
+                index = next_index (thread);
+                roll = next_random (&thread->rng) % 100;
+
+                if (roll < config.read_percent)
+                {
+                        make_key (batch->keys + pending * config.key_size,
+                                  index);
+                        if (++pending == config.batch)
+                        {
+                                flush_batch (batch, pending);
+                                pending = 0;
+                        }
+                }
+                else
+                {
+                        make_key (key, index);
+                        if (roll < config.read_percent + config.delete_percent)
+                                bench_delete (key, config.key_size);
+                        else
+                                bench_put (key, config.key_size, value,
+                                           config.value_size);
+                }
+
+                thread->ops++;
+        }
+
+        if (pending > 0)
+                flush_batch (batch, pending);
+}
+
+/* The same stream against the LRU_CACHE_DEFINE cache, keyed and valued
+ * by the index itself.
+ */
+static void
+run_fixed (bench_thread_t *thread)
+{
+        unsigned int roll;
+        uint64_t index;
+        uint64_t value;
+        size_t  i;
+
+        for (i = 0; i < config.ops; i++)
+        {
+                index = next_index (thread);
+                roll = next_random (&thread->rng) % 100;
+
+                if (roll < config.read_percent)
+                {
+                        if (bench_fixed_get (fixed, index, &value) ==
+                            LRU_ERROR_NOT_FOUND)
+                                bench_fixed_put (fixed, index, index);
+                }
+                else if (roll < config.read_percent + config.delete_percent)
+                        bench_fixed_delete (fixed, index);
+                else
+                        bench_fixed_put (fixed, index, index);
+
+                thread->ops++;
+        }
+}
+
+static void
+free_batch (bench_batch_t *batch)
+{
+        free (batch->keys);
+        free (batch->key_ptrs);
+        free (batch->key_sizes);
+        free (batch->values);
+        free (batch->value_ptrs);
+        free (batch->value_sizes);
+        free (batch->results);
+}
+
+static int
+init_batch (bench_batch_t *batch, const char *value)
+{
+        size_t  i;
+
+        batch->keys = malloc (config.batch * config.key_size);
+        batch->key_ptrs = malloc (config.batch * sizeof (void *));
+        batch->key_sizes = malloc (config.batch * sizeof (size_t));
+        batch->values = malloc (config.batch * sizeof (void *));
+        batch->value_ptrs = malloc (config.batch * sizeof (void *));
+        batch->value_sizes = malloc (config.batch * sizeof (size_t));
+        batch->results = malloc (config.batch * sizeof (int));
+        if (batch->keys == NULL || batch->key_ptrs == NULL ||
+            batch->key_sizes == NULL || batch->values == NULL ||
+            batch->value_ptrs == NULL || batch->value_sizes == NULL ||
+            batch->results == NULL)
+        {
+                free_batch (batch);
+                return -1;
+        }
+
+        for (i = 0; i < config.batch; i++)
+        {
+                batch->key_sizes[i] = config.key_size;
+                batch->value_ptrs[i] = value;
+                batch->value_sizes[i] = config.value_size;
+        }
+
+        return 0;
+}
+
+/* Each thread replays every threads-th line, so one thread replays the
+ * trace exactly in order.
+ */
+static void
+run_trace (bench_thread_t *thread, const char *value)
+{
+        size_t  i;
+
+        for (i = thread->id; i < trace.count; i += config.threads)
+        {
+                if (bench_get (trace.keys[i], trace.key_sizes[i]) ==
+                    LRU_ERROR_NOT_FOUND)
+                        bench_put (trace.keys[i], trace.key_sizes[i], value,
+                                   config.value_size);
+
+                thread->ops++;
+        }
+}
+
+static void *
+bench_thread_main (void *arg)
+{
+        bench_thread_t *thread;
+        bench_batch_t batch;
+        char   *key;
+        char   *value;
+
+        thread = arg;
+        if (fixed != NULL)
+        {
+                run_fixed (thread);
+                return NULL;
+        }
+
+        key = malloc (config.key_size);
+        value = malloc (config.value_size);
+        if (key == NULL || value == NULL)
+        {
+                free (key);
+                free (value);
+                return NULL;
+        }
+        memset (value, 'v', config.value_size);
+
+        if (trace.count > 0)
+                run_trace (thread, value);
+        else if (config.batch > 0)
+        {
+                if (init_batch (&batch, value) == 0)
+                {
+                        run_batched (thread, &batch, key, value);
+                        free_batch (&batch);
+                }
+        }
+        else
+                run_synthetic (thread, key, value);
+
+        free (key);
+        free (value);
+
+        return NULL;
+}
+
+/* On failure nothing is left allocated and trace is empty. */
+static int
+load_trace (const char *path)
+{
+        FILE   *file;
+        long    end;
+        size_t  length;
+        size_t  i;
+        size_t  start;
+        int     result;
+
+        result = -1;
+        file = fopen (path, "rb");
+        if (file == NULL)
+                return -1;
+
+        if (fseek (file, 0, SEEK_END) != 0 || (end = ftell (file)) < 0 ||
+            (unsigned long) end >= SIZE_MAX || fseek (file, 0, SEEK_SET) != 0)
+                goto cleanup;
+        length = (size_t) end;
+
+        trace.data = malloc (length + 1);
+        if (trace.data == NULL || fread (trace.data, 1, length, file) != length)
+                goto cleanup;
+        fclose (file);
+        file = NULL;
+        trace.data[length] = '\n';
+
+        trace.count = 0;
+        for (i = 0; i <= length; i++)
+        {
+                if (trace.data[i] == '\n')
+                        trace.count++;
+        }
+
+        trace.keys = malloc (trace.count * sizeof (const char *));
+        trace.key_sizes = malloc (trace.count * sizeof (size_t));
+        if (trace.keys == NULL || trace.key_sizes == NULL)
+                goto cleanup;
+
+        /* Blank lines are dropped; a trailing \r is not part of the key. */
+        trace.count = 0;
+        start = 0;
+        for (i = 0; i <= length; i++)
+        {
+                if (trace.data[i] != '\n')
+                        continue;
+
+                if (i > start && trace.data[i - 1] == '\r')
+                        trace.data[i - 1] = '\n';
+
+                if (trace.data[start] != '\n')
+                {
+                        trace.keys[trace.count] = trace.data + start;
+                        trace.key_sizes[trace.count] =
+                                (char *) memchr (trace.data + start, '\n',
+                                                 i - start + 1) -
+                                (trace.data + start);
+                        trace.count++;
+                }
+                start = i + 1;
+        }
+
+        result = 0;
+
+cleanup:
+        if (file != NULL)
+                fclose (file);
+
+        if (result != 0)
+        {
+                free (trace.data);
+                free (trace.keys);
+                free (trace.key_sizes);
+                memset (&trace, 0, sizeof (trace));
+        }
+
+        return result;
+}
+
+static double
+elapsed_seconds (const struct timespec *start, const struct timespec *end)
+{
+        return (end->tv_sec - start->tv_sec) +
+                (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+print_latency (const char *name, lru_latency_op_t op)
+{
+        lru_latency_t latency;
+        int     result;
+
+        if (sharded != NULL)
+                result = lru_sharded_cache_get_latency (sharded, op,
+                                                        &latency);
+        else
+                result = lru_cache_get_latency (cache, op, &latency);
+
+        if (result != LRU_SUCCESS || latency.count == 0)
+                return;
+
+        printf ("  %-10s %10llu %8llu %8llu %8llu %8llu %8llu %10llu\n",
+                name, (unsigned long long) latency.count,
+                (unsigned long long) latency.mean_ns,
+                (unsigned long long) latency.p50_ns,
+                (unsigned long long) latency.p90_ns,
+                (unsigned long long) latency.p99_ns,
+                (unsigned long long) latency.p999_ns,
+                (unsigned long long) latency.max_ns);
+}
+
+static void
+usage (const char *program)
+{
+        fprintf (stderr,
+                 "usage: %s [options]\n"
+                 "  -t THREADS     worker threads (1)\n"
+                 "  -n OPS         operations per thread (1000000)\n"
+                 "  -c CAPACITY    cache capacity (100000)\n"
+                 "  -k KEYS        key space size (1000000)\n"
+                 "  -K BYTES       key size (16)\n"
+                 "  -V BYTES       value size (100)\n"
+                 "  -r PERCENT     reads; the rest are puts (90)\n"
+                 "  -x PERCENT     deletes, taken from the puts (0)\n"
+                 "  -d DIST        uniform, zipf or scan (zipf)\n"
+                 "  -z THETA       Zipfian skew, below 1 (0.99)\n"
+                 "  -P POLICY      lru, slru or tinylfu (lru)\n"
+                 "  -f FLAGS       extra LRU_CACHE_FLAG_* bits\n"
+                 "  -H             LRU_CACHE_FLAG_HUGE_PAGES\n"
+                 "  -N             LRU_CACHE_FLAG_NUMA\n"
+                 "  -A             use the built-in slab allocator\n"
+                 "  -S SHARDS      use a sharded cache with SHARDS shards\n"
+                 "  -b BATCH       issue reads BATCH keys at a time (get_many)\n"
+                 "  -D             use an LRU_CACHE_DEFINE cache of 8-byte\n"
+                 "                 keys and values instead\n"
+                 "  -T FILE        replay keys from FILE, one per line\n"
+                 "  -y FILE        spill evictions to a second tier in FILE\n"
+                 "  -Y BYTES       second tier capacity (1 GiB)\n"
+                 "  -s SEED        random seed (42)\n"
+                 "  -p             prefill the cache before timing\n"
+                 "  -q             do not collect latency histograms\n",
+                 program);
+}
+
+static int
+parse_args (int argc, char **argv)
+{
+        int     opt;
+
+        while ((opt = getopt (argc, argv, "t:n:c:k:K:V:r:x:d:z:P:f:HNAS:b:DT:y:Y:s:pqh"))
+               != -1)
+        {
+                switch (opt)
+                {
+                case 't':
+                        config.threads = strtoul (optarg, NULL, 0);
+                        break;
+                case 'n':
+                        config.ops = strtoul (optarg, NULL, 0);
+                        break;
+                case 'c':
+                        config.capacity = strtoul (optarg, NULL, 0);
+                        break;
+                case 'k':
+                        config.keyspace = strtoul (optarg, NULL, 0);
+                        break;
+                case 'K':
+                        config.key_size = strtoul (optarg, NULL, 0);
+                        break;
+                case 'V':
+                        config.value_size = strtoul (optarg, NULL, 0);
+                        break;
+                case 'r':
+                        config.read_percent = strtoul (optarg, NULL, 0);
+                        break;
+                case 'x':
+                        config.delete_percent = strtoul (optarg, NULL, 0);
+                        break;
+                case 'd':
+                        if (strcasecmp (optarg, "uniform") == 0)
+                                config.distribution = BENCH_UNIFORM;
+                        else if (strcasecmp (optarg, "zipf") == 0)
+                                config.distribution = BENCH_ZIPF;
+                        else if (strcasecmp (optarg, "scan") == 0)
+                                config.distribution = BENCH_SCAN;
+                        else
+                                return -1;
+                        break;
+                case 'z':
+                        config.zipf_theta = strtod (optarg, NULL);
+                        break;
+                case 'P':
+                        if (strcasecmp (optarg, "slru") == 0)
+                                config.flags |= LRU_CACHE_FLAG_SEGMENTED;
+                        else if (strcasecmp (optarg, "tinylfu") == 0)
+                                config.flags |= LRU_CACHE_FLAG_TINYLFU;
+                        else if (strcasecmp (optarg, "lru") != 0)
+                                return -1;
+                        break;
+                case 'f':
+                        config.flags |= strtoul (optarg, NULL, 0);
+                        break;
+                case 'H':
+                        config.flags |= LRU_CACHE_FLAG_HUGE_PAGES;
+                        break;
+                case 'N':
+                        config.flags |= LRU_CACHE_FLAG_NUMA;
+                        break;
+                case 'A':
+                        config.slab = true;
+                        break;
+                case 'S':
+                        config.shards = strtoul (optarg, NULL, 0);
+                        break;
+                case 'b':
+                        config.batch = strtoul (optarg, NULL, 0);
+                        break;
+                case 'D':
+                        config.fixed = true;
+                        break;
+                case 'T':
+                        config.trace_path = optarg;
+                        break;
+                case 'y':
+                        config.tier_path = optarg;
+                        break;
+                case 'Y':
+                        config.tier_capacity = strtoull (optarg, NULL, 0);
+                        break;
+                case 's':
+                        config.seed = strtoull (optarg, NULL, 0);
+                        break;
+                case 'p':
+                        config.prefill = true;
+                        break;
+                case 'q':
+                        config.latency = false;
+                        break;
+                default:
+                        return -1;
+                }
+        }
+
+        if (config.threads == 0 || config.keyspace == 0 ||
+            config.key_size == 0 || config.value_size == 0 ||
+            config.read_percent > 100 ||
+            config.read_percent + config.delete_percent > 100 ||
+            config.zipf_theta <= 0 || config.zipf_theta >= 1.0)
+                return -1;
+
+        /* The specialized cache has none of the generic options. */
+        if (config.fixed &&
+            (config.shards > 0 || config.batch > 0 || config.flags != 0 ||
+             config.slab ||
+             config.trace_path != NULL || config.tier_path != NULL))
+                return -1;
+
+        if (config.batch > 0 && config.trace_path != NULL)
+                return -1;
+
+        /* Shorter keys would collide once truncated. */
+        if (config.trace_path == NULL && !config.fixed &&
+            config.key_size < count_digits (config.keyspace - 1))
+        {
+                fprintf (stderr, "key size %zu cannot hold %zu keys\n",
+                         config.key_size, config.keyspace);
+                return -1;
+        }
+
+        return 0;
+}
+
+static void
+prefill (void)
+{
+        char   *key;
+        char   *value;
+        size_t  i;
+
+        /* No stats to reset: filling to capacity only counts insertions. */
+        if (fixed != NULL)
+        {
+                for (i = 0; i < config.capacity && i < config.keyspace; i++)
+                        bench_fixed_put (fixed, i, i);
+
+                return;
+        }
+
+        key = malloc (config.key_size);
+        value = calloc (1, config.value_size);
+        if (key == NULL || value == NULL)
+                goto cleanup;
+
+        for (i = 0; i < config.capacity && i < config.keyspace; i++)
+        {
+                make_key (key, i);
+                bench_put (key, config.key_size, value, config.value_size);
+        }
+
+        if (sharded != NULL)
+                lru_sharded_cache_reset_stats (sharded);
+        else
+                lru_cache_reset_stats (cache);
+
+      cleanup:
+        free (key);
+        free (value);
+}
+
+int
+main (int argc, char **argv)
+{
+        bench_thread_t *threads;
+        struct timespec start;
+        struct timespec end;
+        lru_stats_t stats;
+        unsigned int flags;
+        uint64_t total_ops;
+        double  seconds;
+        size_t  i;
+
+        if (parse_args (argc, argv) != 0)
+        {
+                usage (argv[0]);
+                return 2;
+        }
+
+        if (config.trace_path != NULL && load_trace (config.trace_path) != 0)
+        {
+                fprintf (stderr, "cannot read trace %s\n", config.trace_path);
+                return 1;
+        }
+
+        if (config.distribution == BENCH_ZIPF && trace.count == 0)
+                zipf_init (&zipf, config.keyspace, config.zipf_theta);
+
+        flags = config.flags;
+        if (config.latency)
+                flags |= LRU_CACHE_FLAG_LATENCY_STATS;
+
+        if (config.fixed)
+                fixed = bench_fixed_create (config.capacity);
+        else if (config.shards > 0)
+                sharded = lru_sharded_cache_create_ex (config.capacity,
+                                                       config.shards, flags);
+        else
+                cache = lru_cache_create_ex (config.capacity, flags);
+
+        if (cache == NULL && sharded == NULL && fixed == NULL)
+        {
+                fprintf (stderr, "cannot create cache\n");
+                return 1;
+        }
+
+        if (config.slab &&
+            (sharded != NULL ?
+             lru_sharded_cache_set_allocator (sharded,
+                                              lru_slab_allocator ()) :
+             lru_cache_set_allocator (cache, lru_slab_allocator ())) !=
+            LRU_SUCCESS)
+        {
+                fprintf (stderr, "cannot use the slab allocator\n");
+                return 1;
+        }
+
+        if (config.tier_path != NULL &&
+            (sharded != NULL ?
+             lru_sharded_cache_attach_tier (sharded, config.tier_path,
+                                            config.tier_capacity) :
+             lru_cache_attach_tier (cache, config.tier_path,
+                                    config.tier_capacity)) != LRU_SUCCESS)
+        {
+                fprintf (stderr, "cannot attach tier %s\n", config.tier_path);
+                return 1;
+        }
+
+        if (config.prefill)
+                prefill ();
+
+        threads = calloc (config.threads, sizeof (bench_thread_t));
+        if (threads == NULL)
+                return 1;
+
+        clock_gettime (CLOCK_MONOTONIC, &start);
+
+        for (i = 0; i < config.threads; i++)
+        {
+                threads[i].id = i;
+                threads[i].rng = scramble (config.seed + i) | 1;
+                pthread_create (&threads[i].thread, NULL, bench_thread_main,
+                                &threads[i]);
+        }
+
+        total_ops = 0;
+        for (i = 0; i < config.threads; i++)
+        {
+                pthread_join (threads[i].thread, NULL);
+                total_ops += threads[i].ops;
+        }
+
+        clock_gettime (CLOCK_MONOTONIC, &end);
+        seconds = elapsed_seconds (&start, &end);
+
+        if (fixed != NULL)
+                bench_fixed_get_stats (fixed, &stats);
+        else if (sharded != NULL)
+                lru_sharded_cache_get_stats (sharded, &stats);
+        else
+                lru_cache_get_stats (cache, &stats);
+
+        printf ("threads %zu, ops %llu, %.3f s, %.0f ops/s\n",
+                config.threads, (unsigned long long) total_ops, seconds,
+                total_ops / seconds);
+        printf ("hit rate %.4f (%llu hits, %llu misses), %llu evictions, "
+                "size %zu\n",
+                stats.hits + stats.misses > 0 ?
+                (double) stats.hits / (stats.hits + stats.misses) : 0.0,
+                (unsigned long long) stats.hits,
+                (unsigned long long) stats.misses,
+                (unsigned long long) stats.evictions, stats.current_size);
+        if (config.tier_path != NULL)
+                printf ("tier: %llu spills, %llu hits\n",
+                        (unsigned long long) stats.spills,
+                        (unsigned long long) stats.tier_hits);
+
+        if (config.latency && fixed == NULL)
+        {
+                printf ("latency ns: %-8s %10s %8s %8s %8s %8s %8s %10s\n",
+                        "", "count", "mean", "p50", "p90", "p99", "p99.9",
+                        "max");
+                print_latency ("get", LRU_LATENCY_GET);
+                print_latency ("put", LRU_LATENCY_PUT);
+                print_latency ("delete", LRU_LATENCY_DELETE);
+                print_latency ("evict", LRU_LATENCY_EVICT);
+                print_latency ("lock wait", LRU_LATENCY_LOCK_WAIT);
+        }
+
+        if (fixed != NULL)
+                bench_fixed_destroy (fixed);
+        else if (sharded != NULL)
+                lru_sharded_cache_destroy (sharded);
+        else
+                lru_cache_destroy (cache);
+
+        free (threads);
+        free (trace.data);
+        free (trace.keys);
+        free (trace.key_sizes);
+
+        return 0;
+}
@@ -1,17 +1,48 @@
 /* lru_cache.c - Simple LRU Cache Implementation
  * - Thread-safe operations with reader-writer locks
  * - O(1) get, put, and delete operations
- * - Custom memory allocators support
- * - Statistics tracking
+ * - Word-at-a-time default hash, stored per node and never recomputed
+ * - Custom memory allocators support and a built-in slab allocator
+ * - Evicted nodes recycled directly into the next insert
+ * - Statistics tracking, lookup counters striped per thread
+ * - Optional per-operation latency histograms, lock wait measured apart
+ * - Compile-time tracing hooks (callback or USDT probes)
  *     - Hits
  *     - Misses
  *     - Evictions
  * - Eviction callbacks
  * - Iterator support for cache traversal
- * - Configurable capacity with dynamic resizing
+ * - Cursor-based scan that drops the lock between chunks
+ * - Entry-count or byte-budget capacity
+ * - Configurable capacity with dynamic resizing and incremental rehashing
  * - Key-value pair deep copying
+ * - Ownership-transfer put and take that skip the copies
+ * - Optional cache-line-friendly open-addressing hash index
+ * - Optional single-allocation nodes with inline key and value
+ * - Zero-copy pinned lookups through acquire/release handles
+ * - Optional deferred promotion so hits only take the read lock
+ * - Optional lock-free peek and contains with epoch-based reclamation
+ * - Optional scan-resistant segmented LRU and W-TinyLFU policies
+ * - Per-entry TTL, expired lazily and through a hierarchical timing wheel
+ * - Eviction callbacks run after the cache lock is dropped
+ * - Batched tail eviction for shrinking and shedding under memory pressure
+ * - Clear that swaps in empty state and frees the old entries unlocked
+ * - Process-wide memory budget registry that sheds on cgroup pressure
+ * - Optional file-backed second tier fed asynchronously with evictions
+ * - Optional value compression above a size threshold through hooks
+ * - Get-or-load with concurrent misses coalesced onto a single load
+ * - Snapshot to a file and bulk restore through mmap for warm restarts
+ * - Sharded front-end with one lock, list and hash table per shard
+ * - Optional NUMA placement of shards with node-local slab memory
+ * - Optional huge page backing for large indexes and slab nodes
+ * - Batched multi-key get and put under a single lock acquisition
+ *
+ * The public API is declared in lru_cache.h; lru_demo.c and lru_bench.c
+ * link against the library built from this file.
  */
 
+#include "lru_cache.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,56 +51,136 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#ifdef LRU_CACHE_USDT
+#include <sys/sdt.h>
+#endif
 
 #define LRU_CACHE_DEFAULT_CAPACITY 1024
 #define LRU_CACHE_MIN_CAPACITY 1
 #define LRU_CACHE_LOAD_FACTOR 0.75
-
+#define LRU_CACHE_REHASH_STEP 16
+#define LRU_CACHE_MIN_TABLE_SIZE 8
+#define LRU_CACHE_INLINE_ALIGN _Alignof (max_align_t)
+#define LRU_CACHE_BATCH_SIZE 256
+#define LRU_CACHE_READER_STRIPES 16
+#define LRU_CACHE_STAT_STRIPES 16
+#define LRU_HIST_SUB_BITS 3
+#define LRU_HIST_SUB (1 << LRU_HIST_SUB_BITS)
+#define LRU_HIST_MAX_BITS 36
+#define LRU_HIST_BUCKETS \
+        ((LRU_HIST_MAX_BITS - LRU_HIST_SUB_BITS + 1) * LRU_HIST_SUB)
+#define LRU_CACHE_RETIRE_BATCH 64
+#define LRU_CACHE_RECLAIM_BATCH 1024
+#define LRU_CACHE_LINE_SIZE 64
+#define LRU_CACHE_WINDOW_PERCENT 1
+#define LRU_CACHE_PROTECTED_PERCENT 80
+#define LRU_CACHE_FLIGHT_BUCKETS 64
+#define LRU_SNAPSHOT_MAGIC "LRUSNAP"
+#define LRU_SNAPSHOT_VERSION 1
+#define LRU_SNAPSHOT_BUFFER (1 << 20)
+#define LRU_TIMER_LEVELS 6
+#define LRU_TIMER_SLOT_BITS 6
+#define LRU_TIMER_SLOTS (1 << LRU_TIMER_SLOT_BITS)
+#define LRU_TIMER_NONE UINT16_MAX
+#define LRU_TIER_QUEUE 4096
+#define LRU_TIER_BATCH 256
+#define LRU_TIER_MIN_BUCKETS 64
+#define LRU_TIER_UNQUEUED SIZE_MAX
+#define LRU_REGISTRY_STEP 32
+#define LRU_REGISTRY_MIN_SHARE 8
+#define LRU_REGISTRY_PRESSURE_PERCENT 10
+#define LRU_REGISTRY_STALL_US 150000
+#define LRU_REGISTRY_WINDOW_US 2000000
+#define LRU_SKETCH_DEPTH 4
+#define LRU_SKETCH_MAX_COUNT 15
+#define LRU_SKETCH_SAMPLE_FACTOR 10
+
+#define LRU_SLAB_CHUNK_SIZE (64 * 1024)
+#define LRU_SLAB_HEADER_SIZE 64
+#define LRU_SLAB_CLASSES 32
+#define LRU_SLAB_MAX_OBJECT 8192
+#define LRU_SLAB_LARGE_CLASS UINT32_MAX
+#define LRU_SLAB_ANY_NODE UINT32_MAX
+#define LRU_SLAB_REGION_SIZE LRU_HUGE_PAGE_SIZE
+#define LRU_SLAB_HUGE_POOL LRU_NUMA_MAX_NODES
+#define LRU_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#ifndef LRU_SLAB_MAGAZINE_SIZE
+#define LRU_SLAB_MAGAZINE_SIZE 32
+#endif
+#define LRU_NUMA_MAX_NODES 64
+#define LRU_NUMA_MAX_CPUS 4096
+#define LRU_NUMA_NO_NODE (-1)
+#define LRU_NUMA_WORD_BITS (8 * sizeof (unsigned long))
+#define LRU_NUMA_MASK_WORDS(bits) \
+        (((bits) + LRU_NUMA_WORD_BITS - 1) / LRU_NUMA_WORD_BITS)
+#define LRU_MPOL_PREFERRED 1
+#define LRU_MPOL_MF_MOVE (1 << 1)
+#define LRU_SHARDED_CACHE_MAX_SHARDS 1024
+#define LRU_SHARD_HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+#define LRU_HASH_SEED 0xa0761d6478bd642fULL
+#define LRU_HASH_PRIME1 0xe7037ed1a0b428dbULL
+
+/* List regions, in list order from the head.  Plain LRU keeps every
+ * node in probation.
+ */
 typedef enum
 {
-        LRU_SUCCESS = 0,
-        LRU_ERROR_NOMEM = -1,
-        LRU_ERROR_INVALID_ARG = -2,
-        LRU_ERROR_NOT_FOUND = -3,
-        LRU_ERROR_LOCK = -4,
-        LRU_ERROR_FULL = -5
-} lru_error_t;
+        LRU_SEGMENT_WINDOW,
+        LRU_SEGMENT_PROTECTED,
+        LRU_SEGMENT_PROBATION,
+        LRU_SEGMENTS
+} lru_segment_t;
 
-typedef struct lru_cache lru_cache_t;
 typedef struct lru_node lru_node_t;
+typedef struct lru_tier lru_tier_t;
 typedef struct lru_hash_entry lru_hash_entry_t;
+typedef struct lru_slot lru_slot_t;
 
-typedef void *(*lru_malloc_fn) (size_t size);
-typedef void (*lru_free_fn) (void *ptr);
-typedef void *(*lru_copy_fn) (const void *data, size_t size);
-typedef void (*lru_destroy_fn) (void *data);
-typedef unsigned long (*lru_hash_fn) (const void *key, size_t key_size);
-typedef int (*lru_compare_fn) (const void *key1, size_t size1,
-                               const void *key2, size_t size2);
-typedef void (*lru_eviction_fn) (const void *key, size_t key_size,
-                                 void *value, size_t value_size,
-                                 void *user_data);
-
-typedef struct lru_allocator
+/* Snapshot files hold a header followed by one record per entry in MRU
+ * to LRU order, each record followed by its key and value bytes.  Fields
+ * are in host byte order; expiries are stored as the time remaining.
+ */
+typedef struct lru_snapshot_header
 {
-        lru_malloc_fn malloc_fn;
-        lru_free_fn free_fn;
-        lru_copy_fn copy_fn;
-        lru_destroy_fn destroy_fn;
-} lru_allocator_t;
+        char    magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t count;
+} lru_snapshot_header_t;
 
-typedef struct lru_stats
+typedef struct lru_snapshot_record
 {
-        uint64_t hits;
-        uint64_t misses;
-        uint64_t evictions;
-        uint64_t insertions;
-        uint64_t deletions;
-        uint64_t collisions;
-        size_t  current_size;
-        size_t  peak_size;
-} lru_stats_t;
+        uint64_t key_size;
+        uint64_t value_size;
+        uint64_t ttl_ms;
+} lru_snapshot_record_t;
+
+/* pprev points at whatever links to this entry, the bucket head or the
+ * previous entry's next, so an entry unlinks itself without a walk;
+ * generation tells which table it is counted in during a rehash.
+ */
+struct lru_hash_entry
+{
+        lru_node_t *node;
+        lru_hash_entry_t *next;
+        lru_hash_entry_t **pprev;
+        unsigned int generation;
+};
 
+/* Inline nodes keep the key and value bytes in data[], so node, key and
+ * value are a single allocation.
+ */
 struct lru_node
 {
         void   *key;
@@ -78,44 +189,353 @@ struct lru_node
         size_t  value_size;
         lru_node_t *prev;
         lru_node_t *next;
-        lru_hash_entry_t *hash_entry;
+        lru_hash_entry_t hash_entry;
+        unsigned long hash;
+        size_t  data_capacity;
+        unsigned int refcount;
+        bool    inline_data;
+        bool    accessed;
+        unsigned char segment;
+        uint16_t timer_slot;
+        uint64_t expires_at;
+        lru_node_t *timer_prev;
+        lru_node_t *timer_next;
+        size_t  raw_size;
+        void   *inflated;
+        _Alignas (max_align_t) unsigned char data[];
 };
 
-struct lru_hash_entry
+/* Open-addressing slot: the full hash sits next to the node pointer so
+ * a probe only dereferences the node when the hashes match.
+ */
+struct lru_slot
 {
+        unsigned long hash;
         lru_node_t *node;
-        lru_hash_entry_t *next;
 };
 
+/* Readers in lock-free mode announce themselves in one of a few padded
+ * stripes, counted separately for each epoch parity.
+ */
+typedef struct lru_reader_stripe
+{
+        _Alignas (LRU_CACHE_LINE_SIZE) unsigned long active[2];
+} lru_reader_stripe_t;
+
+/* Lookup counters are bumped from every reader, so each thread counts in
+ * its own cache line and lru_cache_get_stats() sums the stripes.
+ */
+typedef enum
+{
+        LRU_STAT_HITS,
+        LRU_STAT_MISSES,
+        LRU_STAT_COLLISIONS,
+        LRU_STAT_COUNTERS
+} lru_stat_t;
+
+typedef struct lru_stat_stripe
+{
+        _Alignas (LRU_CACHE_LINE_SIZE) uint64_t counters[LRU_STAT_COUNTERS];
+} lru_stat_stripe_t;
+
+/* HDR-style log-linear histogram: values below LRU_HIST_SUB get a bucket
+ * each, and every power of two above is split into LRU_HIST_SUB buckets.
+ */
+typedef struct lru_histogram
+{
+        uint64_t total_ns;
+        uint64_t buckets[LRU_HIST_BUCKETS];
+} lru_histogram_t;
+
+typedef struct lru_latency_stripe
+{
+        _Alignas (LRU_CACHE_LINE_SIZE) lru_histogram_t ops[LRU_LATENCY_OPS];
+} lru_latency_stripe_t;
+
+/* Tracing hooks compile to nothing unless LRU_CACHE_TRACE (a callback set
+ * with lru_cache_set_trace_callback) or LRU_CACHE_USDT (static probes in
+ * the lru_cache provider) is defined.
+ */
+#if defined (LRU_CACHE_USDT)
+#define LRU_TRACE(cache, event, key, key_size, arg) \
+        DTRACE_PROBE3 (lru_cache, event, key, key_size, arg)
+#elif defined (LRU_CACHE_TRACE)
+#define LRU_TRACE(cache, event, key, key_size, arg) \
+        do \
+        { \
+                if ((cache)->trace_fn != NULL) \
+                        (cache)->trace_fn (LRU_TRACE_##event, key, key_size, \
+                                           arg, (cache)->trace_user_data); \
+        } \
+        while (0)
+#else
+#define LRU_TRACE(cache, event, key, key_size, arg) ((void) 0)
+#endif
+
+/* One load in progress for a key.  Callers that miss on the same key
+ * while it runs wait on done instead of loading again; the last of them
+ * to leave frees the record.
+ */
+typedef struct lru_flight
+{
+        struct lru_flight *next;
+        unsigned long hash;
+        const void *key;
+        size_t  key_size;
+        void   *value;
+        size_t  value_size;
+        int     result;
+        bool    finished;
+        unsigned int refs;
+        pthread_cond_t done;
+} lru_flight_t;
+
+/* Hierarchical timing wheel over millisecond ticks.  A timer sits at the
+ * level of the highest 6-bit group in which its expiry differs from the
+ * current tick and is cascaded down when that slot comes round.
+ */
+typedef struct lru_timer_wheel
+{
+        uint64_t now;
+        uint64_t occupied[LRU_TIMER_LEVELS];
+        lru_node_t *slots[LRU_TIMER_LEVELS][LRU_TIMER_SLOTS];
+} lru_timer_wheel_t;
+
+/* A key held by the second tier.  Until written it points at the evicted
+ * node and, once queued, its ring slot; afterwards it records where the
+ * value lives in the file and is kept in write order, the order the
+ * circular log overwrites entries in.
+ */
+typedef struct lru_tier_entry
+{
+        struct lru_tier_entry *next;
+        struct lru_tier_entry *older;
+        struct lru_tier_entry *newer;
+        lru_node_t *node;
+        size_t  slot;
+        unsigned long hash;
+        uint64_t offset;
+        uint64_t expires_at;
+        uint64_t version;
+        size_t  value_size;
+        size_t  raw_size;
+        size_t  key_size;
+        unsigned char key[];
+} lru_tier_entry_t;
+
+/* entry is cleared when the key is dropped before being written. */
+typedef struct lru_tier_item
+{
+        lru_node_t *node;
+        lru_tier_entry_t *entry;
+} lru_tier_item_t;
+
+/* File-backed second tier.  Evicted nodes wait in a bounded ring until
+ * the writer thread appends their values to a circular log in one
+ * pwritev() per batch.  The index and ring are guarded by lock.  Every
+ * entry gets a new version from versions, so a reader can tell that
+ * the entry it read is still the one indexed: lookups read the file
+ * without the lock and keep the data only if the entry survived, since
+ * the writer forgets entries before it overwrites their region.
+ */
+struct lru_tier
+{
+        lru_cache_t *cache;
+        int     fd;
+        char   *path;
+        uint64_t capacity;
+        uint64_t write_pos;
+
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t idle;
+        pthread_t writer;
+        bool    stop;
+
+        lru_tier_item_t queue[LRU_TIER_QUEUE];
+        size_t  head;
+        size_t  count;
+
+        lru_tier_entry_t **buckets;
+        size_t  n_buckets;
+        size_t  n_entries;
+        lru_tier_entry_t *oldest;
+        lru_tier_entry_t *newest;
+
+        uint64_t versions;
+        uint64_t spills;
+        uint64_t hits;
+};
+
+/* A registered cache as the registry sees it: the counters and size at
+ * the last sample, its share of the budget and the estimated hits per
+ * interval one more byte would bring it.  held is its size when last
+ * shed from.
+ */
+typedef struct lru_registry_entry
+{
+        struct lru_registry_entry *next;
+        lru_cache_t *cache;
+        uint64_t hits;
+        uint64_t evictions;
+        uint64_t rate;
+        uint64_t evicted;
+        size_t  bytes;
+        size_t  held;
+        double  share;
+        double  marginal;
+        unsigned int busy;
+        bool    sampled;
+        bool    limited;
+        bool    shed;
+} lru_registry_entry_t;
+
+/* Evictions a registry cap caused, queued so that their callbacks and
+ * the shrink callback run once the registry lock is dropped.  busy on
+ * the entry counts its jobs, and unregistering waits for them.
+ */
+typedef struct lru_registry_job
+{
+        struct lru_registry_job *next;
+        lru_registry_entry_t *entry;
+        lru_node_t *evicted;
+        lru_node_t *last;
+        lru_eviction_fn eviction_fn;
+        void   *eviction_user_data;
+        lru_tier_t *tier;
+        size_t  released;
+} lru_registry_job_t;
+
+/* Process-wide memory budget split between the registered caches, and
+ * the optional watcher thread that rebalances it every interval_ms and
+ * sheds on cgroup memory pressure events.  All of it is guarded by lock,
+ * which is never taken with a cache lock held nor held while user
+ * callbacks run.
+ */
+typedef struct lru_registry
+{
+        pthread_mutex_t lock;
+        lru_registry_entry_t *entries;
+        size_t  n_entries;
+        lru_registry_job_t *jobs;
+        pthread_cond_t idle;
+        size_t  budget;
+        lru_shrink_fn shrink_fn;
+        void   *shrink_user_data;
+        bool    pressured;
+
+        pthread_t watcher;
+        bool    watching;
+        int     pressure_fd;
+        int     wake[2];
+        unsigned int interval_ms;
+} lru_registry_t;
+
+/* mapped is the length of the huge page mapping holding the array, or 0
+ * when it came from calloc().
+ */
+typedef struct lru_table
+{
+        size_t  size;
+        size_t  count;
+        size_t  mapped;
+        unsigned int generation;
+        lru_hash_entry_t **buckets;
+        lru_slot_t *slots;
+} lru_table_t;
+
 struct lru_cache
 {
         size_t  capacity;
         size_t  size;
-        size_t  hash_table_size;
+        size_t  bytes;
+        size_t  byte_limit;
 
         lru_node_t *head;
         lru_node_t *tail;
-        lru_hash_entry_t **hash_table;
+        lru_node_t *window_tail;
+        lru_node_t *protected_tail;
+        size_t  segment_size[LRU_SEGMENTS];
+        lru_table_t table;
+        lru_table_t old_table;
+        size_t  rehash_index;
+        size_t  rehash_pending;
 
         lru_allocator_t allocator;
         lru_hash_fn hash_fn;
         lru_compare_fn compare_fn;
         lru_eviction_fn eviction_fn;
         void   *eviction_user_data;
+        lru_compress_fn compress_fn;
+        lru_decompress_fn decompress_fn;
+        size_t  compress_threshold;
+        void   *compress_user_data;
+        unsigned long compress_generation;
+        size_t  compressed_values;
+
+        /* Entries detached under the lock whose eviction callback or
+         * spill has not been started yet, and entries done with both whose
+         * memory is still to be released by the next writer.  Both are chained
+         * through node->next, the first in eviction order.
+         */
+        lru_node_t *evicted;
+        lru_node_t *evicted_tail;
+        lru_node_t *spent;
 
         lru_stats_t stats;
+        lru_stat_stripe_t *stat_stripes;
+        lru_latency_stripe_t *latency;
         pthread_rwlock_t lock;
 
+#ifdef LRU_CACHE_TRACE
+        lru_trace_fn trace_fn;
+        void   *trace_user_data;
+#endif
+
+        pthread_mutex_t flight_lock;
+        lru_flight_t *flights[LRU_CACHE_FLIGHT_BUCKETS];
+
         bool    thread_safe;
         bool    track_stats;
+        bool    open_addressing;
+        bool    inline_nodes;
+        bool    byte_capacity;
+        bool    deferred_promotion;
+        bool    lockfree_reads;
+        bool    segmented;
+        bool    tinylfu;
+        bool    huge_pages;
+        int     numa_node;
+
+        lru_timer_wheel_t *wheel;
+        lru_tier_t *tier;
+        lru_registry_entry_t *registry;
+
+        unsigned char *sketch;
+        size_t  sketch_width;
+        size_t  sketch_additions;
+
+        lru_reader_stripe_t *readers;
+        unsigned long epoch;
+        unsigned int index_seq;
+        lru_node_t *retired[2];
+        size_t  retired_count;
+};
+
+struct lru_sharded_cache
+{
+        size_t  n_shards;
+        unsigned int shard_bits;
+        lru_cache_t **shards;
+        lru_hash_fn hash_fn;
 };
 
-typedef struct lru_iterator
+struct lru_iterator
 {
         lru_cache_t *cache;
         lru_node_t *current;
         bool    locked;
-} lru_iterator_t;
+};
 
 static void *
 default_malloc (size_t size)
@@ -147,961 +567,7970 @@ default_destroy (void *data)
         free (data);
 }
 
-static unsigned long
-default_hash (const void *key, size_t key_size)
+/* NUMA placement reads the topology from sysfs and binds memory with
+ * the mbind system call directly, so there is no libnuma dependency.
+ * Hosts with a single node (or without sysfs) report one node, and
+ * LRU_CACHE_FLAG_NUMA then has no effect.
+ */
+typedef struct lru_numa_topology
 {
-        unsigned long hash;
-        const unsigned char *ptr;
-        size_t  i;
-
-        hash = 5381;
-        ptr = (const unsigned char *) key;
+        unsigned int n_nodes;
+        unsigned int nodes[LRU_NUMA_MAX_NODES];
+} lru_numa_topology_t;
 
-        for (i = 0; i < key_size; i++)
-                hash = ((hash << 5) + hash) + ptr[i];
-
-        return hash;
-}
+static lru_numa_topology_t numa_topology;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
 
+/* Parses a sysfs range list such as "0-3,8-11" into a bitmask. */
 static int
-default_compare (const void *key1, size_t size1,
-                 const void *key2, size_t size2)
-{
-        if (size1 != size2)
-                return (int) (size1 - size2);
-
-        return memcmp (key1, key2, size1);
-}
-
-static size_t
-calculate_hash_table_size (size_t capacity)
+numa_read_list (const char *path, unsigned long *mask, size_t n_bits)
 {
-        size_t  size;
+        char    text[4096];
+        char   *pos;
+        unsigned long first;
+        unsigned long last;
+        ssize_t n;
+        int     fd;
 
-        size = (size_t) (capacity / LRU_CACHE_LOAD_FACTOR);
+        memset (mask, 0, LRU_NUMA_MASK_WORDS (n_bits) * sizeof (unsigned long));
 
-        size--;
-        size |= size >> 1;
-        size |= size >> 2;
-        size |= size >> 4;
-        size |= size >> 8;
-        size |= size >> 16;
-        size++;
+        fd = open (path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return LRU_ERROR_IO;
 
-        return size;
-}
+        n = read (fd, text, sizeof (text) - 1);
+        close (fd);
 
-static lru_node_t *
-create_node (lru_cache_t *cache, const void *key, size_t key_size,
-             const void *value, size_t value_size)
-{
-        lru_node_t *node;
+        if (n <= 0)
+                return LRU_ERROR_IO;
 
-        node = cache->allocator.malloc_fn (sizeof (lru_node_t));
-        if (node == NULL)
-                return NULL;
+        text[n] = '\0';
 
-        node->key = cache->allocator.copy_fn (key, key_size);
-        if (node->key == NULL)
+        pos = text;
+        while (*pos >= '0' && *pos <= '9')
         {
-                cache->allocator.free_fn (node);
-                return NULL;
-        }
+                first = strtoul (pos, &pos, 10);
+                last = first;
+                if (*pos == '-')
+                        last = strtoul (pos + 1, &pos, 10);
 
-        node->value = cache->allocator.copy_fn (value, value_size);
-        if (node->value == NULL)
-        {
-                cache->allocator.destroy_fn (node->key);
-                cache->allocator.free_fn (node);
-                return NULL;
-        }
+                for (; first <= last && first < n_bits; first++)
+                        mask[first / LRU_NUMA_WORD_BITS] |=
+                                1UL << (first % LRU_NUMA_WORD_BITS);
 
-        node->key_size = key_size;
-        node->value_size = value_size;
-        node->prev = NULL;
-        node->next = NULL;
-        node->hash_entry = NULL;
+                if (*pos == ',')
+                        pos++;
+        }
 
-        return node;
+        return LRU_SUCCESS;
 }
 
 static void
-destroy_node (lru_cache_t *cache, lru_node_t *node)
+numa_init (void)
 {
-        if (node == NULL)
+        unsigned long mask[LRU_NUMA_MASK_WORDS (LRU_NUMA_MAX_NODES)];
+        unsigned int i;
+
+        if (numa_read_list ("/sys/devices/system/node/online", mask,
+                            LRU_NUMA_MAX_NODES) != LRU_SUCCESS)
                 return;
 
-        if (node->key != NULL)
-                cache->allocator.destroy_fn (node->key);
+        for (i = 0; i < LRU_NUMA_MAX_NODES; i++)
+                if ((mask[i / LRU_NUMA_WORD_BITS] >>
+                     (i % LRU_NUMA_WORD_BITS)) & 1)
+                        numa_topology.nodes[numa_topology.n_nodes++] = i;
+}
 
-        if (node->value != NULL)
-                cache->allocator.destroy_fn (node->value);
+static unsigned int
+numa_node_count (void)
+{
+        pthread_once (&numa_once, numa_init);
 
-        cache->allocator.free_fn (node);
+        return numa_topology.n_nodes == 0 ? 1 : numa_topology.n_nodes;
 }
 
-static void
-remove_from_list (lru_cache_t *cache, lru_node_t *node)
+static int
+numa_current_node (void)
 {
-        if (node->prev != NULL)
-                node->prev->next = node->next;
-        else
-                cache->head = node->next;
+#ifdef SYS_getcpu
+        unsigned int cpu;
+        unsigned int node;
 
-        if (node->next != NULL)
-                node->next->prev = node->prev;
-        else
-                cache->tail = node->prev;
+        if (syscall (SYS_getcpu, &cpu, &node, NULL) == 0 &&
+            node < LRU_NUMA_MAX_NODES)
+                return (int) node;
+#endif
+
+        return LRU_NUMA_NO_NODE;
 }
 
+/* Prefers node for the whole pages inside [addr, addr + len), moving
+ * the ones already touched.  Best effort: failures leave the memory
+ * wherever the kernel put it.
+ */
 static void
-add_to_front (lru_cache_t *cache, lru_node_t *node)
+numa_bind (void *addr, size_t len, int node)
 {
-        node->next = cache->head;
-        node->prev = NULL;
+#ifdef SYS_mbind
+        unsigned long mask[LRU_NUMA_MASK_WORDS (LRU_NUMA_MAX_NODES)];
+        uintptr_t page;
+        uintptr_t start;
+        uintptr_t end;
 
-        if (cache->head != NULL)
-                cache->head->prev = node;
+        if (addr == NULL || node < 0 || node >= LRU_NUMA_MAX_NODES)
+                return;
 
-        cache->head = node;
+        page = (uintptr_t) sysconf (_SC_PAGESIZE);
+        start = ((uintptr_t) addr + page - 1) & ~(page - 1);
+        end = ((uintptr_t) addr + len) & ~(page - 1);
+        if (start >= end)
+                return;
 
-        if (cache->tail == NULL)
-                cache->tail = node;
+        memset (mask, 0, sizeof (mask));
+        mask[node / LRU_NUMA_WORD_BITS] |= 1UL << (node % LRU_NUMA_WORD_BITS);
+
+        (void) syscall (SYS_mbind, start, end - start, LRU_MPOL_PREFERRED,
+                        mask, LRU_NUMA_MAX_NODES + 1, LRU_MPOL_MF_MOVE);
+#else
+        (void) addr;
+        (void) len;
+        (void) node;
+#endif
 }
 
-static void
-move_to_front (lru_cache_t *cache, lru_node_t *node)
+/* Built-in slab allocator.  Objects up to LRU_SLAB_MAX_OBJECT bytes are
+ * carved from 64 KiB chunks aligned to their size, so free() finds the
+ * size class by masking the pointer down to the chunk header instead of
+ * keeping a per-object header.  Larger requests get a chunk of their own.
+ * Each size class has a locked free list and every thread keeps a small
+ * magazine per class in front of it, so the steady state takes no locks.
+ * Freed memory is kept for reuse and never returned to the system.
+ *
+ * Caches bound to a NUMA node draw from a pool of that node instead,
+ * and caches created with LRU_CACHE_FLAG_HUGE_PAGES from one more pool
+ * bound to no node.  Pool chunks are cut from 2 MiB regions backed by
+ * huge pages where the system allows, bound to the node if any, and
+ * the chunk header records the pool so a free from any thread goes back
+ * to it.  Pools skip the magazines, which would otherwise mix nodes per
+ * thread, so every pool allocation and free takes the class lock.  Frees
+ * come from any thread and mostly outside the cache lock (evicted and
+ * released entries, handle releases), so a pool class is as contended as
+ * its busiest cache.
+ */
+typedef struct lru_slab_object
 {
-        if (cache->head == node)
-                return;
+        struct lru_slab_object *next;
+} lru_slab_object_t;
 
-        remove_from_list (cache, node);
-        add_to_front (cache, node);
-}
+typedef struct lru_slab_chunk
+{
+        uint32_t class_index;
+        uint32_t node;
+        size_t  length;
+} lru_slab_chunk_t;
 
-static unsigned long
-hash_key (lru_cache_t *cache, const void *key, size_t key_size)
+typedef struct lru_slab_class
 {
-        return cache->hash_fn (key, key_size) % cache->hash_table_size;
-}
+        pthread_mutex_t lock;
+        lru_slab_object_t *free_list;
+} lru_slab_class_t;
 
-static lru_node_t *
-find_in_hash_table (lru_cache_t *cache, const void *key, size_t key_size,
-                    lru_hash_entry_t ***prev_entry_ptr)
+typedef struct lru_slab_magazine
 {
-        unsigned long hash;
-        lru_hash_entry_t **entry_ptr;
-        lru_hash_entry_t *entry;
+        unsigned int count[LRU_SLAB_CLASSES];
+        void   *objects[LRU_SLAB_CLASSES][LRU_SLAB_MAGAZINE_SIZE];
+} lru_slab_magazine_t;
 
-        hash = hash_key (cache, key, key_size);
-        entry_ptr = &cache->hash_table[hash];
+typedef struct lru_slab_pool
+{
+        lru_slab_class_t classes[LRU_SLAB_CLASSES];
+        pthread_mutex_t lock;
+        unsigned char *region;
+        unsigned char *region_end;
+} lru_slab_pool_t;
+
+static const size_t slab_class_sizes[LRU_SLAB_CLASSES] = {
+        16, 32, 48, 64, 80, 96, 112, 128,
+        160, 192, 224, 256, 320, 384, 448, 512,
+        640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+        2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192
+};
 
-        while ((entry = *entry_ptr) != NULL)
-        {
-                if (cache->compare_fn
-                    (entry->node->key, entry->node->key_size, key,
-                     key_size) == 0)
-                {
-                        if (prev_entry_ptr != NULL)
-                                *prev_entry_ptr = entry_ptr;
-                        return entry->node;
-                }
+static lru_registry_t registry = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .idle = PTHREAD_COND_INITIALIZER,
+        .pressure_fd = -1
+};
 
-                entry_ptr = &entry->next;
+static lru_slab_class_t slab_classes[LRU_SLAB_CLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_magazine_key;
+static __thread lru_slab_magazine_t *slab_magazine;
+static lru_slab_pool_t *slab_pools[LRU_NUMA_MAX_NODES + 1];
+static pthread_mutex_t slab_pools_lock = PTHREAD_MUTEX_INITIALIZER;
 
-                if (cache->track_stats)
-                        cache->stats.collisions++;
+static void
+slab_push_objects (lru_slab_class_t *class, void **objects,
+                   unsigned int count)
+{
+        lru_slab_object_t *object;
+        unsigned int i;
+
+        pthread_mutex_lock (&class->lock);
+        for (i = 0; i < count; i++)
+        {
+                object = objects[i];
+                object->next = class->free_list;
+                class->free_list = object;
         }
+        pthread_mutex_unlock (&class->lock);
+}
+
+static void
+slab_flush_magazine (void *data)
+{
+        lru_slab_magazine_t *magazine;
+        uint32_t i;
 
-        if (prev_entry_ptr != NULL)
-                *prev_entry_ptr = entry_ptr;
+        magazine = data;
+        for (i = 0; i < LRU_SLAB_CLASSES; i++)
+                slab_push_objects (&slab_classes[i], magazine->objects[i],
+                                   magazine->count[i]);
 
-        return NULL;
+        free (magazine);
 }
 
-static int
-add_to_hash_table (lru_cache_t *cache, lru_node_t *node)
+static void
+slab_init (void)
 {
-        unsigned long hash;
-        lru_hash_entry_t *entry;
+        uint32_t i;
 
-        entry = cache->allocator.malloc_fn (sizeof (lru_hash_entry_t));
-        if (entry == NULL)
-                return LRU_ERROR_NOMEM;
+        for (i = 0; i < LRU_SLAB_CLASSES; i++)
+                pthread_mutex_init (&slab_classes[i].lock, NULL);
 
-        hash = hash_key (cache, node->key, node->key_size);
-        entry->node = node;
-        entry->next = cache->hash_table[hash];
-        cache->hash_table[hash] = entry;
+        pthread_key_create (&slab_magazine_key, slab_flush_magazine);
+}
+
+static lru_slab_magazine_t *
+slab_get_magazine (void)
+{
+        if (LRU_SLAB_MAGAZINE_SIZE == 0)
+                return NULL;
 
-        node->hash_entry = entry;
+        if (slab_magazine == NULL)
+        {
+                slab_magazine = calloc (1, sizeof (lru_slab_magazine_t));
+                if (slab_magazine != NULL)
+                        pthread_setspecific (slab_magazine_key, slab_magazine);
+        }
 
-        return LRU_SUCCESS;
+        return slab_magazine;
 }
 
-static void
-remove_from_hash_table (lru_cache_t *cache, lru_node_t *node)
+static lru_slab_pool_t *
+slab_get_pool (uint32_t index)
 {
-        lru_hash_entry_t **entry_ptr;
-        lru_hash_entry_t *entry;
+        lru_slab_pool_t *pool;
+        uint32_t i;
+
+        pool = __atomic_load_n (&slab_pools[index], __ATOMIC_ACQUIRE);
+        if (pool != NULL)
+                return pool;
 
-        find_in_hash_table (cache, node->key, node->key_size, &entry_ptr);
+        pthread_mutex_lock (&slab_pools_lock);
 
-        if (entry_ptr != NULL && *entry_ptr != NULL)
+        pool = slab_pools[index];
+        if (pool == NULL)
         {
-                entry = *entry_ptr;
-                *entry_ptr = entry->next;
-                cache->allocator.free_fn (entry);
+                pool = calloc (1, sizeof (lru_slab_pool_t));
+                if (pool != NULL)
+                {
+                        for (i = 0; i < LRU_SLAB_CLASSES; i++)
+                                pthread_mutex_init (&pool->classes[i].lock,
+                                                    NULL);
+                        pthread_mutex_init (&pool->lock, NULL);
+                        __atomic_store_n (&slab_pools[index], pool,
+                                          __ATOMIC_RELEASE);
+                }
         }
+
+        pthread_mutex_unlock (&slab_pools_lock);
+
+        return pool;
 }
 
-static int
-evict_lru (lru_cache_t *cache)
+static uint32_t
+slab_class_index (size_t size)
 {
-        lru_node_t *lru_node;
+        uint32_t shift;
+        size_t  step;
 
-        if (cache->tail == NULL)
-                return LRU_ERROR_NOT_FOUND;
+        if (size <= 128)
+                return size == 0 ? 0 : (uint32_t) ((size + 15) / 16 - 1);
 
-        lru_node = cache->tail;
+        shift = 7;
+        while (((size_t) 2 << shift) < size)
+                shift++;
 
-        if (cache->eviction_fn != NULL)
+        step = (size_t) 1 << (shift - 2);
+
+        return 8 + (shift - 7) * 4 +
+                (uint32_t) ((size - ((size_t) 1 << shift) + step - 1) / step) -
+                1;
+}
+
+/* Maps size bytes of zeroed memory (a multiple of the page size)
+ * aligned to align.  With huge set, size is a multiple of
+ * LRU_HUGE_PAGE_SIZE: the explicit huge page pool is tried first and
+ * transparent huge pages are requested otherwise.  Release with
+ * munmap (ptr, size).
+ */
+static void *
+map_aligned (size_t size, size_t align, bool huge)
+{
+        unsigned char *map;
+        unsigned char *base;
+        size_t  length;
+        size_t  head;
+        int     flags;
+
+#ifdef MAP_HUGETLB
+        if (huge && align <= LRU_HUGE_PAGE_SIZE)
         {
-                cache->eviction_fn (lru_node->key, lru_node->key_size,
-                                    lru_node->value, lru_node->value_size,
-                                    cache->eviction_user_data);
+                flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+                flags |= 21 << MAP_HUGE_SHIFT;
+#endif
+                map = mmap (NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+                if (map != MAP_FAILED)
+                        return map;
         }
+#endif
 
-        remove_from_hash_table (cache, lru_node);
-        remove_from_list (cache, lru_node);
+        flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        length = size + align;
+        map = mmap (NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (map == MAP_FAILED)
+                return NULL;
 
-        if (cache->track_stats)
-                cache->stats.evictions++;
+        base = (unsigned char *) (((uintptr_t) map + align - 1) &
+                                  ~((uintptr_t) align - 1));
+        head = (size_t) (base - map);
 
-        cache->size--;
-        destroy_node (cache, lru_node);
+        if (head > 0)
+                munmap (map, head);
+        if (length - head > size)
+                munmap (base + size, length - head - size);
 
-        return LRU_SUCCESS;
+#ifdef MADV_HUGEPAGE
+        if (huge)
+                madvise (base, size, MADV_HUGEPAGE);
+#endif
+
+        return base;
 }
 
-lru_cache_t *
-lru_cache_create (size_t capacity)
+/* Maps size bytes aligned to a chunk for pool index, bound to its node. */
+static void *
+slab_map (size_t size, uint32_t index, bool huge)
 {
-        lru_cache_t *cache = calloc (1, sizeof (lru_cache_t));
+        void   *base;
 
-        if (capacity < LRU_CACHE_MIN_CAPACITY)
-                capacity = LRU_CACHE_DEFAULT_CAPACITY;
+        base = map_aligned (size, huge ? LRU_HUGE_PAGE_SIZE :
+                            LRU_SLAB_CHUNK_SIZE, huge);
+        if (base != NULL && index != LRU_SLAB_HUGE_POOL)
+                numa_bind (base, size, (int) index);
 
-        cache->capacity = capacity;
-        cache->hash_table_size = calculate_hash_table_size (capacity);
+        return base;
+}
+
+static lru_slab_chunk_t *
+slab_new_chunk (uint32_t class_index, uint32_t node)
+{
+        lru_slab_pool_t *pool;
+        lru_slab_chunk_t *chunk;
 
-        cache->hash_table = calloc (cache->hash_table_size,
-                                    sizeof (lru_hash_entry_t *));
-        if (cache->hash_table == NULL)
+        if (node == LRU_SLAB_ANY_NODE)
         {
-                free (cache);
-                return NULL;
+                if (posix_memalign ((void **) &chunk, LRU_SLAB_CHUNK_SIZE,
+                                    LRU_SLAB_CHUNK_SIZE) != 0)
+                        return NULL;
         }
+        else
+        {
+                pool = slab_pools[node];
 
-        cache->allocator.malloc_fn = default_malloc;
-        cache->allocator.free_fn = default_free;
-        cache->allocator.copy_fn = default_copy;
+                pthread_mutex_lock (&pool->lock);
+                if (pool->region == pool->region_end)
+                {
+                        pool->region = slab_map (LRU_SLAB_REGION_SIZE, node,
+                                                 true);
+                        pool->region_end = pool->region == NULL ? NULL :
+                                pool->region + LRU_SLAB_REGION_SIZE;
+                }
+
+                chunk = (lru_slab_chunk_t *) pool->region;
+                if (chunk != NULL)
+                        pool->region += LRU_SLAB_CHUNK_SIZE;
+                pthread_mutex_unlock (&pool->lock);
+
+                if (chunk == NULL)
+                        return NULL;
+        }
+
+        chunk->class_index = class_index;
+        chunk->node = node;
+        chunk->length = LRU_SLAB_CHUNK_SIZE;
+
+        return chunk;
+}
+
+/* Refills the magazine (or hands out one object when there is none) from
+ * the class free list, carving a new chunk when the list is empty.
+ */
+static void *
+slab_refill (lru_slab_class_t *class, uint32_t index, uint32_t node,
+             lru_slab_magazine_t *magazine)
+{
+        lru_slab_chunk_t *chunk;
+        lru_slab_object_t *object;
+        unsigned char *pos;
+        size_t  object_size;
+        unsigned int want;
+
+        object_size = slab_class_sizes[index];
+
+        pthread_mutex_lock (&class->lock);
+
+        if (class->free_list == NULL)
+        {
+                chunk = slab_new_chunk (index, node);
+                if (chunk == NULL)
+                {
+                        pthread_mutex_unlock (&class->lock);
+                        return NULL;
+                }
+
+                for (pos = (unsigned char *) chunk + LRU_SLAB_HEADER_SIZE;
+                     pos + object_size <= (unsigned char *) chunk +
+                     LRU_SLAB_CHUNK_SIZE; pos += object_size)
+                {
+                        object = (lru_slab_object_t *) pos;
+                        object->next = class->free_list;
+                        class->free_list = object;
+                }
+        }
+
+        object = class->free_list;
+        class->free_list = object->next;
+
+        want = LRU_SLAB_MAGAZINE_SIZE / 2;
+        while (magazine != NULL && want-- > 0 && class->free_list != NULL)
+        {
+                magazine->objects[index][magazine->count[index]++] =
+                        class->free_list;
+                class->free_list = class->free_list->next;
+        }
+
+        pthread_mutex_unlock (&class->lock);
+
+        return object;
+}
+
+static void *
+slab_malloc (size_t size)
+{
+        lru_slab_magazine_t *magazine;
+        lru_slab_chunk_t *chunk;
+        uint32_t index;
+
+        pthread_once (&slab_once, slab_init);
+
+        if (size > LRU_SLAB_MAX_OBJECT)
+        {
+                if (posix_memalign ((void **) &chunk, LRU_SLAB_CHUNK_SIZE,
+                                    LRU_SLAB_HEADER_SIZE + size) != 0)
+                        return NULL;
+
+                chunk->class_index = LRU_SLAB_LARGE_CLASS;
+                chunk->node = LRU_SLAB_ANY_NODE;
+                return (unsigned char *) chunk + LRU_SLAB_HEADER_SIZE;
+        }
+
+        index = slab_class_index (size);
+        magazine = slab_get_magazine ();
+
+        if (magazine != NULL && magazine->count[index] > 0)
+                return magazine->objects[index][--magazine->count[index]];
+
+        return slab_refill (&slab_classes[index], index, LRU_SLAB_ANY_NODE,
+                            magazine);
+}
+
+static void *
+slab_pool_malloc (uint32_t index, size_t size)
+{
+        lru_slab_pool_t *pool;
+        lru_slab_chunk_t *chunk;
+        size_t  page;
+        size_t  length;
+        uint32_t class_index;
+
+        if (size > LRU_SLAB_MAX_OBJECT)
+        {
+                page = (size_t) sysconf (_SC_PAGESIZE);
+                length = (LRU_SLAB_HEADER_SIZE + size + page - 1) &
+                        ~(page - 1);
+
+                chunk = slab_map (length, index, false);
+                if (chunk == NULL)
+                        return NULL;
+
+                chunk->class_index = LRU_SLAB_LARGE_CLASS;
+                chunk->node = index;
+                chunk->length = length;
+                return (unsigned char *) chunk + LRU_SLAB_HEADER_SIZE;
+        }
+
+        pool = slab_get_pool (index);
+        if (pool == NULL)
+                return NULL;
+
+        class_index = slab_class_index (size);
+
+        return slab_refill (&pool->classes[class_index], class_index, index,
+                            NULL);
+}
+
+static void
+slab_free (void *ptr)
+{
+        lru_slab_magazine_t *magazine;
+        lru_slab_chunk_t *chunk;
+        uint32_t index;
+        unsigned int half;
+
+        if (ptr == NULL)
+                return;
+
+        chunk = (lru_slab_chunk_t *) ((uintptr_t) ptr &
+                                      ~((uintptr_t) LRU_SLAB_CHUNK_SIZE - 1));
+        index = chunk->class_index;
+
+        if (chunk->node != LRU_SLAB_ANY_NODE)
+        {
+                if (index == LRU_SLAB_LARGE_CLASS)
+                        munmap (chunk, chunk->length);
+                else
+                        slab_push_objects (&slab_pools[chunk->node]->
+                                           classes[index], &ptr, 1);
+                return;
+        }
+
+        if (index == LRU_SLAB_LARGE_CLASS)
+        {
+                free (chunk);
+                return;
+        }
+
+        magazine = slab_get_magazine ();
+        if (magazine == NULL)
+        {
+                slab_push_objects (&slab_classes[index], &ptr, 1);
+                return;
+        }
+
+        if (magazine->count[index] == LRU_SLAB_MAGAZINE_SIZE)
+        {
+                half = LRU_SLAB_MAGAZINE_SIZE / 2;
+                magazine->count[index] -= half;
+                slab_push_objects (&slab_classes[index],
+                                   &magazine->objects[index]
+                                   [magazine->count[index]], half);
+        }
+
+        magazine->objects[index][magazine->count[index]++] = ptr;
+}
+
+/* Only the node hooks are set: copies returned by lru_cache_get() and
+ * friends keep coming from copy_fn, so callers can still free() them.
+ */
+static const lru_allocator_t slab_allocator = {
+        slab_malloc,
+        slab_free,
+        NULL,
+        NULL
+};
+
+/* Pass to lru_cache_set_allocator() to allocate nodes (and, with
+ * LRU_CACHE_FLAG_INLINE_NODES, their keys and values) from the
+ * process-wide slab allocator.
+ */
+const lru_allocator_t *
+lru_slab_allocator (void)
+{
+        return &slab_allocator;
+}
+
+int
+lru_numa_node_count (void)
+{
+        return (int) numa_node_count ();
+}
+
+int
+lru_numa_current_node (void)
+{
+        return numa_current_node ();
+}
+
+/* Restricts the calling thread to the CPUs of node, so that threads
+ * serving the keys of a node's shards run next to them.
+ */
+int
+lru_numa_bind_thread (int node)
+{
+        unsigned long cpus[LRU_NUMA_MASK_WORDS (LRU_NUMA_MAX_CPUS)];
+        char    path[64];
+
+        if (node < 0 || node >= LRU_NUMA_MAX_NODES)
+                return LRU_ERROR_INVALID_ARG;
+
+        snprintf (path, sizeof (path),
+                  "/sys/devices/system/node/node%d/cpulist", node);
+        if (numa_read_list (path, cpus, LRU_NUMA_MAX_CPUS) != LRU_SUCCESS)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (syscall (SYS_sched_setaffinity, 0, sizeof (cpus), cpus) != 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return LRU_SUCCESS;
+}
+
+/* Folded 64x64->128 bit multiply, the mixing step of wyhash-style
+ * hashes.
+ */
+static uint64_t
+hash_mix (uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+        __uint128_t product;
+
+        product = (__uint128_t) a * b;
+
+        return (uint64_t) product ^ (uint64_t) (product >> 64);
+#else
+        uint64_t lo;
+        uint64_t mid;
+        uint64_t hi;
+        uint64_t cross;
+
+        lo = (a & 0xffffffffULL) * (b & 0xffffffffULL);
+        mid = (a >> 32) * (b & 0xffffffffULL);
+        cross = (a & 0xffffffffULL) * (b >> 32);
+        hi = (a >> 32) * (b >> 32);
+
+        cross += (lo >> 32) + (mid & 0xffffffffULL);
+        hi += (mid >> 32) + (cross >> 32);
+        lo = (cross << 32) | (lo & 0xffffffffULL);
+
+        return lo ^ hi;
+#endif
+}
+
+static uint64_t
+read_u64 (const unsigned char *ptr)
+{
+        uint64_t value;
+
+        memcpy (&value, ptr, sizeof (value));
+
+        return value;
+}
+
+static uint64_t
+read_u32 (const unsigned char *ptr)
+{
+        uint32_t value;
+
+        memcpy (&value, ptr, sizeof (value));
+
+        return value;
+}
+
+/* Word-at-a-time hash in the style of wyhash: 16 bytes per multiply,
+ * with the tail read as overlapping words instead of byte by byte.
+ */
+static unsigned long
+default_hash (const void *key, size_t key_size)
+{
+        const unsigned char *ptr;
+        uint64_t seed;
+        uint64_t a;
+        uint64_t b;
+        size_t  remaining;
+
+        ptr = (const unsigned char *) key;
+        seed = LRU_HASH_SEED ^ hash_mix (LRU_HASH_SEED ^ key_size,
+                                         LRU_HASH_PRIME1);
+
+        if (key_size <= 16)
+        {
+                if (key_size >= 8)
+                {
+                        a = read_u64 (ptr);
+                        b = read_u64 (ptr + key_size - 8);
+                }
+                else if (key_size >= 4)
+                {
+                        a = read_u32 (ptr);
+                        b = read_u32 (ptr + key_size - 4);
+                }
+                else if (key_size > 0)
+                {
+                        a = ((uint64_t) ptr[0] << 16) |
+                                ((uint64_t) ptr[key_size >> 1] << 8) |
+                                ptr[key_size - 1];
+                        b = 0;
+                }
+                else
+                {
+                        a = 0;
+                        b = 0;
+                }
+        }
+        else
+        {
+                remaining = key_size;
+                while (remaining > 16)
+                {
+                        seed = hash_mix (read_u64 (ptr) ^ LRU_HASH_PRIME1,
+                                         read_u64 (ptr + 8) ^ seed);
+                        ptr += 16;
+                        remaining -= 16;
+                }
+
+                a = read_u64 (ptr + remaining - 16);
+                b = read_u64 (ptr + remaining - 8);
+        }
+
+        return (unsigned long)
+                hash_mix (LRU_HASH_PRIME1 ^ key_size,
+                          hash_mix (a ^ LRU_HASH_PRIME1, b ^ seed));
+}
+
+static int
+default_compare (const void *key1, size_t size1,
+                 const void *key2, size_t size2)
+{
+        if (size1 != size2)
+                return (int) (size1 - size2);
+
+        return memcmp (key1, key2, size1);
+}
+
+static size_t
+calculate_hash_table_size (size_t capacity)
+{
+        size_t  size;
+
+        size = (size_t) (capacity / LRU_CACHE_LOAD_FACTOR);
+
+        size--;
+        size |= size >> 1;
+        size |= size >> 2;
+        size |= size >> 4;
+        size |= size >> 8;
+        size |= size >> 16;
+#if SIZE_MAX > 0xffffffffUL
+        size |= size >> 32;
+#endif
+        size++;
+
+        if (size < LRU_CACHE_MIN_TABLE_SIZE)
+                size = LRU_CACHE_MIN_TABLE_SIZE;
+
+        return size;
+}
+
+static size_t
+inline_value_offset (size_t key_size)
+{
+        return (key_size + LRU_CACHE_INLINE_ALIGN - 1) &
+                ~(LRU_CACHE_INLINE_ALIGN - 1);
+}
+
+/* Node memory of a cache bound to a NUMA node or backed by huge pages
+ * comes from the matching slab pool as long as the slab allocator is
+ * still in place.
+ */
+static void *
+alloc_node_memory (lru_cache_t *cache, size_t size)
+{
+        if (cache->allocator.malloc_fn == slab_malloc)
+        {
+                if (cache->numa_node != LRU_NUMA_NO_NODE)
+                        return slab_pool_malloc ((uint32_t) cache->numa_node,
+                                                 size);
+                if (cache->huge_pages)
+                        return slab_pool_malloc (LRU_SLAB_HUGE_POOL, size);
+        }
+
+        return cache->allocator.malloc_fn (size);
+}
+
+static lru_node_t *
+create_inline_node (lru_cache_t *cache, const void *key, size_t key_size,
+                    const void *value, size_t value_size)
+{
+        lru_node_t *node;
+        size_t  value_offset;
+
+        value_offset = inline_value_offset (key_size);
+
+        node = alloc_node_memory (cache, sizeof (lru_node_t) +
+                                  value_offset + value_size);
+        if (node == NULL)
+                return NULL;
+
+        node->key = node->data;
+        node->value = node->data + value_offset;
+        memcpy (node->key, key, key_size);
+        memcpy (node->value, value, value_size);
+
+        node->inline_data = true;
+        node->data_capacity = value_offset + value_size;
+
+        return node;
+}
+
+/* A custom copy_fn may do more than duplicate bytes, so inline nodes and
+ * buffer reuse are only used with the built-in ones.
+ */
+static bool
+bytewise_copy (lru_cache_t *cache)
+{
+        return cache->allocator.copy_fn == default_copy;
+}
+
+static void
+init_node (lru_node_t *node, size_t key_size, size_t value_size)
+{
+        node->key_size = key_size;
+        node->value_size = value_size;
+        node->prev = NULL;
+        node->next = NULL;
+        node->hash_entry.node = node;
+        node->hash_entry.next = NULL;
+        node->hash_entry.pprev = NULL;
+        node->refcount = 1;
+        node->accessed = false;
+        node->timer_slot = LRU_TIMER_NONE;
+        node->expires_at = 0;
+        node->raw_size = 0;
+        node->inflated = NULL;
+}
+
+static lru_node_t *
+create_node (lru_cache_t *cache, const void *key, size_t key_size,
+             const void *value, size_t value_size)
+{
+        lru_node_t *node;
+
+        if (cache->inline_nodes && bytewise_copy (cache))
+        {
+                node = create_inline_node (cache, key, key_size, value,
+                                           value_size);
+                if (node != NULL)
+                        init_node (node, key_size, value_size);
+
+                return node;
+        }
+
+        node = alloc_node_memory (cache, sizeof (lru_node_t));
+        if (node == NULL)
+                return NULL;
+
+        node->key = cache->allocator.copy_fn (key, key_size);
+        if (node->key == NULL)
+        {
+                cache->allocator.free_fn (node);
+                return NULL;
+        }
+
+        node->value = cache->allocator.copy_fn (value, value_size);
+        if (node->value == NULL)
+        {
+                cache->allocator.destroy_fn (node->key);
+                cache->allocator.free_fn (node);
+                return NULL;
+        }
+
+        node->inline_data = false;
+        init_node (node, key_size, value_size);
+
+        return node;
+}
+
+/* Nodes and tier entries holding a compressed value are counted, since
+ * the hooks may only change while none is left to decompress.  Nodes
+ * are released outside the lock, hence the atomics.
+ */
+static void
+set_raw_size (lru_cache_t *cache, lru_node_t *node, size_t raw_size)
+{
+        if (node->raw_size != 0)
+                __atomic_sub_fetch (&cache->compressed_values, 1,
+                                    __ATOMIC_RELAXED);
+        if (raw_size != 0)
+                __atomic_add_fetch (&cache->compressed_values, 1,
+                                    __ATOMIC_RELAXED);
+
+        node->raw_size = raw_size;
+}
+
+static void
+destroy_node (lru_cache_t *cache, lru_node_t *node)
+{
+        if (node == NULL)
+                return;
+
+        set_raw_size (cache, node, 0);
+
+        if (!node->inline_data)
+        {
+                if (node->key != NULL)
+                        cache->allocator.destroy_fn (node->key);
+
+                if (node->value != NULL)
+                        cache->allocator.destroy_fn (node->value);
+        }
+
+        free (node->inflated);
+        cache->allocator.free_fn (node);
+}
+
+/* Internal buffers are malloc()ed; callers release what they are given
+ * with destroy_fn, so with a custom copy_fn they get a copy of their own.
+ */
+static void *
+hand_out_value (lru_cache_t *cache, void *buffer, size_t size)
+{
+        void   *copy;
+
+        if (bytewise_copy (cache))
+                return buffer;
+
+        copy = cache->allocator.copy_fn (buffer, size);
+        free (buffer);
+
+        return copy;
+}
+
+/* The compression hooks as one put saw them. */
+typedef struct lru_compression
+{
+        lru_compress_fn compress_fn;
+        size_t  threshold;
+        void   *user_data;
+        unsigned long generation;
+} lru_compression_t;
+
+/* With the cache lock held. */
+static void
+current_compression (lru_cache_t *cache, lru_compression_t *hooks)
+{
+        hooks->compress_fn = cache->compress_fn;
+        hooks->threshold = cache->compress_threshold;
+        hooks->user_data = cache->compress_user_data;
+        hooks->generation = cache->compress_generation;
+}
+
+/* Copies the hooks for compressing before the write lock is taken; the
+ * caller re-checks the generation once it holds the lock.  The setter
+ * publishes compress_fn before the generation, so a cache without
+ * compression is seen as such without taking the lock.
+ */
+static void
+snapshot_compression (lru_cache_t *cache, lru_compression_t *hooks)
+{
+        hooks->generation = __atomic_load_n (&cache->compress_generation,
+                                             __ATOMIC_ACQUIRE);
+        hooks->compress_fn = __atomic_load_n (&cache->compress_fn,
+                                              __ATOMIC_ACQUIRE);
+        if (hooks->compress_fn == NULL)
+                return;
+
+        if (!cache->thread_safe)
+        {
+                current_compression (cache, hooks);
+                return;
+        }
+
+        if (pthread_rwlock_rdlock (&cache->lock) != 0)
+        {
+                hooks->compress_fn = NULL;
+                return;
+        }
+
+        current_compression (cache, hooks);
+        pthread_rwlock_unlock (&cache->lock);
+}
+
+/* Returns a malloc()ed compressed copy of a value at or above the
+ * threshold, or NULL to store it as it is.  Compression has to save at
+ * least a byte to be kept.
+ */
+static void *
+compress_value (const lru_compression_t *hooks, const void *value,
+                size_t value_size, size_t *compressed_size)
+{
+        void   *buffer;
+        size_t  size;
+
+        if (hooks->compress_fn == NULL ||
+            value_size < hooks->threshold || value_size < 2)
+                return NULL;
+
+        buffer = malloc (value_size - 1);
+        if (buffer == NULL)
+                return NULL;
+
+        size = hooks->compress_fn (value, value_size, buffer, value_size - 1,
+                                   hooks->user_data);
+        if (size == 0 || size >= value_size)
+        {
+                free (buffer);
+                return NULL;
+        }
+
+        *compressed_size = size;
+
+        return buffer;
+}
+
+static void *
+decompress_value (lru_cache_t *cache, const void *data, size_t size,
+                  size_t raw_size)
+{
+        void   *buffer;
+
+        buffer = malloc (raw_size);
+        if (buffer == NULL)
+                return NULL;
+
+        if (cache->decompress_fn (data, size, buffer, raw_size,
+                                  cache->compress_user_data) != raw_size)
+        {
+                free (buffer);
+                return NULL;
+        }
+
+        return buffer;
+}
+
+/* The caller's copy of a node's value, decompressed if need be. */
+static int
+copy_value (lru_cache_t *cache, const lru_node_t *node, void **value,
+            size_t *value_size)
+{
+        void   *buffer;
+
+        if (node->raw_size == 0)
+        {
+                *value = cache->allocator.copy_fn (node->value,
+                                                   node->value_size);
+                if (*value == NULL)
+                        return LRU_ERROR_NOMEM;
+
+                if (value_size != NULL)
+                        *value_size = node->value_size;
+
+                return LRU_SUCCESS;
+        }
+
+        buffer = decompress_value (cache, node->value, node->value_size,
+                                   node->raw_size);
+        if (buffer == NULL)
+                return LRU_ERROR_NOMEM;
+
+        *value = hand_out_value (cache, buffer, node->raw_size);
+        if (*value == NULL)
+                return LRU_ERROR_NOMEM;
+
+        if (value_size != NULL)
+                *value_size = node->raw_size;
+
+        return LRU_SUCCESS;
+}
+
+/* The node's value as stored, or a malloc()ed decompressed copy that the
+ * caller frees; NULL if that copy cannot be made.
+ */
+static void *
+raw_value (lru_cache_t *cache, const lru_node_t *node)
+{
+        if (node->raw_size == 0)
+                return node->value;
+
+        return decompress_value (cache, node->value, node->value_size,
+                                 node->raw_size);
+}
+
+static size_t
+raw_value_size (const lru_node_t *node)
+{
+        return node->raw_size != 0 ? node->raw_size : node->value_size;
+}
+
+/* Threads are dealt stripes round-robin on first use, which spreads them
+ * better than hashing thread ids would.
+ */
+static unsigned int
+thread_stripe_index (void)
+{
+        static unsigned int next_stripe;
+        static _Thread_local unsigned int stripe;
+
+        if (stripe == 0)
+                stripe = __atomic_add_fetch (&next_stripe, 1,
+                                             __ATOMIC_RELAXED);
+
+        return stripe;
+}
+
+/* Epoch-based reclamation for lock-free readers.  A reader counts itself
+ * in the stripe slot of the epoch it saw and re-checks the epoch, so it
+ * can only hold up the advance to the epoch after next.
+ */
+static unsigned long *
+reader_enter (lru_cache_t *cache)
+{
+        lru_reader_stripe_t *stripe;
+        unsigned long *active;
+        unsigned long epoch;
+
+        stripe = &cache->readers[thread_stripe_index () %
+                                 LRU_CACHE_READER_STRIPES];
+
+        for (;;)
+        {
+                epoch = __atomic_load_n (&cache->epoch, __ATOMIC_SEQ_CST);
+                active = &stripe->active[epoch & 1];
+
+                __atomic_add_fetch (active, 1, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n (&cache->epoch, __ATOMIC_SEQ_CST) ==
+                    epoch)
+                        return active;
+
+                __atomic_sub_fetch (active, 1, __ATOMIC_RELEASE);
+        }
+}
+
+static void
+reader_exit (unsigned long *active)
+{
+        __atomic_sub_fetch (active, 1, __ATOMIC_RELEASE);
+}
+
+static bool
+readers_drained (lru_cache_t *cache, unsigned int parity)
+{
+        size_t  i;
+
+        for (i = 0; i < LRU_CACHE_READER_STRIPES; i++)
+        {
+                if (__atomic_load_n (&cache->readers[i].active[parity],
+                                     __ATOMIC_ACQUIRE) != 0)
+                        return false;
+        }
+
+        return true;
+}
+
+static void
+free_retired (lru_cache_t *cache, unsigned int parity)
+{
+        lru_node_t *node;
+
+        while ((node = cache->retired[parity]) != NULL)
+        {
+                cache->retired[parity] = node->next;
+                destroy_node (cache, node);
+                cache->retired_count--;
+        }
+}
+
+/* Nodes retired two epochs ago share the parity of the next epoch; once
+ * no reader is counted there they are unreachable and can be freed.
+ * Called with the write lock held.
+ */
+static bool
+advance_epoch (lru_cache_t *cache)
+{
+        unsigned int next;
+
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+        next = (cache->epoch + 1) & 1;
+        if (!readers_drained (cache, next))
+                return false;
+
+        free_retired (cache, next);
+        __atomic_store_n (&cache->epoch, cache->epoch + 1, __ATOMIC_SEQ_CST);
+
+        return true;
+}
+
+/* Waits until every reader that might still see an unpublished table has
+ * left; only used for the rare table swaps.
+ */
+static void
+synchronize_readers (lru_cache_t *cache)
+{
+        int     i;
+
+        for (i = 0; i < 2; i++)
+        {
+                while (!advance_epoch (cache))
+                        sched_yield ();
+        }
+}
+
+static void
+retire_node (lru_cache_t *cache, lru_node_t *node)
+{
+        unsigned int parity;
+
+        parity = cache->epoch & 1;
+        node->next = cache->retired[parity];
+        cache->retired[parity] = node;
+
+        if (++cache->retired_count >= LRU_CACHE_RETIRE_BATCH)
+                advance_epoch (cache);
+}
+
+/* Lock-free readers may still be looking at an unlinked node, so in that
+ * mode it is retired instead of freed.  Called with the write lock held.
+ */
+static void
+free_node (lru_cache_t *cache, lru_node_t *node)
+{
+        if (cache->lockfree_reads)
+                retire_node (cache, node);
+        else
+                destroy_node (cache, node);
+}
+
+/* The cache holds one reference for as long as the node is linked and
+ * every lru_cache_acquire() holds another, so a node that is evicted,
+ * deleted or replaced while acquired is freed by its last release.
+ */
+static void
+unref_node (lru_cache_t *cache, lru_node_t *node)
+{
+        if (__atomic_sub_fetch (&node->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+                free_node (cache, node);
+}
+
+static bool
+node_pinned (lru_node_t *node)
+{
+        return __atomic_load_n (&node->refcount, __ATOMIC_ACQUIRE) > 1;
+}
+
+/* Threads sharing a stripe still count atomically, but the line is
+ * rarely contended.
+ */
+static void
+count_stat (lru_cache_t *cache, lru_stat_t counter)
+{
+        lru_stat_stripe_t *stripe;
+
+        if (!cache->track_stats)
+                return;
+
+        stripe = &cache->stat_stripes[thread_stripe_index () %
+                                      LRU_CACHE_STAT_STRIPES];
+        __atomic_add_fetch (&stripe->counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+sum_stat (lru_cache_t *cache, lru_stat_t counter)
+{
+        uint64_t total;
+        size_t  i;
+
+        total = 0;
+        for (i = 0; i < LRU_CACHE_STAT_STRIPES; i++)
+                total += __atomic_load_n (&cache->stat_stripes[i].
+                                          counters[counter],
+                                          __ATOMIC_RELAXED);
+
+        return total;
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Start of a timed section, 0 when latency stats are off. */
+static uint64_t
+latency_start (lru_cache_t *cache)
+{
+        return cache->latency != NULL ? monotonic_ns () : 0;
+}
+
+static size_t
+histogram_bucket (uint64_t value)
+{
+        unsigned int bits;
+
+        if (value >= 1ULL << LRU_HIST_MAX_BITS)
+                value = (1ULL << LRU_HIST_MAX_BITS) - 1;
+
+        if (value < LRU_HIST_SUB)
+                return value;
+
+        bits = 63 - __builtin_clzll (value);
+
+        return (bits - LRU_HIST_SUB_BITS + 1) * LRU_HIST_SUB +
+                ((value >> (bits - LRU_HIST_SUB_BITS)) & (LRU_HIST_SUB - 1));
+}
+
+static uint64_t
+histogram_value (size_t bucket)
+{
+        unsigned int shift;
+
+        if (bucket < LRU_HIST_SUB)
+                return bucket;
+
+        shift = bucket / LRU_HIST_SUB - 1;
+
+        return ((uint64_t) (LRU_HIST_SUB + bucket % LRU_HIST_SUB) << shift) +
+                (1ULL << shift) - 1;
+}
+
+static void
+record_latency (lru_cache_t *cache, lru_latency_op_t op, uint64_t start)
+{
+        lru_histogram_t *histogram;
+        uint64_t elapsed;
+
+        if (start == 0)
+                return;
+
+        elapsed = monotonic_ns () - start;
+        histogram = &cache->latency[thread_stripe_index () %
+                                    LRU_CACHE_STAT_STRIPES].ops[op];
+
+        __atomic_add_fetch (&histogram->total_ns, elapsed, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&histogram->buckets[histogram_bucket (elapsed)], 1,
+                            __ATOMIC_RELAXED);
+}
+
+/* Takes the cache lock, timing the wait when latency stats are on. */
+static int
+lock_cache (lru_cache_t *cache, bool write)
+{
+        uint64_t start;
+        int     result;
+
+        if (!cache->thread_safe)
+                return LRU_SUCCESS;
+
+        start = latency_start (cache);
+
+        if (write)
+                result = pthread_rwlock_wrlock (&cache->lock);
+        else
+                result = pthread_rwlock_rdlock (&cache->lock);
+
+        if (result != 0)
+                return LRU_ERROR_LOCK;
+
+        record_latency (cache, LRU_LATENCY_LOCK_WAIT, start);
+
+        return LRU_SUCCESS;
+}
+
+static void *
+reuse_buffer (lru_cache_t *cache, void *buffer, size_t size, size_t new_size,
+              const void *data)
+{
+        void   *copy;
+
+        if (size == new_size && bytewise_copy (cache))
+        {
+                memcpy (buffer, data, new_size);
+                return buffer;
+        }
+
+        copy = cache->allocator.copy_fn (data, new_size);
+        if (copy != NULL)
+                cache->allocator.destroy_fn (buffer);
+
+        return copy;
+}
+
+/* Turns an evicted node into the node for a new entry, so a cache at
+ * capacity with same-sized entries makes no allocator calls on insert.
+ */
+static lru_node_t *
+recycle_node (lru_cache_t *cache, lru_node_t *node, const void *key,
+              size_t key_size, const void *value, size_t value_size)
+{
+        size_t  value_offset;
+        void   *buffer;
+
+        set_raw_size (cache, node, 0);
+        free (node->inflated);
+        node->inflated = NULL;
+
+        if (node->inline_data)
+        {
+                value_offset = inline_value_offset (key_size);
+
+                if (!cache->inline_nodes || !bytewise_copy (cache) ||
+                    value_offset + value_size > node->data_capacity)
+                        goto replace;
+
+                node->value = node->data + value_offset;
+                memcpy (node->key, key, key_size);
+                memcpy (node->value, value, value_size);
+
+                init_node (node, key_size, value_size);
+                return node;
+        }
+
+        if (cache->inline_nodes && bytewise_copy (cache))
+                goto replace;
+
+        buffer = reuse_buffer (cache, node->key, node->key_size, key_size,
+                               key);
+        if (buffer == NULL)
+                goto replace;
+        node->key = buffer;
+        node->key_size = key_size;
+
+        buffer = reuse_buffer (cache, node->value, node->value_size,
+                               value_size, value);
+        if (buffer == NULL)
+                goto replace;
+        node->value = buffer;
+
+        init_node (node, key_size, value_size);
+        return node;
+
+      replace:
+        destroy_node (cache, node);
+        return create_node (cache, key, key_size, value, value_size);
+}
+
+/* Builds a node around caller-allocated buffers instead of copying them.
+ * A victim with separate buffers gives up only those and keeps serving
+ * as the node.
+ */
+static lru_node_t *
+adopt_node (lru_cache_t *cache, lru_node_t *node, void *key,
+            size_t key_size, void *value, size_t value_size)
+{
+        if (node != NULL && node->inline_data)
+        {
+                destroy_node (cache, node);
+                node = NULL;
+        }
+
+        if (node != NULL)
+        {
+                set_raw_size (cache, node, 0);
+                cache->allocator.destroy_fn (node->key);
+                cache->allocator.destroy_fn (node->value);
+                free (node->inflated);
+        }
+        else
+        {
+                node = alloc_node_memory (cache, sizeof (lru_node_t));
+                if (node == NULL)
+                        return NULL;
+        }
+
+        node->key = key;
+        node->value = value;
+        node->inline_data = false;
+        init_node (node, key_size, value_size);
+
+        return node;
+}
+
+/* Window and protected each end at a tracked node; probation ends at the
+ * list tail.
+ */
+static lru_node_t **
+segment_tail (lru_cache_t *cache, unsigned int segment)
+{
+        if (segment == LRU_SEGMENT_WINDOW)
+                return &cache->window_tail;
+
+        if (segment == LRU_SEGMENT_PROTECTED)
+                return &cache->protected_tail;
+
+        return NULL;
+}
+
+/* The node a segment's new head is linked after, NULL for the list head. */
+static lru_node_t *
+segment_anchor (lru_cache_t *cache, unsigned int segment)
+{
+        if (segment == LRU_SEGMENT_WINDOW)
+                return NULL;
+
+        if (segment == LRU_SEGMENT_PROBATION && cache->protected_tail != NULL)
+                return cache->protected_tail;
+
+        return cache->window_tail;
+}
+
+static void
+remove_from_list (lru_cache_t *cache, lru_node_t *node)
+{
+        lru_node_t **tail;
+
+        tail = segment_tail (cache, node->segment);
+        if (tail != NULL && *tail == node)
+                *tail = cache->segment_size[node->segment] > 1 ?
+                        node->prev : NULL;
+        cache->segment_size[node->segment]--;
+
+        if (node->prev != NULL)
+                node->prev->next = node->next;
+        else
+                cache->head = node->next;
+
+        if (node->next != NULL)
+                node->next->prev = node->prev;
+        else
+                cache->tail = node->prev;
+}
+
+static void
+add_to_front (lru_cache_t *cache, lru_node_t *node)
+{
+        node->next = cache->head;
+        node->prev = NULL;
+
+        if (cache->head != NULL)
+                cache->head->prev = node;
+
+        cache->head = node;
+
+        if (cache->tail == NULL)
+                cache->tail = node;
+}
+
+static void
+insert_after (lru_cache_t *cache, lru_node_t *anchor, lru_node_t *node)
+{
+        if (anchor == NULL)
+        {
+                add_to_front (cache, node);
+                return;
+        }
+
+        node->prev = anchor;
+        node->next = anchor->next;
+
+        if (anchor->next != NULL)
+                anchor->next->prev = node;
+        else
+                cache->tail = node;
+
+        anchor->next = node;
+}
+
+/* Joins the list at the LRU end, as restored entries do since they are
+ * older than anything already cached.
+ */
+static void
+append_node (lru_cache_t *cache, lru_node_t *node)
+{
+        insert_after (cache, cache->tail, node);
+
+        node->segment = LRU_SEGMENT_PROBATION;
+        cache->segment_size[LRU_SEGMENT_PROBATION]++;
+}
+
+static void
+enter_segment (lru_cache_t *cache, lru_node_t *node, unsigned int segment)
+{
+        lru_node_t **tail;
+
+        insert_after (cache, segment_anchor (cache, segment), node);
+
+        node->segment = segment;
+        cache->segment_size[segment]++;
+
+        tail = segment_tail (cache, segment);
+        if (tail != NULL && *tail == NULL)
+                *tail = node;
+}
+
+/* Moves node to the head of segment; for plain LRU this is the old
+ * move_to_front().
+ */
+static void
+move_to_segment (lru_cache_t *cache, lru_node_t *node, unsigned int segment)
+{
+        if (node->segment == segment &&
+            node->prev == segment_anchor (cache, segment))
+                return;
+
+        remove_from_list (cache, node);
+        enter_segment (cache, node, segment);
+}
+
+static size_t
+segment_limit (lru_cache_t *cache, unsigned int percent)
+{
+        size_t  entries;
+
+        entries = cache->byte_capacity ? cache->size : cache->capacity;
+        entries = entries * percent / 100;
+
+        return entries > 0 ? entries : 1;
+}
+
+/* Count-Min sketch of access frequencies: LRU_SKETCH_DEPTH rows of
+ * saturating counters, all halved every LRU_SKETCH_SAMPLE_FACTOR * width
+ * additions so old popularity ages out.
+ */
+static size_t
+sketch_index (lru_cache_t *cache, unsigned long hash, unsigned int row)
+{
+        static const uint64_t seeds[LRU_SKETCH_DEPTH] = {
+                0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+                0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+        };
+        uint64_t mixed;
+
+        mixed = ((uint64_t) hash ^ (hash >> 29)) * seeds[row];
+
+        return row * cache->sketch_width +
+                ((size_t) (mixed >> 32) & (cache->sketch_width - 1));
+}
+
+static void
+record_access (lru_cache_t *cache, unsigned long hash)
+{
+        unsigned char *counter;
+        unsigned int row;
+        size_t  i;
+
+        if (!cache->tinylfu)
+                return;
+
+        for (row = 0; row < LRU_SKETCH_DEPTH; row++)
+        {
+                counter = &cache->sketch[sketch_index (cache, hash, row)];
+                if (*counter < LRU_SKETCH_MAX_COUNT)
+                        (*counter)++;
+        }
+
+        if (++cache->sketch_additions <
+            LRU_SKETCH_SAMPLE_FACTOR * cache->sketch_width)
+                return;
+
+        for (i = 0; i < LRU_SKETCH_DEPTH * cache->sketch_width; i++)
+                cache->sketch[i] >>= 1;
+        cache->sketch_additions /= 2;
+}
+
+static unsigned int
+sketch_frequency (lru_cache_t *cache, unsigned long hash)
+{
+        unsigned int frequency;
+        unsigned int count;
+        unsigned int row;
+
+        frequency = LRU_SKETCH_MAX_COUNT;
+        for (row = 0; row < LRU_SKETCH_DEPTH; row++)
+        {
+                count = cache->sketch[sketch_index (cache, hash, row)];
+                if (count < frequency)
+                        frequency = count;
+        }
+
+        return frequency;
+}
+
+/* Segmented LRU: a hit in probation earns a place in protected, whose
+ * overflow falls back to the head of probation, so a scan of one-hit keys
+ * only ever cycles through probation.
+ */
+static void
+promote_node (lru_cache_t *cache, lru_node_t *node)
+{
+        if (!cache->segmented || node->segment == LRU_SEGMENT_WINDOW)
+        {
+                move_to_segment (cache, node, node->segment);
+                return;
+        }
+
+        move_to_segment (cache, node, LRU_SEGMENT_PROTECTED);
+
+        while (cache->segment_size[LRU_SEGMENT_PROTECTED] >
+               segment_limit (cache, LRU_CACHE_PROTECTED_PERCENT))
+                move_to_segment (cache, cache->protected_tail,
+                                 LRU_SEGMENT_PROBATION);
+}
+
+/* New entries start in the window under W-TinyLFU and in probation
+ * otherwise.  The window only overflows into probation here while the
+ * cache is filling; once full, admit_candidate() decides.
+ */
+static void
+insert_node (lru_cache_t *cache, lru_node_t *node)
+{
+        if (!cache->tinylfu)
+        {
+                enter_segment (cache, node, LRU_SEGMENT_PROBATION);
+                return;
+        }
+
+        enter_segment (cache, node, LRU_SEGMENT_WINDOW);
+
+        while (cache->segment_size[LRU_SEGMENT_WINDOW] >
+               segment_limit (cache, LRU_CACHE_WINDOW_PERCENT))
+                move_to_segment (cache, cache->window_tail,
+                                 LRU_SEGMENT_PROBATION);
+}
+
+/* W-TinyLFU admission: with the window full, the entry about to leave it
+ * only enters the main cache if the sketch has seen it more often than
+ * the main victim; otherwise it is the one evicted.
+ */
+static lru_node_t *
+admit_candidate (lru_cache_t *cache, lru_node_t *victim)
+{
+        lru_node_t *candidate;
+
+        candidate = cache->window_tail;
+
+        if (candidate == NULL || candidate == victim ||
+            victim->segment == LRU_SEGMENT_WINDOW ||
+            cache->segment_size[LRU_SEGMENT_WINDOW] <
+            segment_limit (cache, LRU_CACHE_WINDOW_PERCENT) ||
+            node_pinned (candidate))
+                return victim;
+
+        if (sketch_frequency (cache, candidate->hash) >
+            sketch_frequency (cache, victim->hash))
+        {
+                move_to_segment (cache, candidate, LRU_SEGMENT_PROBATION);
+                return victim;
+        }
+
+        return candidate;
+}
+
+/* Table sizes are powers of two, see calculate_hash_table_size(). */
+static unsigned long
+hash_key (const lru_table_t *table, unsigned long hash)
+{
+        return hash & (table->size - 1);
+}
+
+static bool
+rehashing (const lru_cache_t *cache)
+{
+        return cache->old_table.size != 0;
+}
+
+/* With LRU_CACHE_FLAG_HUGE_PAGES, arrays of at least a huge page are
+ * mapped on huge pages so lookups in very large caches stop missing the
+ * TLB on nearly every bucket.
+ */
+static int
+init_table (lru_cache_t *cache, lru_table_t *table, size_t size)
+{
+        size_t  entry_size;
+        size_t  bytes;
+        void   *array;
+
+        memset (table, 0, sizeof (lru_table_t));
+
+        entry_size = cache->open_addressing ? sizeof (lru_slot_t) :
+                sizeof (lru_hash_entry_t *);
+        bytes = size * entry_size;
+        array = NULL;
+
+        if (cache->huge_pages && bytes >= LRU_HUGE_PAGE_SIZE)
+        {
+                bytes = (bytes + LRU_HUGE_PAGE_SIZE - 1) &
+                        ~((size_t) LRU_HUGE_PAGE_SIZE - 1);
+                array = map_aligned (bytes, LRU_HUGE_PAGE_SIZE, true);
+                if (array != NULL)
+                        table->mapped = bytes;
+        }
+
+        if (array == NULL)
+                array = calloc (size, entry_size);
+
+        if (array == NULL)
+                return LRU_ERROR_NOMEM;
+
+        numa_bind (array, size * entry_size, cache->numa_node);
+
+        if (cache->open_addressing)
+                table->slots = array;
+        else
+                table->buckets = array;
+
+        table->size = size;
+
+        return LRU_SUCCESS;
+}
+
+static void
+free_table (lru_table_t *table)
+{
+        if (table->mapped != 0)
+                munmap (table->slots != NULL ? (void *) table->slots :
+                        (void *) table->buckets, table->mapped);
+        else
+        {
+                free (table->buckets);
+                free (table->slots);
+        }
+
+        memset (table, 0, sizeof (lru_table_t));
+}
+
+/* The table geometry is published under a sequence count so lock-free
+ * readers never pair one table's size with another's array.
+ */
+static void
+begin_index_update (lru_cache_t *cache)
+{
+        if (!cache->lockfree_reads)
+                return;
+
+        __atomic_store_n (&cache->index_seq, cache->index_seq + 1,
+                          __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static void
+end_index_update (lru_cache_t *cache)
+{
+        if (!cache->lockfree_reads)
+                return;
+
+        __atomic_store_n (&cache->index_seq, cache->index_seq + 1,
+                          __ATOMIC_RELEASE);
+}
+
+static void
+store_table (lru_table_t *dst, const lru_table_t *src)
+{
+        __atomic_store_n (&dst->size, src->size, __ATOMIC_RELAXED);
+        __atomic_store_n (&dst->buckets, src->buckets, __ATOMIC_RELAXED);
+        __atomic_store_n (&dst->slots, src->slots, __ATOMIC_RELAXED);
+        dst->count = src->count;
+        dst->mapped = src->mapped;
+        dst->generation = src->generation;
+}
+
+static void
+load_table (lru_table_t *dst, const lru_table_t *src)
+{
+        dst->size = __atomic_load_n (&src->size, __ATOMIC_RELAXED);
+        dst->buckets = __atomic_load_n (&src->buckets, __ATOMIC_RELAXED);
+        dst->slots = __atomic_load_n (&src->slots, __ATOMIC_RELAXED);
+        dst->count = 0;
+}
+
+/* Unpublishes the old table, then frees it once no lock-free reader can
+ * still be walking it.
+ */
+static void
+drop_old_table (lru_cache_t *cache)
+{
+        lru_table_t old;
+        lru_table_t empty;
+
+        old = cache->old_table;
+        memset (&empty, 0, sizeof (lru_table_t));
+
+        begin_index_update (cache);
+        store_table (&cache->old_table, &empty);
+        end_index_update (cache);
+
+        cache->rehash_index = 0;
+
+        if (cache->lockfree_reads)
+                synchronize_readers (cache);
+
+        free_table (&old);
+}
+
+static void
+clear_table (lru_cache_t *cache, lru_table_t *table)
+{
+        if (cache->open_addressing)
+                memset (table->slots, 0, table->size * sizeof (lru_slot_t));
+        else
+                memset (table->buckets, 0,
+                        table->size * sizeof (lru_hash_entry_t *));
+
+        table->count = 0;
+}
+
+/* Linear probing needs well-spread low bits, which djb2-style hashes of
+ * similar keys do not have, so the hash is finalized before masking.
+ */
+static size_t
+slot_home (const lru_table_t *table, unsigned long hash)
+{
+        uint64_t mixed;
+
+        mixed = (uint64_t) hash;
+        mixed ^= mixed >> 33;
+        mixed *= 0xff51afd7ed558ccdULL;
+        mixed ^= mixed >> 33;
+
+        return (size_t) mixed & (table->size - 1);
+}
+
+/* Robin Hood linear probing: distance of the entry at pos from its home
+ * slot.  Entries along a probe sequence are ordered by this distance,
+ * which bounds unsuccessful lookups and lets deletion shift backwards
+ * instead of leaving tombstones.
+ */
+static size_t
+probe_distance (const lru_table_t *table, unsigned long hash, size_t pos)
+{
+        return (pos - slot_home (table, hash)) & (table->size - 1);
+}
+
+static lru_node_t *
+find_in_open_table (lru_cache_t *cache, lru_table_t *table,
+                    unsigned long hash, const void *key, size_t key_size)
+{
+        lru_node_t *node;
+        lru_slot_t *slot;
+        unsigned long slot_hash;
+        size_t  mask;
+        size_t  pos;
+        size_t  dist;
+
+        mask = table->size - 1;
+        pos = slot_home (table, hash);
+
+        /* Bounded by the table size because a lock-free reader can race
+         * with slots being shifted under it.
+         */
+        for (dist = 0; dist < table->size; dist++)
+        {
+                slot = &table->slots[pos];
+                node = __atomic_load_n (&slot->node, __ATOMIC_ACQUIRE);
+                slot_hash = __atomic_load_n (&slot->hash, __ATOMIC_RELAXED);
+
+                if (node == NULL ||
+                    probe_distance (table, slot_hash, pos) < dist)
+                        return NULL;
+
+                if (slot_hash == hash &&
+                    cache->compare_fn (node->key, node->key_size,
+                                       key, key_size) == 0)
+                        return node;
+
+                pos = (pos + 1) & mask;
+
+                count_stat (cache, LRU_STAT_COLLISIONS);
+        }
+
+        return NULL;
+}
+
+/* The hash is written before the node pointer is released so a reader
+ * that sees the node also sees it fully built.
+ */
+static void
+set_slot (lru_slot_t *slot, const lru_slot_t *entry)
+{
+        __atomic_store_n (&slot->hash, entry->hash, __ATOMIC_RELAXED);
+        __atomic_store_n (&slot->node, entry->node, __ATOMIC_RELEASE);
+}
+
+static int
+add_to_open_table (lru_table_t *table, lru_node_t *node, unsigned long hash)
+{
+        lru_slot_t entry;
+        lru_slot_t tmp;
+        size_t  mask;
+        size_t  pos;
+        size_t  dist;
+        size_t  slot_dist;
+
+        if (table->count + 1 >= table->size)
+                return LRU_ERROR_FULL;
+
+        entry.hash = hash;
+        entry.node = node;
+        mask = table->size - 1;
+        pos = slot_home (table, hash);
+
+        for (dist = 0;; dist++)
+        {
+                if (table->slots[pos].node == NULL)
+                {
+                        set_slot (&table->slots[pos], &entry);
+                        table->count++;
+                        return LRU_SUCCESS;
+                }
+
+                slot_dist = probe_distance (table, table->slots[pos].hash, pos);
+                if (slot_dist < dist)
+                {
+                        tmp = table->slots[pos];
+                        set_slot (&table->slots[pos], &entry);
+                        entry = tmp;
+                        dist = slot_dist;
+                }
+
+                pos = (pos + 1) & mask;
+        }
+}
+
+static bool
+remove_from_open_table (lru_table_t *table, lru_node_t *node,
+                        unsigned long hash)
+{
+        size_t  mask;
+        size_t  pos;
+        size_t  next;
+
+        mask = table->size - 1;
+        pos = slot_home (table, hash);
+
+        while (table->slots[pos].node != node)
+        {
+                if (table->slots[pos].node == NULL)
+                        return false;
+                pos = (pos + 1) & mask;
+        }
+
+        for (;;)
+        {
+                next = (pos + 1) & mask;
+
+                if (table->slots[next].node == NULL ||
+                    probe_distance (table, table->slots[next].hash, next) == 0)
+                        break;
+
+                set_slot (&table->slots[pos], &table->slots[next]);
+                pos = next;
+        }
+
+        __atomic_store_n (&table->slots[pos].node, NULL, __ATOMIC_RELEASE);
+        table->count--;
+
+        return true;
+}
+
+static lru_node_t *
+find_in_chained_table (lru_cache_t *cache, lru_table_t *table,
+                       unsigned long hash, const void *key, size_t key_size)
+{
+        lru_hash_entry_t *entry;
+
+        for (entry = __atomic_load_n (&table->buckets[hash_key (table, hash)],
+                                      __ATOMIC_ACQUIRE); entry != NULL;
+             entry = __atomic_load_n (&entry->next, __ATOMIC_ACQUIRE))
+        {
+                if (entry->node->hash == hash &&
+                    cache->compare_fn (entry->node->key,
+                                       entry->node->key_size, key,
+                                       key_size) == 0)
+                        return entry->node;
+
+                count_stat (cache, LRU_STAT_COLLISIONS);
+        }
+
+        return NULL;
+}
+
+static void
+link_chained_entry (lru_table_t *table, lru_hash_entry_t *entry,
+                    unsigned long hash)
+{
+        unsigned long bucket;
+
+        bucket = hash_key (table, hash);
+        __atomic_store_n (&entry->next, table->buckets[bucket],
+                          __ATOMIC_RELAXED);
+        if (entry->next != NULL)
+                entry->next->pprev = &entry->next;
+        entry->pprev = &table->buckets[bucket];
+        entry->generation = table->generation;
+        __atomic_store_n (&table->buckets[bucket], entry, __ATOMIC_RELEASE);
+        table->count++;
+}
+
+static void
+unlink_chained_entry (lru_table_t *table, lru_hash_entry_t *entry)
+{
+        __atomic_store_n (entry->pprev, entry->next, __ATOMIC_RELEASE);
+        if (entry->next != NULL)
+                entry->next->pprev = entry->pprev;
+
+        table->count--;
+}
+
+static lru_node_t *
+find_in_table (lru_cache_t *cache, lru_table_t *table, unsigned long hash,
+               const void *key, size_t key_size)
+{
+        if (cache->open_addressing)
+                return find_in_open_table (cache, table, hash, key, key_size);
+
+        return find_in_chained_table (cache, table, hash, key, key_size);
+}
+
+/* While a rehash is in progress, buckets of the old table below
+ * rehash_index have already been migrated, so only keys hashing at or
+ * above it can still live there.
+ */
+static bool
+in_old_table (lru_cache_t *cache, unsigned long hash)
+{
+        size_t  home;
+
+        if (!rehashing (cache))
+                return false;
+
+        if (cache->open_addressing)
+                home = slot_home (&cache->old_table, hash);
+        else
+                home = hash_key (&cache->old_table, hash);
+
+        return home >= cache->rehash_index;
+}
+
+static lru_node_t *
+find_in_hash_table (lru_cache_t *cache, unsigned long hash,
+                    const void *key, size_t key_size)
+{
+        lru_node_t *node;
+
+        if (in_old_table (cache, hash))
+        {
+                node = find_in_table (cache, &cache->old_table, hash, key,
+                                      key_size);
+                if (node != NULL)
+                        return node;
+        }
+
+        return find_in_table (cache, &cache->table, hash, key, key_size);
+}
+
+/* Lookup for lock-free readers; the caller must be inside reader_enter().
+ * Both tables are searched during a rehash, so a concurrent migration or
+ * Robin Hood shift can only cause a spurious miss.
+ */
+static lru_node_t *
+find_lockfree (lru_cache_t *cache, unsigned long hash, const void *key,
+               size_t key_size)
+{
+        lru_table_t table;
+        lru_table_t old_table;
+        lru_node_t *node;
+        unsigned int seq;
+
+        for (;;)
+        {
+                seq = __atomic_load_n (&cache->index_seq, __ATOMIC_ACQUIRE);
+                load_table (&table, &cache->table);
+                load_table (&old_table, &cache->old_table);
+                __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+                if ((seq & 1) == 0 &&
+                    __atomic_load_n (&cache->index_seq,
+                                     __ATOMIC_RELAXED) == seq)
+                        break;
+        }
+
+        if (old_table.size != 0)
+        {
+                node = find_in_table (cache, &old_table, hash, key,
+                                      key_size);
+                if (node != NULL)
+                        return node;
+        }
+
+        return find_in_table (cache, &table, hash, key, key_size);
+}
+
+static int
+add_to_hash_table (lru_cache_t *cache, lru_node_t *node, unsigned long hash)
+{
+        if (cache->open_addressing)
+                return add_to_open_table (&cache->table, node, hash);
+
+        link_chained_entry (&cache->table, &node->hash_entry, hash);
+
+        return LRU_SUCCESS;
+}
+
+static void
+remove_from_hash_table (lru_cache_t *cache, lru_node_t *node)
+{
+        if (cache->open_addressing)
+        {
+                if (in_old_table (cache, node->hash) &&
+                    remove_from_open_table (&cache->old_table, node,
+                                            node->hash))
+                        return;
+
+                remove_from_open_table (&cache->table, node, node->hash);
+                return;
+        }
+
+        unlink_chained_entry (node->hash_entry.generation ==
+                              cache->table.generation ?
+                              &cache->table : &cache->old_table,
+                              &node->hash_entry);
+}
+
+static void
+migrate_chained_buckets (lru_cache_t *cache, size_t steps)
+{
+        lru_table_t *old;
+        lru_hash_entry_t *entry;
+        lru_hash_entry_t *next_entry;
+        size_t  empty_visits;
+
+        old = &cache->old_table;
+        empty_visits = steps * 10;
+
+        while (steps > 0 && cache->rehash_index < old->size)
+        {
+                entry = old->buckets[cache->rehash_index];
+                if (entry == NULL)
+                {
+                        cache->rehash_index++;
+                        if (--empty_visits == 0)
+                                return;
+                        continue;
+                }
+
+                while (entry != NULL)
+                {
+                        next_entry = entry->next;
+                        link_chained_entry (&cache->table, entry,
+                                            entry->node->hash);
+                        old->count--;
+                        entry = next_entry;
+                }
+
+                __atomic_store_n (&old->buckets[cache->rehash_index++], NULL,
+                                  __ATOMIC_RELEASE);
+                steps--;
+        }
+}
+
+/* A step only stops right after an empty slot, so no probe run crosses
+ * rehash_index and every entry left in the old table has its home slot
+ * at or above it, which is what in_old_table() relies on.
+ */
+static void
+migrate_open_slots (lru_cache_t *cache, size_t steps)
+{
+        lru_table_t *old;
+        lru_slot_t *slot;
+        size_t  empty_visits;
+
+        old = &cache->old_table;
+        empty_visits = steps * 10;
+
+        while (cache->rehash_index < old->size)
+        {
+                slot = &old->slots[cache->rehash_index++];
+
+                if (slot->node == NULL)
+                {
+                        if (steps == 0 || --empty_visits == 0)
+                                return;
+                        continue;
+                }
+
+                add_to_open_table (&cache->table, slot->node, slot->hash);
+                __atomic_store_n (&slot->node, NULL, __ATOMIC_RELEASE);
+                old->count--;
+
+                if (steps > 0)
+                        steps--;
+        }
+}
+
+/* One migration runs at a time.  A size asked for while one is under
+ * way is kept in rehash_pending and taken up when it ends, instead of
+ * finishing the current one on the spot.
+ */
+static int
+start_rehash (lru_cache_t *cache, size_t new_size)
+{
+        lru_table_t table;
+
+        if (rehashing (cache))
+        {
+                cache->rehash_pending = new_size;
+                return LRU_SUCCESS;
+        }
+
+        cache->rehash_pending = 0;
+
+        if (new_size == cache->table.size)
+                return LRU_SUCCESS;
+
+        if (init_table (cache, &table, new_size) != LRU_SUCCESS)
+                return LRU_ERROR_NOMEM;
+        table.generation = cache->table.generation + 1;
+
+        begin_index_update (cache);
+        store_table (&cache->old_table, &cache->table);
+        store_table (&cache->table, &table);
+        cache->rehash_index = 0;
+        end_index_update (cache);
+
+        if (cache->old_table.count == 0)
+                drop_old_table (cache);
+
+        return LRU_SUCCESS;
+}
+
+/* While a pending resize needs more room than the table being filled
+ * has, the migration is paced to end before that table reaches its load
+ * factor: each write moves the remaining buckets divided by the inserts
+ * left until then.  The worst case is a single write moving everything
+ * left, reached only once the table is already at its load factor.
+ */
+static size_t
+rehash_pace (lru_cache_t *cache, size_t steps)
+{
+        size_t  limit;
+        size_t  remaining;
+        size_t  paced;
+
+        if (cache->rehash_pending <= cache->table.size)
+                return steps;
+
+        limit = (size_t) (cache->table.size * LRU_CACHE_LOAD_FACTOR);
+        remaining = cache->old_table.size - cache->rehash_index;
+        if (cache->size >= limit)
+                return remaining;
+
+        paced = remaining / (limit - cache->size) + 1;
+
+        return paced > steps ? paced : steps;
+}
+
+/* Incremental rehashing: every write-locked operation migrates a few
+ * buckets from the old table, so rebuilding a large index never stalls
+ * the cache behind one long pass.
+ */
+static void
+rehash_step (lru_cache_t *cache, size_t steps)
+{
+        if (!rehashing (cache))
+                return;
+
+        steps = rehash_pace (cache, steps);
+
+        if (cache->open_addressing)
+                migrate_open_slots (cache, steps);
+        else
+                migrate_chained_buckets (cache, steps);
+
+        if (cache->old_table.count == 0)
+        {
+                drop_old_table (cache);
+                if (cache->rehash_pending != 0)
+                        start_rehash (cache, cache->rehash_pending);
+        }
+}
+
+/* Memory charged against a byte capacity for one entry. */
+static size_t
+entry_charge (size_t key_size, size_t value_size)
+{
+        return key_size + value_size + sizeof (lru_node_t);
+}
+
+/* byte_limit is the registry's cap on top of the capacity. */
+static bool
+over_capacity (lru_cache_t *cache)
+{
+        if (cache->bytes > cache->byte_limit)
+                return true;
+
+        if (cache->byte_capacity)
+                return cache->bytes > cache->capacity;
+
+        return cache->size > cache->capacity;
+}
+
+/* replaced, if not NULL, is an entry the insert will take the place of,
+ * so its slot and bytes count as free.
+ */
+static bool
+needs_room (lru_cache_t *cache, size_t charge, const lru_node_t *replaced)
+{
+        size_t  bytes;
+        size_t  size;
+
+        bytes = cache->bytes;
+        size = cache->size;
+        if (replaced != NULL)
+        {
+                bytes -= entry_charge (replaced->key_size,
+                                       replaced->value_size);
+                size--;
+        }
+
+        if (bytes + charge > cache->byte_limit)
+                return true;
+
+        if (cache->byte_capacity)
+                return bytes + charge > cache->capacity;
+
+        return size >= cache->capacity;
+}
+
+static uint64_t
+monotonic_ms (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static bool
+node_expired (const lru_node_t *node)
+{
+        return node->expires_at != 0 && node->expires_at <= monotonic_ms ();
+}
+
+static void
+timer_add (lru_timer_wheel_t *wheel, lru_node_t *node)
+{
+        uint64_t expires;
+        uint64_t diff;
+        unsigned int level;
+        unsigned int slot;
+
+        expires = node->expires_at < wheel->now ? wheel->now :
+                node->expires_at;
+
+        /* Expiries beyond the wheel's span park in the top level and are
+         * placed again when they come round.
+         */
+        diff = expires ^ wheel->now;
+        if ((diff >> (LRU_TIMER_LEVELS * LRU_TIMER_SLOT_BITS)) != 0)
+        {
+                expires = wheel->now |
+                        ((1ULL << (LRU_TIMER_LEVELS * LRU_TIMER_SLOT_BITS)) -
+                         1);
+                diff = expires ^ wheel->now;
+        }
+
+        level = 0;
+        while (level + 1 < LRU_TIMER_LEVELS &&
+               (diff >> ((level + 1) * LRU_TIMER_SLOT_BITS)) != 0)
+                level++;
+
+        slot = (expires >> (level * LRU_TIMER_SLOT_BITS)) &
+                (LRU_TIMER_SLOTS - 1);
+
+        node->timer_prev = NULL;
+        node->timer_next = wheel->slots[level][slot];
+        if (node->timer_next != NULL)
+                node->timer_next->timer_prev = node;
+        wheel->slots[level][slot] = node;
+        wheel->occupied[level] |= 1ULL << slot;
+        node->timer_slot = level * LRU_TIMER_SLOTS + slot;
+}
+
+static void
+timer_remove (lru_timer_wheel_t *wheel, lru_node_t *node)
+{
+        unsigned int level;
+        unsigned int slot;
+
+        level = node->timer_slot / LRU_TIMER_SLOTS;
+        slot = node->timer_slot % LRU_TIMER_SLOTS;
+
+        if (node->timer_prev != NULL)
+                node->timer_prev->timer_next = node->timer_next;
+        else
+                wheel->slots[level][slot] = node->timer_next;
+
+        if (node->timer_next != NULL)
+                node->timer_next->timer_prev = node->timer_prev;
+
+        if (wheel->slots[level][slot] == NULL)
+                wheel->occupied[level] &= ~(1ULL << slot);
+
+        node->timer_slot = LRU_TIMER_NONE;
+}
+
+static lru_node_t *
+timer_take_slot (lru_timer_wheel_t *wheel, unsigned int level,
+                 unsigned int slot)
+{
+        lru_node_t *list;
+
+        list = wheel->slots[level][slot];
+        wheel->slots[level][slot] = NULL;
+        wheel->occupied[level] &= ~(1ULL << slot);
+
+        return list;
+}
+
+/* Earliest tick at or after wheel->now at which some slot needs work,
+ * found from the occupancy bitmaps so empty stretches cost nothing.
+ */
+static uint64_t
+timer_next_event (const lru_timer_wheel_t *wheel)
+{
+        uint64_t next;
+        uint64_t start;
+        uint64_t bits;
+        uint64_t span;
+        unsigned int level;
+        unsigned int shift;
+
+        next = UINT64_MAX;
+
+        for (level = 0; level < LRU_TIMER_LEVELS; level++)
+        {
+                if (wheel->occupied[level] == 0)
+                        continue;
+
+                shift = level * LRU_TIMER_SLOT_BITS;
+                span = 1ULL << (shift + LRU_TIMER_SLOT_BITS);
+
+                /* First slot boundary of this level not yet processed. */
+                start = (wheel->now + (1ULL << shift) - 1) &
+                        ~((1ULL << shift) - 1);
+                if ((start & ~(span - 1)) != (wheel->now & ~(span - 1)))
+                        continue;
+
+                bits = wheel->occupied[level] &
+                        (~0ULL << ((start >> shift) & (LRU_TIMER_SLOTS - 1)));
+                if (bits == 0)
+                        continue;
+
+                start = (start & ~(span - 1)) +
+                        ((uint64_t) __builtin_ctzll (bits) << shift);
+                if (start < next)
+                        next = start;
+        }
+
+        return next;
+}
+
+static void
+detach_node (lru_cache_t *cache, lru_node_t *node)
+{
+        if (node->timer_slot != LRU_TIMER_NONE)
+                timer_remove (cache->wheel, node);
+
+        remove_from_hash_table (cache, node);
+        remove_from_list (cache, node);
+
+        cache->size--;
+        cache->bytes -= entry_charge (node->key_size, node->value_size);
+}
+
+static void
+unlink_node (lru_cache_t *cache, lru_node_t *node)
+{
+        detach_node (cache, node);
+        unref_node (cache, node);
+}
+
+/* The node leaves the cache now but keeps the cache's reference, so its
+ * key and value stay valid for the callback run by unlock_cache().
+ */
+static void
+queue_eviction (lru_cache_t *cache, lru_node_t *node)
+{
+        detach_node (cache, node);
+        node->next = NULL;
+
+        if (cache->evicted_tail != NULL)
+                cache->evicted_tail->next = node;
+        else
+                cache->evicted = node;
+        cache->evicted_tail = node;
+}
+
+/* Nodes go back through unref_node() under the write lock, since the
+ * allocator hooks and the retire lists are not safe to touch outside it.
+ */
+static void
+release_spent (lru_cache_t *cache)
+{
+        lru_node_t *node;
+        lru_node_t *next;
+
+        if (__atomic_load_n (&cache->spent, __ATOMIC_RELAXED) == NULL)
+                return;
+
+        node = __atomic_exchange_n (&cache->spent, NULL, __ATOMIC_ACQUIRE);
+        for (; node != NULL; node = next)
+        {
+                next = node->next;
+                unref_node (cache, node);
+        }
+}
+
+/* Hands a chain of released nodes to the next writer's release_spent(). */
+static void
+push_spent (lru_cache_t *cache, lru_node_t *first, lru_node_t *last)
+{
+        lru_node_t *spent;
+
+        spent = __atomic_load_n (&cache->spent, __ATOMIC_RELAXED);
+        do
+                last->next = spent;
+        while (!__atomic_compare_exchange_n (&cache->spent, &spent, first,
+                                             true, __ATOMIC_RELEASE,
+                                             __ATOMIC_RELAXED));
+}
+
+/* free() and the slab allocator may be called from any thread, so nodes
+ * they back can be freed without the cache lock.
+ */
+static bool
+allocator_thread_safe (lru_cache_t *cache)
+{
+        return cache->allocator.destroy_fn == default_destroy &&
+                (cache->allocator.free_fn == default_free ||
+                 cache->allocator.free_fn == slab_free);
+}
+
+static bool
+frees_unlocked (lru_cache_t *cache)
+{
+        return !cache->lockfree_reads && allocator_thread_safe (cache);
+}
+
+/* Frees a chain of evicted nodes on the spot when that is safe outside
+ * the lock and leaves it to release_spent() otherwise.
+ */
+static void
+release_evicted (lru_cache_t *cache, lru_node_t *first, lru_node_t *last)
+{
+        lru_node_t *next;
+
+        if (!frees_unlocked (cache))
+        {
+                push_spent (cache, first, last);
+                return;
+        }
+
+        for (; first != NULL; first = next)
+        {
+                next = first->next;
+                unref_node (cache, first);
+        }
+}
+
+static lru_tier_entry_t **
+tier_find (lru_tier_t *tier, unsigned long hash, const void *key,
+           size_t key_size)
+{
+        lru_tier_entry_t **link;
+
+        link = &tier->buckets[hash & (tier->n_buckets - 1)];
+        while (*link != NULL &&
+               ((*link)->hash != hash ||
+                tier->cache->compare_fn ((*link)->key, (*link)->key_size,
+                                         key, key_size) != 0))
+                link = &(*link)->next;
+
+        return link;
+}
+
+/* An entry not yet written only gives up its ring slot; whoever holds
+ * the node still releases it.
+ */
+static void
+tier_remove_entry (lru_tier_t *tier, lru_tier_entry_t *entry)
+{
+        lru_tier_entry_t **link;
+
+        link = &tier->buckets[entry->hash & (tier->n_buckets - 1)];
+        while (*link != entry)
+                link = &(*link)->next;
+        *link = entry->next;
+
+        if (entry->node != NULL)
+        {
+                if (entry->slot != LRU_TIER_UNQUEUED)
+                        tier->queue[entry->slot].entry = NULL;
+        }
+        else
+        {
+                if (entry->older != NULL)
+                        entry->older->newer = entry->newer;
+                else
+                        tier->oldest = entry->newer;
+
+                if (entry->newer != NULL)
+                        entry->newer->older = entry->older;
+                else
+                        tier->newest = entry->older;
+        }
+
+        if (entry->raw_size != 0)
+                __atomic_sub_fetch (&tier->cache->compressed_values, 1,
+                                    __ATOMIC_RELAXED);
+
+        tier->n_entries--;
+        free (entry);
+}
+
+static void
+tier_grow (lru_tier_t *tier)
+{
+        lru_tier_entry_t **buckets;
+        lru_tier_entry_t *entry;
+        size_t  n_buckets;
+        size_t  i;
+
+        n_buckets = tier->n_buckets * 2;
+        buckets = calloc (n_buckets, sizeof (lru_tier_entry_t *));
+        if (buckets == NULL)
+                return;
+
+        for (i = 0; i < tier->n_buckets; i++)
+        {
+                while ((entry = tier->buckets[i]) != NULL)
+                {
+                        tier->buckets[i] = entry->next;
+                        entry->next = buckets[entry->hash & (n_buckets - 1)];
+                        buckets[entry->hash & (n_buckets - 1)] = entry;
+                }
+        }
+
+        free (tier->buckets);
+        tier->buckets = buckets;
+        tier->n_buckets = n_buckets;
+}
+
+static lru_tier_entry_t *
+tier_add_entry (lru_tier_t *tier, lru_node_t *node)
+{
+        lru_tier_entry_t **link;
+        lru_tier_entry_t *entry;
+
+        link = tier_find (tier, node->hash, node->key, node->key_size);
+        if (*link != NULL)
+                tier_remove_entry (tier, *link);
+
+        entry = malloc (sizeof (lru_tier_entry_t) + node->key_size);
+        if (entry == NULL)
+                return NULL;
+
+        if (tier->n_entries >= tier->n_buckets)
+                tier_grow (tier);
+
+        memcpy (entry->key, node->key, node->key_size);
+        entry->key_size = node->key_size;
+        entry->value_size = node->value_size;
+        entry->raw_size = node->raw_size;
+        if (entry->raw_size != 0)
+                __atomic_add_fetch (&tier->cache->compressed_values, 1,
+                                    __ATOMIC_RELAXED);
+        entry->hash = node->hash;
+        entry->expires_at = node->expires_at;
+        entry->version = ++tier->versions;
+        entry->node = node;
+        entry->slot = LRU_TIER_UNQUEUED;
+
+        link = &tier->buckets[entry->hash & (tier->n_buckets - 1)];
+        entry->next = *link;
+        *link = entry;
+        tier->n_entries++;
+
+        return entry;
+}
+
+/* Once its value is on disk, an entry joins the write order. */
+static void
+tier_written (lru_tier_t *tier, lru_tier_entry_t *entry, uint64_t offset)
+{
+        entry->node = NULL;
+        entry->offset = offset;
+
+        entry->older = tier->newest;
+        entry->newer = NULL;
+        if (tier->newest != NULL)
+                tier->newest->newer = entry;
+        else
+                tier->oldest = entry;
+        tier->newest = entry;
+}
+
+/* Claims the next bytes of the log, forgetting the entries stored there.
+ * When the log wraps, whatever is left of the previous lap is older than
+ * everything written since and is dropped with it.
+ */
+static uint64_t
+tier_reserve (lru_tier_t *tier, uint64_t bytes)
+{
+        uint64_t offset;
+
+        if (tier->write_pos + bytes > tier->capacity)
+        {
+                while (tier->oldest != NULL &&
+                       tier->oldest->offset >= tier->write_pos)
+                        tier_remove_entry (tier, tier->oldest);
+                tier->write_pos = 0;
+        }
+
+        offset = tier->write_pos;
+        while (tier->oldest != NULL && tier->oldest->offset >= offset &&
+               tier->oldest->offset < offset + bytes)
+                tier_remove_entry (tier, tier->oldest);
+
+        tier->write_pos += bytes;
+
+        return offset;
+}
+
+static bool
+tier_write (int fd, struct iovec *iov, int count, uint64_t offset)
+{
+        ssize_t written;
+
+        while (count > 0)
+        {
+                written = pwritev (fd, iov, count, offset);
+                if (written < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+
+                offset += written;
+                while (count > 0 && (size_t) written >= iov->iov_len)
+                {
+                        written -= iov->iov_len;
+                        iov++;
+                        count--;
+                }
+
+                if (count > 0)
+                {
+                        iov->iov_base = (char *) iov->iov_base + written;
+                        iov->iov_len -= written;
+                }
+        }
+
+        return true;
+}
+
+/* The nodes stay queued while their values are written, so lookups still
+ * find them in memory; only then are they handed back for release.
+ */
+static void *
+tier_writer (void *arg)
+{
+        lru_tier_t *tier;
+        lru_tier_item_t *item;
+        lru_node_t *first;
+        lru_node_t *last;
+        struct iovec iov[LRU_TIER_BATCH];
+        uint64_t offsets[LRU_TIER_BATCH];
+        uint64_t offset;
+        uint64_t bytes;
+        size_t  n;
+        size_t  i;
+        int     count;
+        bool    written;
+
+        tier = arg;
+
+        pthread_mutex_lock (&tier->lock);
+        for (;;)
+        {
+                while (tier->count == 0 && !tier->stop)
+                        pthread_cond_wait (&tier->work, &tier->lock);
+
+                if (tier->stop)
+                        break;
+
+                bytes = 0;
+                for (n = 0; n < tier->count && n < LRU_TIER_BATCH; n++)
+                {
+                        item = &tier->queue[(tier->head + n) % LRU_TIER_QUEUE];
+                        if (item->entry == NULL)
+                                continue;
+                        if (bytes + item->node->value_size > tier->capacity)
+                                break;
+                        bytes += item->node->value_size;
+                }
+
+                offset = tier_reserve (tier, bytes);
+                count = 0;
+                for (i = 0; i < n; i++)
+                {
+                        item = &tier->queue[(tier->head + i) % LRU_TIER_QUEUE];
+                        if (item->entry == NULL)
+                                continue;
+                        offsets[i] = offset;
+                        offset += item->node->value_size;
+                        iov[count].iov_base = item->node->value;
+                        iov[count].iov_len = item->node->value_size;
+                        count++;
+                }
+
+                pthread_mutex_unlock (&tier->lock);
+                written = tier_write (tier->fd, iov, count, offset - bytes);
+                pthread_mutex_lock (&tier->lock);
+
+                first = NULL;
+                last = NULL;
+                for (i = 0; i < n; i++)
+                {
+                        item = &tier->queue[(tier->head + i) % LRU_TIER_QUEUE];
+                        if (item->entry != NULL && written)
+                        {
+                                tier_written (tier, item->entry, offsets[i]);
+                                tier->spills++;
+                        }
+                        else if (item->entry != NULL)
+                                tier_remove_entry (tier, item->entry);
+
+                        item->node->next = NULL;
+                        if (last != NULL)
+                                last->next = item->node;
+                        else
+                                first = item->node;
+                        last = item->node;
+                }
+
+                tier->head = (tier->head + n) % LRU_TIER_QUEUE;
+                tier->count -= n;
+                push_spent (tier->cache, first, last);
+                pthread_cond_broadcast (&tier->idle);
+        }
+        pthread_mutex_unlock (&tier->lock);
+
+        return NULL;
+}
+
+/* Indexes a node as it is evicted, under the cache lock, so that a write
+ * or delete of the key from then on finds and forgets it.  Expired nodes
+ * and values too large for the log are not kept.
+ */
+static void
+tier_track (lru_tier_t *tier, lru_node_t *node)
+{
+        if (node_expired (node) || node->value_size > tier->capacity)
+                return;
+
+        pthread_mutex_lock (&tier->lock);
+        tier_add_entry (tier, node);
+        pthread_mutex_unlock (&tier->lock);
+}
+
+/* Queues the evicted nodes still indexed for the writer once their
+ * callbacks have run.  Dropped ones, and any that do not fit in the
+ * ring, are released instead of ever blocking the caller.
+ */
+static void
+tier_submit (lru_tier_t *tier, lru_node_t *evicted)
+{
+        lru_tier_entry_t *entry;
+        lru_tier_item_t *item;
+        lru_node_t *node;
+        lru_node_t *next;
+        lru_node_t *first;
+        lru_node_t *last;
+
+        first = NULL;
+        last = NULL;
+
+        pthread_mutex_lock (&tier->lock);
+        for (node = evicted; node != NULL; node = next)
+        {
+                next = node->next;
+
+                entry = *tier_find (tier, node->hash, node->key,
+                                    node->key_size);
+                if (entry != NULL && entry->node == node &&
+                    tier->count == LRU_TIER_QUEUE)
+                        tier_remove_entry (tier, entry);
+                else if (entry != NULL && entry->node == node)
+                {
+                        entry->slot = (tier->head + tier->count) %
+                                LRU_TIER_QUEUE;
+                        item = &tier->queue[entry->slot];
+                        item->node = node;
+                        item->entry = entry;
+                        tier->count++;
+                        continue;
+                }
+
+                node->next = NULL;
+                if (last != NULL)
+                        last->next = node;
+                else
+                        first = node;
+                last = node;
+        }
+        pthread_cond_signal (&tier->work);
+        pthread_mutex_unlock (&tier->lock);
+
+        if (first != NULL)
+                release_evicted (tier->cache, first, last);
+}
+
+/* Forgets the key in the tier, queued or written, so a stale copy cannot
+ * come back after the key is written or deleted in memory.
+ */
+static bool
+tier_invalidate (lru_tier_t *tier, unsigned long hash, const void *key,
+                 size_t key_size)
+{
+        lru_tier_entry_t *entry;
+
+        pthread_mutex_lock (&tier->lock);
+
+        entry = *tier_find (tier, hash, key, key_size);
+        if (entry != NULL)
+                tier_remove_entry (tier, entry);
+        pthread_mutex_unlock (&tier->lock);
+
+        return entry != NULL;
+}
+
+static bool
+tier_read (int fd, void *buffer, size_t size, uint64_t offset)
+{
+        ssize_t done;
+
+        while (size > 0)
+        {
+                done = pread (fd, buffer, size, offset);
+                if (done < 0 && errno == EINTR)
+                        continue;
+                if (done <= 0)
+                        return false;
+
+                buffer = (char *) buffer + done;
+                size -= done;
+                offset += done;
+        }
+
+        return true;
+}
+
+/* The entry for key, if it is still the one of that version. */
+static lru_tier_entry_t *
+tier_find_version (lru_tier_t *tier, unsigned long hash, const void *key,
+                   size_t key_size, uint64_t version)
+{
+        lru_tier_entry_t *entry;
+
+        entry = *tier_find (tier, hash, key, key_size);
+        if (entry == NULL || entry->version != version)
+                return NULL;
+
+        return entry;
+}
+
+/* Forgets the key unless it has been replaced since it was read. */
+static void
+tier_forget (lru_tier_t *tier, unsigned long hash, const void *key,
+             size_t key_size, uint64_t version)
+{
+        lru_tier_entry_t *entry;
+
+        pthread_mutex_lock (&tier->lock);
+        entry = tier_find_version (tier, hash, key, key_size, version);
+        if (entry != NULL)
+                tier_remove_entry (tier, entry);
+        pthread_mutex_unlock (&tier->lock);
+}
+
+/* Copies the key's value out of the tier into a malloc()ed buffer, still
+ * compressed if raw_size is set, leaving the entry in place.  version
+ * identifies the entry read.  A value still queued is copied under the
+ * lock; one on disk is read without it and kept only if the entry is
+ * still indexed afterwards.
+ */
+static int
+tier_fetch (lru_tier_t *tier, unsigned long hash, const void *key,
+            size_t key_size, void **value, size_t *value_size,
+            size_t *raw_size, uint64_t *expires_at, uint64_t *version)
+{
+        lru_tier_entry_t *entry;
+        uint64_t offset;
+        int     result;
+
+        pthread_mutex_lock (&tier->lock);
+
+        entry = *tier_find (tier, hash, key, key_size);
+        if (entry == NULL)
+        {
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        *value_size = entry->value_size;
+        *raw_size = entry->raw_size;
+        *expires_at = entry->expires_at;
+        *version = entry->version;
+
+        if (entry->expires_at != 0 && entry->expires_at <= monotonic_ms ())
+        {
+                tier_remove_entry (tier, entry);
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        *value = malloc (entry->value_size);
+        if (*value == NULL)
+        {
+                result = LRU_ERROR_NOMEM;
+                goto cleanup;
+        }
+
+        if (entry->node != NULL)
+        {
+                memcpy (*value, entry->node->value, entry->value_size);
+                tier->hits++;
+                result = LRU_SUCCESS;
+                goto cleanup;
+        }
+
+        offset = entry->offset;
+        pthread_mutex_unlock (&tier->lock);
+
+        if (!tier_read (tier->fd, *value, *value_size, offset))
+        {
+                free (*value);
+                tier_forget (tier, hash, key, key_size, *version);
+                return LRU_ERROR_IO;
+        }
+
+        pthread_mutex_lock (&tier->lock);
+
+        if (tier_find_version (tier, hash, key, key_size, *version) == NULL)
+        {
+                free (*value);
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        tier->hits++;
+        result = LRU_SUCCESS;
+
+      cleanup:
+        pthread_mutex_unlock (&tier->lock);
+
+        return result;
+}
+
+static void
+tier_clear (lru_tier_t *tier)
+{
+        size_t  i;
+
+        pthread_mutex_lock (&tier->lock);
+
+        for (i = 0; i < tier->n_buckets; i++)
+        {
+                while (tier->buckets[i] != NULL)
+                        tier_remove_entry (tier, tier->buckets[i]);
+        }
+        pthread_mutex_unlock (&tier->lock);
+}
+
+/* Stops the writer and releases everything still queued.  Called once
+ * no other thread can reach the cache.
+ */
+static void
+tier_destroy (lru_tier_t *tier)
+{
+        lru_node_t *node;
+        size_t  i;
+
+        pthread_mutex_lock (&tier->lock);
+        tier->stop = true;
+        pthread_cond_signal (&tier->work);
+        pthread_mutex_unlock (&tier->lock);
+        pthread_join (tier->writer, NULL);
+
+        tier_clear (tier);
+
+        for (i = 0; i < tier->count; i++)
+        {
+                node = tier->queue[(tier->head + i) % LRU_TIER_QUEUE].node;
+                node->next = NULL;
+                push_spent (tier->cache, node, node);
+        }
+
+        close (tier->fd);
+        unlink (tier->path);
+        free (tier->path);
+        free (tier->buckets);
+        pthread_cond_destroy (&tier->idle);
+        pthread_cond_destroy (&tier->work);
+        pthread_mutex_destroy (&tier->lock);
+        free (tier);
+}
+
+/* Runs the eviction callback for a chain taken off cache->evicted, with
+ * the callback and tier read while it was taken, then hands the nodes to
+ * the tier or releases them.  Called without the cache lock.
+ */
+static void
+finish_evictions (lru_cache_t *cache, lru_node_t *evicted, lru_node_t *last,
+                  lru_eviction_fn eviction_fn, void *user_data,
+                  lru_tier_t *tier)
+{
+        lru_node_t *node;
+        void   *raw;
+        uint64_t start;
+
+        /* A compressed value whose copy cannot be made is evicted
+         * without a callback.
+         */
+        for (node = evicted; eviction_fn != NULL && node != NULL;
+             node = node->next)
+        {
+                raw = raw_value (cache, node);
+                if (raw == NULL)
+                        continue;
+
+                start = latency_start (cache);
+                eviction_fn (node->key, node->key_size, raw,
+                             raw_value_size (node), user_data);
+                record_latency (cache, LRU_LATENCY_EVICT, start);
+
+                if (raw != node->value)
+                        free (raw);
+        }
+
+        if (tier != NULL)
+                tier_submit (tier, evicted);
+        else
+                release_evicted (cache, evicted, last);
+}
+
+/* Drops the cache lock and only then runs the eviction callback for
+ * whatever the locked section evicted, so a slow callback stalls only
+ * its own caller.  The callback may call back into the cache.
+ */
+static void
+unlock_cache (lru_cache_t *cache)
+{
+        lru_eviction_fn eviction_fn;
+        void   *user_data;
+        lru_node_t *evicted;
+        lru_node_t *last;
+        lru_tier_t *tier;
+
+        /* Read-locked paths never evict, so the list is only written
+         * here with the write lock held.
+         */
+        evicted = cache->evicted;
+        last = cache->evicted_tail;
+        if (evicted != NULL)
+        {
+                cache->evicted = NULL;
+                cache->evicted_tail = NULL;
+        }
+        eviction_fn = cache->eviction_fn;
+        user_data = cache->eviction_user_data;
+        tier = cache->tier;
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        if (evicted != NULL)
+                finish_evictions (cache, evicted, last, eviction_fn,
+                                  user_data, tier);
+}
+
+static void
+expire_node (lru_cache_t *cache, lru_node_t *node)
+{
+        if (cache->track_stats)
+                cache->stats.expirations++;
+
+        LRU_TRACE (cache, EVICT, node->key, node->key_size, node->value_size);
+
+        if (cache->eviction_fn != NULL)
+                queue_eviction (cache, node);
+        else
+                unlink_node (cache, node);
+}
+
+/* Runs the wheel up to now, cascading timers from the higher levels as
+ * their slots come round and expiring those in the level 0 slot of each
+ * tick.  Every timer is touched once per level it falls through, so the
+ * cost is O(1) amortized per entry.
+ */
+static size_t
+expire_entries (lru_cache_t *cache)
+{
+        lru_timer_wheel_t *wheel;
+        lru_node_t *node;
+        lru_node_t *next;
+        uint64_t now;
+        uint64_t tick;
+        unsigned int level;
+        unsigned int shift;
+        size_t  expired;
+
+        wheel = cache->wheel;
+        if (wheel == NULL)
+                return 0;
+
+        now = monotonic_ms ();
+        expired = 0;
+
+        while ((tick = timer_next_event (wheel)) <= now)
+        {
+                wheel->now = tick;
+
+                for (level = LRU_TIMER_LEVELS - 1; level > 0; level--)
+                {
+                        shift = level * LRU_TIMER_SLOT_BITS;
+                        if ((tick & ((1ULL << shift) - 1)) != 0)
+                                continue;
+
+                        node = timer_take_slot (wheel, level,
+                                                (tick >> shift) &
+                                                (LRU_TIMER_SLOTS - 1));
+                        for (; node != NULL; node = next)
+                        {
+                                next = node->timer_next;
+                                timer_add (wheel, node);
+                        }
+                }
+
+                node = timer_take_slot (wheel, 0,
+                                        tick & (LRU_TIMER_SLOTS - 1));
+                for (; node != NULL; node = next)
+                {
+                        next = node->timer_next;
+                        node->timer_slot = LRU_TIMER_NONE;
+
+                        if (node->expires_at > tick)
+                        {
+                                timer_add (wheel, node);
+                                continue;
+                        }
+
+                        expire_node (cache, node);
+                        expired++;
+                }
+
+                wheel->now = tick + 1;
+        }
+
+        wheel->now = now + 1;
+
+        return expired;
+}
+
+/* Housekeeping done by every writer once it holds the lock. */
+static void
+maintain_cache (lru_cache_t *cache)
+{
+        release_spent (cache);
+        rehash_step (cache, LRU_CACHE_REHASH_STEP);
+        expire_entries (cache);
+}
+
+static int
+ensure_wheel (lru_cache_t *cache)
+{
+        if (cache->wheel != NULL)
+                return LRU_SUCCESS;
+
+        cache->wheel = calloc (1, sizeof (lru_timer_wheel_t));
+        if (cache->wheel == NULL)
+                return LRU_ERROR_NOMEM;
+        cache->wheel->now = monotonic_ms ();
+
+        return LRU_SUCCESS;
+}
+
+static int
+arm_timer (lru_cache_t *cache, lru_node_t *node)
+{
+        if (node->expires_at == 0)
+                return LRU_SUCCESS;
+
+        if (ensure_wheel (cache) != LRU_SUCCESS)
+                return LRU_ERROR_NOMEM;
+
+        timer_add (cache->wheel, node);
+
+        return LRU_SUCCESS;
+}
+
+static int
+set_expiry (lru_cache_t *cache, lru_node_t *node, uint64_t expires_at)
+{
+        if (node->timer_slot != LRU_TIMER_NONE)
+                timer_remove (cache->wheel, node);
+
+        node->expires_at = expires_at;
+
+        return arm_timer (cache, node);
+}
+
+/* With reuse set, the victim is detached but handed to the caller for
+ * recycle_node() instead of being freed.
+ */
+static int
+evict_lru (lru_cache_t *cache, lru_node_t **reuse)
+{
+        lru_node_t *lru_node;
+        lru_node_t *prev;
+
+        if (cache->tail == NULL)
+                return LRU_ERROR_NOT_FOUND;
+
+        /* Accessed nodes are cleared and promoted as they are passed, so
+         * the walk reaches them again only after every other candidate.
+         */
+        lru_node = cache->tail;
+        while (lru_node != NULL)
+        {
+                prev = lru_node->prev;
+
+                if (!node_pinned (lru_node))
+                {
+                        if (!lru_node->accessed)
+                                break;
+
+                        lru_node->accessed = false;
+                        record_access (cache, lru_node->hash);
+                        promote_node (cache, lru_node);
+                }
+
+                lru_node = prev;
+        }
+
+        if (lru_node == NULL)
+                return LRU_ERROR_FULL;
+
+        if (cache->tinylfu)
+                lru_node = admit_candidate (cache, lru_node);
+
+        if (cache->track_stats)
+                cache->stats.evictions++;
+
+        LRU_TRACE (cache, EVICT, lru_node->key, lru_node->key_size,
+                   lru_node->value_size);
+
+        /* A victim still owed a callback or a spill cannot be recycled. */
+        if (cache->tier != NULL)
+                tier_track (cache->tier, lru_node);
+
+        if (cache->eviction_fn != NULL || cache->tier != NULL)
+        {
+                queue_eviction (cache, lru_node);
+                return LRU_SUCCESS;
+        }
+
+        if (reuse == NULL)
+        {
+                unlink_node (cache, lru_node);
+                return LRU_SUCCESS;
+        }
+
+        detach_node (cache, lru_node);
+        *reuse = lru_node;
+
+        return LRU_SUCCESS;
+}
+
+static void
+trim_to_capacity (lru_cache_t *cache)
+{
+        while (over_capacity (cache))
+        {
+                if (evict_lru (cache, NULL) != LRU_SUCCESS)
+                        break;
+        }
+}
+
+/* Evicts from the LRU end until at most max_size entries and max_bytes
+ * remain.  The victims are cut off the tail of the list as one run and
+ * queued for unlock_cache(), which runs their callbacks and frees them
+ * once the lock is dropped.  Accessed entries
+ * get their second chance as in evict_lru() and pinned ones are set
+ * aside and put back at the tail; TinyLFU admission is not consulted.
+ * Returns the bytes released.
+ */
+static size_t
+evict_batch (lru_cache_t *cache, size_t max_size, size_t max_bytes)
+{
+        lru_node_t *node;
+        lru_node_t *next;
+        lru_node_t *prev;
+        lru_node_t *boundary;
+        lru_node_t *kept;
+        size_t  size;
+        size_t  bytes;
+        size_t  charge;
+        size_t  released;
+        bool    cut_window;
+        bool    cut_protected;
+
+        size = cache->size;
+        bytes = cache->bytes;
+        kept = NULL;
+
+        boundary = cache->tail;
+        while (boundary != NULL && (size > max_size || bytes > max_bytes))
+        {
+                node = boundary;
+                boundary = node->prev;
+
+                if (node_pinned (node))
+                {
+                        remove_from_list (cache, node);
+                        node->next = kept;
+                        kept = node;
+                }
+                else if (node->accessed)
+                {
+                        node->accessed = false;
+                        record_access (cache, node->hash);
+                        promote_node (cache, node);
+                }
+                else
+                {
+                        size--;
+                        bytes -= entry_charge (node->key_size,
+                                               node->value_size);
+                }
+        }
+
+        /* Once the walk is inside protected, the overflow of a promotion
+         * lands in probation below it and may be pinned.
+         */
+        if (cache->segmented)
+        {
+                node = boundary != NULL ? boundary->next : cache->head;
+                for (; node != NULL; node = next)
+                {
+                        next = node->next;
+                        if (!node_pinned (node))
+                                continue;
+
+                        remove_from_list (cache, node);
+                        node->next = kept;
+                        kept = node;
+                }
+        }
+
+        released = 0;
+        if (cache->tail != boundary)
+        {
+                cut_window = false;
+                cut_protected = false;
+
+                if (cache->tier != NULL)
+                        pthread_mutex_lock (&cache->tier->lock);
+
+                /* Oldest first, the order evict_lru() would go in. */
+                for (node = cache->tail; node != boundary; node = prev)
+                {
+                        prev = node->prev;
+
+                        cut_window |= node == cache->window_tail;
+                        cut_protected |= node == cache->protected_tail;
+
+                        LRU_TRACE (cache, EVICT, node->key, node->key_size,
+                                   node->value_size);
+
+                        if (cache->tier != NULL && !node_expired (node) &&
+                            node->value_size <= cache->tier->capacity)
+                                tier_add_entry (cache->tier, node);
+
+                        if (node->timer_slot != LRU_TIMER_NONE)
+                                timer_remove (cache->wheel, node);
+
+                        remove_from_hash_table (cache, node);
+
+                        charge = entry_charge (node->key_size,
+                                               node->value_size);
+                        cache->segment_size[node->segment]--;
+                        cache->size--;
+                        cache->bytes -= charge;
+                        released += charge;
+
+                        if (cache->track_stats)
+                                cache->stats.evictions++;
+
+                        node->next = NULL;
+                        if (cache->evicted_tail != NULL)
+                                cache->evicted_tail->next = node;
+                        else
+                                cache->evicted = node;
+                        cache->evicted_tail = node;
+                }
+
+                if (cache->tier != NULL)
+                        pthread_mutex_unlock (&cache->tier->lock);
+
+                /* Segments are contiguous, so one that lost its tail to
+                 * the cut now ends at the boundary if it ends at all.
+                 */
+                if (cut_window)
+                        cache->window_tail = boundary != NULL &&
+                                boundary->segment == LRU_SEGMENT_WINDOW ?
+                                boundary : NULL;
+                if (cut_protected)
+                        cache->protected_tail = boundary != NULL &&
+                                boundary->segment == LRU_SEGMENT_PROTECTED ?
+                                boundary : NULL;
+
+                cache->tail = boundary;
+                if (boundary != NULL)
+                        boundary->next = NULL;
+                else
+                        cache->head = NULL;
+        }
+
+        for (node = kept; node != NULL; node = next)
+        {
+                next = node->next;
+                append_node (cache, node);
+        }
+
+        return released;
+}
+
+/* A byte capacity says nothing about the entry count, so the index starts
+ * at the default size and grows with the entries.
+ */
+static size_t
+index_size_for (lru_cache_t *cache, size_t capacity)
+{
+        if (cache->byte_capacity)
+                return calculate_hash_table_size (cache->size >
+                                                  LRU_CACHE_DEFAULT_CAPACITY ?
+                                                  cache->size :
+                                                  LRU_CACHE_DEFAULT_CAPACITY);
+
+        return calculate_hash_table_size (cache->size > capacity ?
+                                          cache->size : capacity);
+}
+
+/* numa_node is LRU_NUMA_NO_NODE for an unbound cache.  A bound one
+ * keeps its nodes, with keys and values inline, and its index on that
+ * node.
+ */
+static lru_cache_t *
+create_cache (size_t capacity, unsigned int flags, int numa_node)
+{
+        lru_cache_t *cache = calloc (1, sizeof (lru_cache_t));
+
+        if (cache == NULL)
+                return NULL;
+
+        if (capacity < LRU_CACHE_MIN_CAPACITY)
+                capacity = LRU_CACHE_DEFAULT_CAPACITY;
+
+        cache->capacity = capacity;
+        cache->byte_limit = SIZE_MAX;
+        cache->open_addressing = (flags & LRU_CACHE_FLAG_OPEN_ADDRESSING) != 0;
+        cache->inline_nodes = (flags & LRU_CACHE_FLAG_INLINE_NODES) != 0;
+        cache->byte_capacity = (flags & LRU_CACHE_FLAG_BYTE_CAPACITY) != 0;
+        cache->deferred_promotion =
+                (flags & LRU_CACHE_FLAG_DEFERRED_PROMOTION) != 0;
+        cache->lockfree_reads = (flags & LRU_CACHE_FLAG_LOCKFREE_READS) != 0;
+        cache->tinylfu = (flags & LRU_CACHE_FLAG_TINYLFU) != 0;
+        cache->segmented = cache->tinylfu ||
+                (flags & LRU_CACHE_FLAG_SEGMENTED) != 0;
+        cache->huge_pages = (flags & LRU_CACHE_FLAG_HUGE_PAGES) != 0;
+        cache->numa_node = numa_node;
+
+        if (numa_node != LRU_NUMA_NO_NODE)
+                cache->inline_nodes = true;
+
+        if (cache->tinylfu)
+        {
+                cache->sketch_width = index_size_for (cache, capacity);
+                cache->sketch = calloc (LRU_SKETCH_DEPTH,
+                                        cache->sketch_width);
+                if (cache->sketch == NULL)
+                {
+                        free (cache);
+                        return NULL;
+                }
+        }
+
+        if (cache->lockfree_reads &&
+            posix_memalign ((void **) &cache->readers, LRU_CACHE_LINE_SIZE,
+                            LRU_CACHE_READER_STRIPES *
+                            sizeof (lru_reader_stripe_t)) != 0)
+        {
+                free (cache->sketch);
+                free (cache);
+                return NULL;
+        }
+
+        if (cache->readers != NULL)
+                memset (cache->readers, 0, LRU_CACHE_READER_STRIPES *
+                        sizeof (lru_reader_stripe_t));
+
+        if (posix_memalign ((void **) &cache->stat_stripes,
+                            LRU_CACHE_LINE_SIZE, LRU_CACHE_STAT_STRIPES *
+                            sizeof (lru_stat_stripe_t)) != 0)
+        {
+                free (cache->readers);
+                free (cache->sketch);
+                free (cache);
+                return NULL;
+        }
+        memset (cache->stat_stripes, 0, LRU_CACHE_STAT_STRIPES *
+                sizeof (lru_stat_stripe_t));
+
+        if ((flags & LRU_CACHE_FLAG_LATENCY_STATS) != 0)
+        {
+                if (posix_memalign ((void **) &cache->latency,
+                                    LRU_CACHE_LINE_SIZE,
+                                    LRU_CACHE_STAT_STRIPES *
+                                    sizeof (lru_latency_stripe_t)) != 0)
+                {
+                        free (cache->stat_stripes);
+                        free (cache->readers);
+                        free (cache->sketch);
+                        free (cache);
+                        return NULL;
+                }
+                memset (cache->latency, 0, LRU_CACHE_STAT_STRIPES *
+                        sizeof (lru_latency_stripe_t));
+        }
+
+        if (init_table (cache, &cache->table,
+                        index_size_for (cache, capacity)) != LRU_SUCCESS)
+        {
+                free (cache->latency);
+                free (cache->stat_stripes);
+                free (cache->readers);
+                free (cache->sketch);
+                free (cache);
+                return NULL;
+        }
+
+        cache->allocator.malloc_fn = default_malloc;
+        cache->allocator.free_fn = default_free;
+        cache->allocator.copy_fn = default_copy;
         cache->allocator.destroy_fn = default_destroy;
 
-        cache->hash_fn = default_hash;
-        cache->compare_fn = default_compare;
+        if (numa_node != LRU_NUMA_NO_NODE)
+        {
+                cache->allocator.malloc_fn = slab_malloc;
+                cache->allocator.free_fn = slab_free;
+        }
+
+        cache->hash_fn = default_hash;
+        cache->compare_fn = default_compare;
+
+        cache->thread_safe = true;
+        cache->track_stats = true;
+
+        if (pthread_rwlock_init (&cache->lock, NULL) != 0)
+                goto fail_lock;
+
+        if (pthread_mutex_init (&cache->flight_lock, NULL) != 0)
+        {
+                pthread_rwlock_destroy (&cache->lock);
+                goto fail_lock;
+        }
+
+        return cache;
+
+      fail_lock:
+        free_table (&cache->table);
+        free (cache->latency);
+        free (cache->stat_stripes);
+        free (cache->readers);
+        free (cache->sketch);
+        free (cache);
+        return NULL;
+}
+
+/* LRU_CACHE_FLAG_NUMA binds a standalone cache to the node of the
+ * creating thread.
+ */
+lru_cache_t *
+lru_cache_create_ex (size_t capacity, unsigned int flags)
+{
+        int     numa_node = LRU_NUMA_NO_NODE;
+
+        if ((flags & LRU_CACHE_FLAG_NUMA) != 0 && numa_node_count () > 1)
+                numa_node = numa_current_node ();
+
+        return create_cache (capacity, flags, numa_node);
+}
+
+lru_cache_t *
+lru_cache_create (size_t capacity)
+{
+        return lru_cache_create_ex (capacity, LRU_CACHE_FLAG_NONE);
+}
+
+int
+lru_cache_set_allocator (lru_cache_t *cache, const lru_allocator_t *allocator)
+{
+        if (cache == NULL || allocator == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (cache->size > 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (allocator->malloc_fn != NULL)
+                cache->allocator.malloc_fn = allocator->malloc_fn;
+
+        if (allocator->free_fn != NULL)
+                cache->allocator.free_fn = allocator->free_fn;
+
+        if (allocator->copy_fn != NULL)
+                cache->allocator.copy_fn = allocator->copy_fn;
+
+        if (allocator->destroy_fn != NULL)
+                cache->allocator.destroy_fn = allocator->destroy_fn;
+
+        return LRU_SUCCESS;
+}
+
+int
+lru_cache_set_hash_function (lru_cache_t *cache, lru_hash_fn hash_fn)
+{
+        if (cache == NULL || hash_fn == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (cache->size > 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        cache->hash_fn = hash_fn;
+        return LRU_SUCCESS;
+}
+
+int
+lru_cache_set_compare_function (lru_cache_t *cache, lru_compare_fn compare_fn)
+{
+        if (cache == NULL || compare_fn == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (cache->size > 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        cache->compare_fn = compare_fn;
+        return LRU_SUCCESS;
+}
+
+int
+lru_cache_set_eviction_callback (lru_cache_t *cache,
+                                 lru_eviction_fn eviction_fn, void *user_data)
+{
+        if (cache == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        cache->eviction_fn = eviction_fn;
+        cache->eviction_user_data = user_data;
+
+        return LRU_SUCCESS;
+}
+
+/* Stored values must all be in the form the hooks expect, and evicted,
+ * spilled or retired ones still count.  Called with the write lock held.
+ */
+static bool
+compression_settable (lru_cache_t *cache)
+{
+        return cache->size == 0 &&
+                __atomic_load_n (&cache->compressed_values,
+                                 __ATOMIC_RELAXED) == 0;
+}
+
+static void
+install_compression (lru_cache_t *cache, lru_compress_fn compress_fn,
+                     lru_decompress_fn decompress_fn, size_t threshold,
+                     void *user_data)
+{
+        __atomic_store_n (&cache->compress_fn, compress_fn, __ATOMIC_RELAXED);
+        cache->decompress_fn = decompress_fn;
+        cache->compress_threshold = threshold;
+        cache->compress_user_data = user_data;
+        __atomic_add_fetch (&cache->compress_generation, 1, __ATOMIC_RELEASE);
+}
+
+/* Values of at least threshold bytes are stored as compress_fn leaves
+ * them, when that saves space, and decompressed for every reader;
+ * byte accounting counts the compressed size.  compress_fn returns the
+ * compressed size, or 0 if the result does not fit in dst_capacity;
+ * decompress_fn returns the number of bytes it restored.  Pass both as
+ * NULL to turn compression off.  The hooks can only be changed while
+ * the cache is empty and no evicted or spilled value compressed with the
+ * old ones remains.  lru_cache_put_many() stores values as they are.
+ */
+int
+lru_cache_set_compression (lru_cache_t *cache, lru_compress_fn compress_fn,
+                           lru_decompress_fn decompress_fn, size_t threshold,
+                           void *user_data)
+{
+        int     result;
+
+        if (cache == NULL || (compress_fn == NULL) != (decompress_fn == NULL))
+                return LRU_ERROR_INVALID_ARG;
+
+        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
+                return LRU_ERROR_LOCK;
+
+        result = LRU_ERROR_INVALID_ARG;
+        if (compression_settable (cache))
+        {
+                install_compression (cache, compress_fn, decompress_fn,
+                                     threshold, user_data);
+                result = LRU_SUCCESS;
+        }
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        return result;
+}
+
+/* Spills evicted entries to a circular log of up to capacity bytes in the
+ * file at path, written in batches by a background thread.  A miss in
+ * lru_cache_get() checks the file and promotes what it finds back into
+ * memory.  The file is scratch space: it is truncated here and removed
+ * by lru_cache_destroy().
+ */
+int
+lru_cache_attach_tier (lru_cache_t *cache, const char *path, size_t capacity)
+{
+        lru_tier_t *tier;
+        int     result;
+
+        if (cache == NULL || path == NULL || capacity == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        tier = calloc (1, sizeof (lru_tier_t));
+        if (tier == NULL)
+                return LRU_ERROR_NOMEM;
+
+        tier->cache = cache;
+        tier->capacity = capacity;
+        tier->n_buckets = LRU_TIER_MIN_BUCKETS;
+        tier->path = strdup (path);
+        tier->buckets = calloc (tier->n_buckets, sizeof (lru_tier_entry_t *));
+        if (tier->path == NULL || tier->buckets == NULL)
+        {
+                result = LRU_ERROR_NOMEM;
+                goto fail_alloc;
+        }
+
+        tier->fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (tier->fd < 0)
+        {
+                result = LRU_ERROR_IO;
+                goto fail_alloc;
+        }
+
+        if (pthread_mutex_init (&tier->lock, NULL) != 0)
+        {
+                result = LRU_ERROR_LOCK;
+                goto fail_open;
+        }
+
+        if (pthread_cond_init (&tier->work, NULL) != 0)
+        {
+                result = LRU_ERROR_LOCK;
+                goto fail_mutex;
+        }
+
+        if (pthread_cond_init (&tier->idle, NULL) != 0)
+        {
+                result = LRU_ERROR_LOCK;
+                goto fail_work;
+        }
+
+        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
+        {
+                result = LRU_ERROR_LOCK;
+                goto fail_idle;
+        }
+
+        if (cache->tier != NULL)
+        {
+                result = LRU_ERROR_INVALID_ARG;
+                goto fail_locked;
+        }
+
+        if (pthread_create (&tier->writer, NULL, tier_writer, tier) != 0)
+        {
+                result = LRU_ERROR_NOMEM;
+                goto fail_locked;
+        }
+
+        cache->tier = tier;
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        return LRU_SUCCESS;
+
+      fail_locked:
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+      fail_idle:
+        pthread_cond_destroy (&tier->idle);
+      fail_work:
+        pthread_cond_destroy (&tier->work);
+      fail_mutex:
+        pthread_mutex_destroy (&tier->lock);
+      fail_open:
+        close (tier->fd);
+        unlink (path);
+      fail_alloc:
+        free (tier->buckets);
+        free (tier->path);
+        free (tier);
+        return result;
+}
+
+/* Waits until every spill queued so far has been written or dropped. */
+int
+lru_cache_flush_tier (lru_cache_t *cache)
+{
+        lru_tier_t *tier;
+
+        if (cache == NULL || cache->tier == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        tier = cache->tier;
+
+        pthread_mutex_lock (&tier->lock);
+        while (tier->count > 0)
+                pthread_cond_wait (&tier->idle, &tier->lock);
+        pthread_mutex_unlock (&tier->lock);
+
+        return LRU_SUCCESS;
+}
+
+static int
+update_value (lru_cache_t *cache, lru_node_t *node, const void *value,
+              size_t value_size, bool owned)
+{
+        void   *new_value;
+
+        if (node->inline_data)
+        {
+                memcpy (node->value, value, value_size);
+                return LRU_SUCCESS;
+        }
+
+        if (owned)
+                new_value = (void *) value;
+        else
+                new_value = cache->allocator.copy_fn (value, value_size);
+        if (new_value == NULL)
+                return LRU_ERROR_NOMEM;
+
+        cache->allocator.destroy_fn (node->value);
+        cache->bytes = cache->bytes - node->value_size + value_size;
+        node->value = new_value;
+        node->value_size = value_size;
+
+        return LRU_SUCCESS;
+}
+
+/* With owned set the cache adopts key and value on success, freeing them
+ * later with destroy_fn; on failure they stay the caller's.  A nonzero
+ * raw_size marks value as the compressed form of that many bytes.
+ */
+static int
+put_locked (lru_cache_t *cache, unsigned long hash, const void *key,
+            size_t key_size, const void *value, size_t value_size,
+            uint64_t expires_at, bool owned, size_t raw_size)
+{
+        lru_node_t *node;
+        lru_node_t *existing;
+        lru_node_t *victim;
+        size_t  charge;
+        int     result;
+
+        charge = entry_charge (key_size, value_size);
+        if ((cache->byte_capacity && charge > cache->capacity) ||
+            charge > cache->byte_limit)
+                return LRU_ERROR_FULL;
+
+        /* With the wheel in place arming the timer cannot fail, so
+         * nothing after the old entry is dropped can.
+         */
+        if (expires_at != 0 && ensure_wheel (cache) != LRU_SUCCESS)
+                return LRU_ERROR_NOMEM;
+
+        record_access (cache, hash);
+
+        existing = find_in_hash_table (cache, hash, key, key_size);
+
+        /* An acquired value must stay intact, so a pinned entry is
+         * replaced by a fresh node instead of being updated in place, as
+         * is an inline node whose value changes size.  Lock-free readers
+         * may be copying the value, so that mode always replaces too.  An
+         * owned value is adopted, which an inline node cannot do.
+         */
+        if (existing != NULL && !node_pinned (existing) &&
+            !cache->lockfree_reads &&
+            (!existing->inline_data ||
+             (!owned && existing->value_size == value_size)))
+        {
+                result = update_value (cache, existing, value, value_size,
+                                       owned);
+                if (result == LRU_SUCCESS)
+                {
+                        set_raw_size (cache, existing, raw_size);
+                        free (existing->inflated);
+                        existing->inflated = NULL;
+                        result = set_expiry (cache, existing, expires_at);
+                }
+                if (result == LRU_SUCCESS)
+                {
+                        if (owned)
+                                cache->allocator.destroy_fn ((void *) key);
+                        if (cache->tier != NULL)
+                                tier_invalidate (cache->tier, hash, key,
+                                                 key_size);
+                        promote_node (cache, existing);
+                        trim_to_capacity (cache);
+                }
+                return result;
+        }
+
+        /* The old entry stays in place, pinned so eviction passes it by,
+         * until its replacement is built and indexed; any failure before
+         * then leaves it untouched.
+         */
+        if (existing != NULL)
+                __atomic_add_fetch (&existing->refcount, 1, __ATOMIC_RELAXED);
+
+        victim = NULL;
+        while (needs_room (cache, charge, existing))
+        {
+                result = evict_lru (cache, victim == NULL &&
+                                    !cache->lockfree_reads ? &victim : NULL);
+                if (result != LRU_SUCCESS)
+                {
+                        destroy_node (cache, victim);
+                        goto unpin;
+                }
+        }
+
+        if (owned)
+                node = adopt_node (cache, victim, (void *) key, key_size,
+                                   (void *) value, value_size);
+        else if (victim != NULL)
+                node = recycle_node (cache, victim, key, key_size, value,
+                                     value_size);
+        else
+                node = create_node (cache, key, key_size, value, value_size);
+
+        if (node == NULL)
+        {
+                result = LRU_ERROR_NOMEM;
+                goto unpin;
+        }
+
+        if (!rehashing (cache) &&
+            cache->size + 1 > cache->table.size * LRU_CACHE_LOAD_FACTOR)
+                start_rehash (cache, cache->table.size * 2);
+
+        node->hash = hash;
+        node->expires_at = expires_at;
+        set_raw_size (cache, node, raw_size);
+        result = add_to_hash_table (cache, node, hash);
+        if (result != LRU_SUCCESS)
+        {
+                if (owned)
+                {
+                        node->key = NULL;
+                        node->value = NULL;
+                }
+                destroy_node (cache, node);
+                goto unpin;
+        }
+
+        /* Both nodes are briefly indexed; the old one is removed by node,
+         * not by key, so the new one is what lookups find from here on.
+         */
+        if (existing != NULL)
+        {
+                __atomic_sub_fetch (&existing->refcount, 1, __ATOMIC_RELAXED);
+                unlink_node (cache, existing);
+        }
+
+        insert_node (cache, node);
+        cache->size++;
+        cache->bytes += charge;
+
+        arm_timer (cache, node);
+
+        /* Only now is a copy in the tier stale; a failed put keeps it. */
+        if (cache->tier != NULL)
+                tier_invalidate (cache->tier, hash, key, key_size);
+
+        LRU_TRACE (cache, INSERT, node->key, node->key_size, value_size);
+
+        if (cache->track_stats)
+        {
+                if (existing == NULL)
+                        cache->stats.insertions++;
+                cache->stats.current_size = cache->size;
+                if (cache->size > cache->stats.peak_size)
+                        cache->stats.peak_size = cache->size;
+        }
+
+        return LRU_SUCCESS;
+
+      unpin:
+        if (existing != NULL)
+                __atomic_sub_fetch (&existing->refcount, 1, __ATOMIC_RELAXED);
+        return result;
+}
+
+/* Values are compressed before the lock is taken.  A compressed value
+ * is copied in, so an owned one is freed once it is cached.
+ */
+static int
+put_hashed (lru_cache_t *cache, unsigned long hash, const void *key,
+            size_t key_size, const void *value, size_t value_size,
+            uint64_t expires_at, bool owned)
+{
+        lru_compression_t hooks;
+        void   *compressed;
+        size_t  compressed_size;
+        uint64_t start;
+        int     result;
+
+        start = latency_start (cache);
+
+        snapshot_compression (cache, &hooks);
+        compressed = compress_value (&hooks, value, value_size,
+                                     &compressed_size);
+
+        if (lock_cache (cache, true) != LRU_SUCCESS)
+        {
+                free (compressed);
+                return LRU_ERROR_LOCK;
+        }
+
+        /* Compressed with hooks that have since been replaced; redo it
+         * with the current ones.
+         */
+        if (cache->compress_generation != hooks.generation)
+        {
+                free (compressed);
+                current_compression (cache, &hooks);
+                compressed = compress_value (&hooks, value, value_size,
+                                             &compressed_size);
+        }
+
+        maintain_cache (cache);
+
+        if (compressed != NULL)
+                result = put_locked (cache, hash, key, key_size, compressed,
+                                     compressed_size, expires_at, false,
+                                     value_size);
+        else
+                result = put_locked (cache, hash, key, key_size, value,
+                                     value_size, expires_at, owned, 0);
+
+        unlock_cache (cache);
+
+        if (compressed != NULL)
+        {
+                free (compressed);
+                if (owned && result == LRU_SUCCESS)
+                {
+                        cache->allocator.destroy_fn ((void *) key);
+                        cache->allocator.destroy_fn ((void *) value);
+                }
+        }
+
+        record_latency (cache, LRU_LATENCY_PUT, start);
+
+        return result;
+}
+
+int
+lru_cache_put (lru_cache_t *cache, const void *key, size_t key_size,
+               const void *value, size_t value_size)
+{
+        if (cache == NULL || key == NULL || value == NULL ||
+            key_size == 0 || value_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return put_hashed (cache, cache->hash_fn (key, key_size), key,
+                           key_size, value, value_size, 0, false);
+}
+
+/* Like lru_cache_put(), but on success the cache takes ownership of key
+ * and value instead of copying them and frees them with the allocator's
+ * destroy_fn, so both must come from the allocator it pairs with
+ * (malloc() by default).  On failure they still belong to the caller.
+ */
+int
+lru_cache_put_owned (lru_cache_t *cache, void *key, size_t key_size,
+                     void *value, size_t value_size)
+{
+        if (cache == NULL || key == NULL || value == NULL ||
+            key_size == 0 || value_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return put_hashed (cache, cache->hash_fn (key, key_size), key,
+                           key_size, value, value_size, 0, true);
+}
+
+/* Like lru_cache_put(), but the entry expires ttl_ms milliseconds from
+ * now.  A plain lru_cache_put() of the same key clears the expiry.
+ */
+int
+lru_cache_put_ttl (lru_cache_t *cache, const void *key, size_t key_size,
+                   const void *value, size_t value_size, uint64_t ttl_ms)
+{
+        if (cache == NULL || key == NULL || value == NULL ||
+            key_size == 0 || value_size == 0 || ttl_ms == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return put_hashed (cache, cache->hash_fn (key, key_size), key,
+                           key_size, value, value_size,
+                           monotonic_ms () + ttl_ms, false);
+}
+
+/* Reclaims every expired entry now instead of waiting for the next
+ * write; returns how many were removed.
+ */
+size_t
+lru_cache_expire (lru_cache_t *cache)
+{
+        size_t  expired;
+
+        if (cache == NULL)
+                return 0;
+
+        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
+                return 0;
+
+        release_spent (cache);
+        expired = expire_entries (cache);
+
+        unlock_cache (cache);
+
+        return expired;
+}
+
+/* A hit in deferred mode only sets the access bit, which is safe under
+ * the read lock; evict_lru() gives accessed nodes a second chance
+ * instead of every hit relinking the list.
+ */
+static void
+touch_node (lru_cache_t *cache, lru_node_t *node)
+{
+        if (!cache->deferred_promotion)
+        {
+                record_access (cache, node->hash);
+                promote_node (cache, node);
+                return;
+        }
+
+        if (!__atomic_load_n (&node->accessed, __ATOMIC_RELAXED))
+                __atomic_store_n (&node->accessed, true, __ATOMIC_RELAXED);
+}
+
+static int
+lock_for_lookup (lru_cache_t *cache)
+{
+        if (cache->deferred_promotion)
+        {
+                if (lock_cache (cache, false) != LRU_SUCCESS)
+                        return LRU_ERROR_LOCK;
+
+                return LRU_SUCCESS;
+        }
+
+        if (lock_cache (cache, true) != LRU_SUCCESS)
+                return LRU_ERROR_LOCK;
+
+        maintain_cache (cache);
+
+        return LRU_SUCCESS;
+}
+
+static int
+get_locked (lru_cache_t *cache, unsigned long hash, const void *key,
+            size_t key_size, void **value, size_t *value_size)
+{
+        lru_node_t *node;
+
+        node = find_in_hash_table (cache, hash, key, key_size);
+
+        /* Under the read lock an expired entry is only hidden; the wheel
+         * reclaims it on the next write.
+         */
+        if (node != NULL && node_expired (node))
+        {
+                if (!cache->deferred_promotion)
+                        expire_node (cache, node);
+                node = NULL;
+        }
+
+        LRU_TRACE (cache, LOOKUP, key, key_size, node != NULL);
+
+        if (node == NULL)
+        {
+                count_stat (cache, LRU_STAT_MISSES);
+
+                return LRU_ERROR_NOT_FOUND;
+        }
+
+        touch_node (cache, node);
+
+        if (copy_value (cache, node, value, value_size) != LRU_SUCCESS)
+                return LRU_ERROR_NOMEM;
+
+        count_stat (cache, LRU_STAT_HITS);
+
+        return LRU_SUCCESS;
+}
+
+static int
+tier_value_out (lru_cache_t *cache, void *buffer, size_t size,
+                size_t raw_size, void **value, size_t *value_size)
+{
+        void   *raw;
+
+        if (raw_size != 0)
+        {
+                raw = decompress_value (cache, buffer, size, raw_size);
+                free (buffer);
+                if (raw == NULL)
+                        return LRU_ERROR_NOMEM;
+                buffer = raw;
+                size = raw_size;
+        }
+
+        *value = hand_out_value (cache, buffer, size);
+        if (*value == NULL)
+                return LRU_ERROR_NOMEM;
+
+        if (value_size != NULL)
+                *value_size = size;
+
+        return LRU_SUCCESS;
+}
+
+/* A hit in the tier is promoted back into memory unless the key was
+ * written, deleted or already reloaded since it was read.  Keys only
+ * change under the write lock, so finding the same entry under it is
+ * enough; the put then drops the entry from the tier, and a failed one
+ * leaves it there.  The value is decompressed under the lock too, and
+ * only if the hooks it was compressed with are still installed: if they
+ * changed, every compressed value, this key's included, was gone first.
+ */
+static int
+get_from_tier (lru_cache_t *cache, lru_tier_t *tier, unsigned long hash,
+               const void *key, size_t key_size, void **value,
+               size_t *value_size)
+{
+        void   *buffer;
+        size_t  size;
+        size_t  raw_size;
+        uint64_t expires_at;
+        uint64_t version;
+        unsigned long generation;
+        bool    current;
+        int     result;
+
+        generation = __atomic_load_n (&cache->compress_generation,
+                                      __ATOMIC_ACQUIRE);
+        result = tier_fetch (tier, hash, key, key_size, &buffer, &size,
+                             &raw_size, &expires_at, &version);
+        if (result != LRU_SUCCESS)
+                return result == LRU_ERROR_NOMEM ? result :
+                        LRU_ERROR_NOT_FOUND;
+
+        if (lock_cache (cache, true) != LRU_SUCCESS)
+        {
+                free (buffer);
+                return LRU_ERROR_LOCK;
+        }
+
+        maintain_cache (cache);
+
+        if (raw_size != 0 && cache->compress_generation != generation)
+        {
+                free (buffer);
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        pthread_mutex_lock (&tier->lock);
+        current = tier_find_version (tier, hash, key, key_size,
+                                     version) != NULL;
+        pthread_mutex_unlock (&tier->lock);
+
+        if (current && find_in_hash_table (cache, hash, key, key_size) == NULL)
+                put_locked (cache, hash, key, key_size, buffer, size,
+                            expires_at, false, raw_size);
+
+        result = tier_value_out (cache, buffer, size, raw_size, value,
+                                 value_size);
+
+      cleanup:
+        unlock_cache (cache);
+
+        return result;
+}
+
+static int
+get_hashed (lru_cache_t *cache, unsigned long hash, const void *key,
+            size_t key_size, void **value, size_t *value_size)
+{
+        lru_tier_t *tier;
+        uint64_t start;
+        int     result;
+
+        start = latency_start (cache);
+
+        if (lock_for_lookup (cache) != LRU_SUCCESS)
+                return LRU_ERROR_LOCK;
+
+        result = get_locked (cache, hash, key, key_size, value, value_size);
+        tier = cache->tier;
+
+        unlock_cache (cache);
+
+        if (result == LRU_ERROR_NOT_FOUND && tier != NULL)
+                result = get_from_tier (cache, tier, hash, key, key_size,
+                                        value, value_size);
+
+        record_latency (cache, LRU_LATENCY_GET, start);
+
+        return result;
+}
+
+int
+lru_cache_get (lru_cache_t *cache, const void *key, size_t key_size,
+               void **value, size_t *value_size)
+{
+        if (cache == NULL || key == NULL || value == NULL || key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return get_hashed (cache, cache->hash_fn (key, key_size), key,
+                           key_size, value, value_size);
+}
+
+static int
+peek_lockfree (lru_cache_t *cache, unsigned long hash, const void *key,
+               size_t key_size, void **value, size_t *value_size)
+{
+        unsigned long *active;
+        lru_node_t *node;
+        int     result;
+
+        active = reader_enter (cache);
+
+        node = find_lockfree (cache, hash, key, key_size);
+
+        if (node == NULL || node_expired (node))
+        {
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        result = copy_value (cache, node, value, value_size);
+
+      cleanup:
+        reader_exit (active);
+
+        return result;
+}
+
+static int
+peek_hashed (lru_cache_t *cache, unsigned long hash, const void *key,
+             size_t key_size, void **value, size_t *value_size)
+{
+        lru_node_t *node;
+        int     result;
+
+        if (cache->lockfree_reads)
+                return peek_lockfree (cache, hash, key, key_size, value,
+                                      value_size);
+
+        if (lock_cache (cache, false) != LRU_SUCCESS)
+                return LRU_ERROR_LOCK;
+
+        node = find_in_hash_table (cache, hash, key, key_size);
+
+        if (node == NULL || node_expired (node))
+        {
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        result = copy_value (cache, node, value, value_size);
+
+      cleanup:
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        return result;
+}
+
+int
+lru_cache_peek (lru_cache_t *cache, const void *key, size_t key_size,
+                void **value, size_t *value_size)
+{
+        if (cache == NULL || key == NULL || value == NULL || key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return peek_hashed (cache, cache->hash_fn (key, key_size), key,
+                            key_size, value, value_size);
+}
+
+static lru_flight_t *
+find_flight (lru_cache_t *cache, unsigned long hash, const void *key,
+             size_t key_size)
+{
+        lru_flight_t *flight;
+
+        for (flight = cache->flights[hash % LRU_CACHE_FLIGHT_BUCKETS];
+             flight != NULL; flight = flight->next)
+        {
+                if (flight->hash == hash &&
+                    cache->compare_fn (flight->key, flight->key_size, key,
+                                       key_size) == 0)
+                        return flight;
+        }
+
+        return NULL;
+}
+
+/* Drops a reference to a finished flight with flight_lock held.  The last
+ * caller out takes the loaded value itself, the others copy it.
+ */
+static int
+leave_flight (lru_cache_t *cache, lru_flight_t *flight, void **value,
+              size_t *value_size)
+{
+        int     result;
+
+        result = flight->result;
+
+        if (--flight->refs == 0)
+        {
+                if (result == LRU_SUCCESS)
+                {
+                        *value = flight->value;
+                        if (value_size != NULL)
+                                *value_size = flight->value_size;
+                }
+
+                pthread_cond_destroy (&flight->done);
+                free (flight);
+
+                return result;
+        }
+
+        if (result != LRU_SUCCESS)
+                return result;
+
+        *value = cache->allocator.copy_fn (flight->value, flight->value_size);
+        if (*value == NULL)
+                return LRU_ERROR_NOMEM;
+
+        if (value_size != NULL)
+                *value_size = flight->value_size;
+
+        return LRU_SUCCESS;
+}
+
+static int
+get_or_load_hashed (lru_cache_t *cache, unsigned long hash, const void *key,
+                    size_t key_size, lru_loader_fn loader, void *ctx,
+                    void **value, size_t *value_size)
+{
+        lru_flight_t *flight;
+        lru_flight_t **bucket;
+        int     result;
+
+        result = get_hashed (cache, hash, key, key_size, value, value_size);
+        if (result != LRU_ERROR_NOT_FOUND)
+                return result;
+
+        pthread_mutex_lock (&cache->flight_lock);
+
+        flight = find_flight (cache, hash, key, key_size);
+        if (flight != NULL)
+        {
+                flight->refs++;
+                while (!flight->finished)
+                        pthread_cond_wait (&flight->done, &cache->flight_lock);
+
+                result = leave_flight (cache, flight, value, value_size);
+                pthread_mutex_unlock (&cache->flight_lock);
+
+                return result;
+        }
+
+        flight = calloc (1, sizeof (lru_flight_t));
+        if (flight == NULL || pthread_cond_init (&flight->done, NULL) != 0)
+        {
+                pthread_mutex_unlock (&cache->flight_lock);
+                free (flight);
+                return LRU_ERROR_NOMEM;
+        }
+
+        flight->hash = hash;
+        flight->key = key;
+        flight->key_size = key_size;
+        flight->refs = 1;
+
+        bucket = &cache->flights[hash % LRU_CACHE_FLIGHT_BUCKETS];
+        flight->next = *bucket;
+        *bucket = flight;
+
+        pthread_mutex_unlock (&cache->flight_lock);
+
+        /* A load that finished between the miss and the registration has
+         * already filled the entry.
+         */
+        result = peek_hashed (cache, hash, key, key_size, &flight->value,
+                              &flight->value_size);
+        if (result == LRU_ERROR_NOT_FOUND)
+        {
+                result = loader (key, key_size, &flight->value,
+                                 &flight->value_size, ctx);
+
+                /* Failing to cache the value does not fail the load. */
+                if (result == LRU_SUCCESS)
+                        put_hashed (cache, hash, key, key_size, flight->value,
+                                    flight->value_size, 0, false);
+        }
+
+        pthread_mutex_lock (&cache->flight_lock);
+
+        for (bucket = &cache->flights[hash % LRU_CACHE_FLIGHT_BUCKETS];
+             *bucket != flight; bucket = &(*bucket)->next)
+                ;
+        *bucket = flight->next;
+
+        flight->result = result;
+        flight->finished = true;
+        pthread_cond_broadcast (&flight->done);
+
+        result = leave_flight (cache, flight, value, value_size);
+        pthread_mutex_unlock (&cache->flight_lock);
+
+        return result;
+}
+
+/* Returns the cached value for key, or calls loader to produce it on a
+ * miss and caches the result.  Concurrent misses on the same key wait for
+ * the one load already running rather than calling loader themselves.
+ * loader must return its value in memory the cache's destroy_fn can free.
+ * The cache stores its own copy; the loader's buffer goes to one waiter as
+ * *value and the others receive copies, so every caller frees *value as
+ * with lru_cache_get().  A loader error is returned to every waiter and
+ * nothing is cached.
+ */
+int
+lru_cache_get_or_load (lru_cache_t *cache, const void *key, size_t key_size,
+                       lru_loader_fn loader, void *ctx, void **value,
+                       size_t *value_size)
+{
+        if (cache == NULL || key == NULL || key_size == 0 || loader == NULL ||
+            value == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        return get_or_load_hashed (cache, cache->hash_fn (key, key_size), key,
+                                   key_size, loader, ctx, value, value_size);
+}
+
+/* A compressed entry is decompressed once for its first handle and the
+ * copy kept until the node goes, so handles can borrow it.  Under the
+ * read lock two threads may race to do it; the loser frees its copy.
+ */
+static int
+inflate_node (lru_cache_t *cache, lru_node_t *node)
+{
+        void   *expected;
+        void   *buffer;
+
+        if (__atomic_load_n (&node->inflated, __ATOMIC_ACQUIRE) != NULL)
+                return LRU_SUCCESS;
+
+        buffer = decompress_value (cache, node->value, node->value_size,
+                                   node->raw_size);
+        if (buffer == NULL)
+                return LRU_ERROR_NOMEM;
+
+        expected = NULL;
+        if (!__atomic_compare_exchange_n (&node->inflated, &expected, buffer,
+                                          false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE))
+                free (buffer);
+
+        return LRU_SUCCESS;
+}
+
+static int
+acquire_hashed (lru_cache_t *cache, unsigned long hash, const void *key,
+                size_t key_size, const void **value, size_t *value_size,
+                lru_handle_t **handle)
+{
+        lru_node_t *node;
+        int     result;
+
+        if (lock_for_lookup (cache) != LRU_SUCCESS)
+                return LRU_ERROR_LOCK;
+
+        node = find_in_hash_table (cache, hash, key, key_size);
+
+        if (node != NULL && node_expired (node))
+        {
+                if (!cache->deferred_promotion)
+                        expire_node (cache, node);
+                node = NULL;
+        }
+
+        LRU_TRACE (cache, LOOKUP, key, key_size, node != NULL);
+
+        if (node == NULL)
+        {
+                count_stat (cache, LRU_STAT_MISSES);
+
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        if (node->raw_size != 0 && inflate_node (cache, node) != LRU_SUCCESS)
+        {
+                result = LRU_ERROR_NOMEM;
+                goto cleanup;
+        }
+
+        touch_node (cache, node);
+
+        __atomic_add_fetch (&node->refcount, 1, __ATOMIC_RELAXED);
+
+        if (node->raw_size != 0)
+                *value = __atomic_load_n (&node->inflated, __ATOMIC_ACQUIRE);
+        else
+                *value = node->value;
+        if (value_size != NULL)
+                *value_size = raw_value_size (node);
+        *handle = node;
+
+        count_stat (cache, LRU_STAT_HITS);
+
+        result = LRU_SUCCESS;
+
+      cleanup:
+        unlock_cache (cache);
+
+        return result;
+}
+
+/* Like lru_cache_get(), but returns a pointer to the cached value instead
+ * of a copy.  The entry is pinned against eviction and deletion frees it
+ * only once every handle has been passed to lru_cache_release().  All
+ * handles must be released before the cache is destroyed.
+ */
+int
+lru_cache_acquire (lru_cache_t *cache, const void *key, size_t key_size,
+                   const void **value, size_t *value_size,
+                   lru_handle_t **handle)
+{
+        if (cache == NULL || key == NULL || value == NULL || handle == NULL ||
+            key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return acquire_hashed (cache, cache->hash_fn (key, key_size), key,
+                               key_size, value, value_size, handle);
+}
+
+void
+lru_cache_release (lru_cache_t *cache, lru_handle_t *handle)
+{
+        if (cache == NULL || handle == NULL)
+                return;
+
+        if (__atomic_sub_fetch (&handle->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+                return;
+
+        /* The entry left the cache while pinned; free it under the lock so
+         * the allocator hooks are never called concurrently.
+         */
+        if (cache->thread_safe)
+                pthread_rwlock_wrlock (&cache->lock);
+
+        free_node (cache, handle);
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+}
+
+static int
+delete_hashed (lru_cache_t *cache, unsigned long hash, const void *key,
+               size_t key_size)
+{
+        lru_node_t *node;
+        uint64_t start;
+        bool    spilled;
+        int     result;
+
+        start = latency_start (cache);
+
+        if (lock_cache (cache, true) != LRU_SUCCESS)
+                return LRU_ERROR_LOCK;
+
+        rehash_step (cache, LRU_CACHE_REHASH_STEP);
+
+        spilled = cache->tier != NULL &&
+                tier_invalidate (cache->tier, hash, key, key_size);
+
+        node = find_in_hash_table (cache, hash, key, key_size);
+
+        if (node == NULL && !spilled)
+        {
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        if (node != NULL)
+                unlink_node (cache, node);
+
+        if (cache->track_stats)
+        {
+                cache->stats.deletions++;
+                cache->stats.current_size = cache->size;
+        }
+
+        result = LRU_SUCCESS;
+
+      cleanup:
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        record_latency (cache, LRU_LATENCY_DELETE, start);
+
+        return result;
+}
+
+int
+lru_cache_delete (lru_cache_t *cache, const void *key, size_t key_size)
+{
+        if (cache == NULL || key == NULL || key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return delete_hashed (cache, cache->hash_fn (key, key_size), key,
+                              key_size);
+}
+
+/* The value buffer is handed over as it is unless an inline node holds
+ * it, a handle still pins it, a lock-free reader may be copying it or it
+ * is compressed; only then is the caller given a copy.  A key not in
+ * memory reports the tier to look in next.
+ */
+static int
+take_from_memory (lru_cache_t *cache, unsigned long hash, const void *key,
+                  size_t key_size, void **value, size_t *value_size,
+                  lru_tier_t **tier)
+{
+        lru_node_t *node;
+        int     result;
+
+        *tier = NULL;
+
+        if (lock_cache (cache, true) != LRU_SUCCESS)
+                return LRU_ERROR_LOCK;
+
+        rehash_step (cache, LRU_CACHE_REHASH_STEP);
+
+        node = find_in_hash_table (cache, hash, key, key_size);
+
+        if (node != NULL && node_expired (node))
+        {
+                expire_node (cache, node);
+                node = NULL;
+        }
+
+        if (node == NULL)
+        {
+                *tier = cache->tier;
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        if (!node->inline_data && !node_pinned (node) &&
+            !cache->lockfree_reads && node->raw_size == 0)
+        {
+                *value = node->value;
+                node->value = NULL;
+                if (value_size != NULL)
+                        *value_size = node->value_size;
+        }
+        else
+        {
+                result = copy_value (cache, node, value, value_size);
+                if (result != LRU_SUCCESS)
+                        goto cleanup;
+        }
+
+        unlink_node (cache, node);
+
+        if (cache->track_stats)
+        {
+                cache->stats.deletions++;
+                cache->stats.current_size = cache->size;
+        }
+
+        result = LRU_SUCCESS;
+
+      cleanup:
+        unlock_cache (cache);
+
+        return result;
+}
+
+/* Reads the key from the tier without the cache lock, then takes the
+ * lock and removes the entry if it is still the one read.  changed is set
+ * when it is not, since the key may have been put back meanwhile.
+ */
+static int
+take_from_tier (lru_cache_t *cache, lru_tier_t *tier, unsigned long hash,
+                const void *key, size_t key_size, void **value,
+                size_t *value_size, bool *changed)
+{
+        void   *buffer;
+        size_t  size;
+        size_t  raw_size;
+        uint64_t expires_at;
+        uint64_t version;
+        bool    current;
+        int     result;
+
+        result = tier_fetch (tier, hash, key, key_size, &buffer, &size,
+                             &raw_size, &expires_at, &version);
+        if (result != LRU_SUCCESS)
+                return result == LRU_ERROR_NOMEM ? result :
+                        LRU_ERROR_NOT_FOUND;
+
+        if (lock_cache (cache, true) != LRU_SUCCESS)
+        {
+                free (buffer);
+                return LRU_ERROR_LOCK;
+        }
+
+        pthread_mutex_lock (&tier->lock);
+        current = tier_find_version (tier, hash, key, key_size,
+                                     version) != NULL;
+        pthread_mutex_unlock (&tier->lock);
+
+        if (!current)
+        {
+                free (buffer);
+                *changed = true;
+                result = LRU_ERROR_NOT_FOUND;
+                goto cleanup;
+        }
+
+        /* A current entry still pins the hooks it was compressed with. */
+        result = tier_value_out (cache, buffer, size, raw_size, value,
+                                 value_size);
+        if (result == LRU_SUCCESS)
+                tier_forget (tier, hash, key, key_size, version);
+
+      cleanup:
+        unlock_cache (cache);
+
+        return result;
+}
+
+static int
+take_hashed (lru_cache_t *cache, unsigned long hash, const void *key,
+             size_t key_size, void **value, size_t *value_size)
+{
+        lru_tier_t *tier;
+        uint64_t start;
+        bool    changed;
+        int     result;
+
+        start = latency_start (cache);
+
+        do
+        {
+                changed = false;
+                result = take_from_memory (cache, hash, key, key_size, value,
+                                           value_size, &tier);
+                if (result == LRU_ERROR_NOT_FOUND && tier != NULL)
+                        result = take_from_tier (cache, tier, hash, key,
+                                                 key_size, value, value_size,
+                                                 &changed);
+        }
+        while (changed);
+
+        record_latency (cache, LRU_LATENCY_DELETE, start);
+
+        return result;
+}
+
+/* Removes the entry and hands its value to the caller, who frees it with
+ * the allocator's destroy_fn, instead of copying it and then freeing the
+ * cached one.
+ */
+int
+lru_cache_take (lru_cache_t *cache, const void *key, size_t key_size,
+                void **value, size_t *value_size)
+{
+        if (cache == NULL || key == NULL || value == NULL || key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        return take_hashed (cache, cache->hash_fn (key, key_size), key,
+                            key_size, value, value_size);
+}
+
+static bool
+contains_hashed (lru_cache_t *cache, unsigned long hash, const void *key,
+                 size_t key_size)
+{
+        unsigned long *active;
+        lru_node_t *node;
+        bool    result;
+
+        if (cache->lockfree_reads)
+        {
+                active = reader_enter (cache);
+                node = find_lockfree (cache, hash, key, key_size);
+                result = node != NULL && !node_expired (node);
+                reader_exit (active);
+
+                return result;
+        }
+
+        if (lock_cache (cache, false) != LRU_SUCCESS)
+                return false;
+
+        node = find_in_hash_table (cache, hash, key, key_size);
+        result = node != NULL && !node_expired (node);
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        return result;
+}
+
+bool
+lru_cache_contains (lru_cache_t *cache, const void *key, size_t key_size)
+{
+        if (cache == NULL || key == NULL || key_size == 0)
+                return false;
+
+        return contains_hashed (cache, cache->hash_fn (key, key_size), key,
+                                key_size);
+}
+
+/* Keys of one chunk of a batched call; every array is indexed relative
+ * to the chunk.
+ */
+typedef struct lru_batch
+{
+        const void *const *keys;
+        const size_t *key_sizes;
+        void  **values;
+        size_t *value_sizes;
+        const void *const *put_values;
+        const size_t *put_value_sizes;
+        int    *results;
+        unsigned long hashes[LRU_CACHE_BATCH_SIZE];
+        size_t  shards[LRU_CACHE_BATCH_SIZE];
+        size_t  members[LRU_CACHE_BATCH_SIZE];
+        int     scratch[LRU_CACHE_BATCH_SIZE];
+} lru_batch_t;
+
+static void
+prefetch_bucket (lru_cache_t *cache, unsigned long hash)
+{
+        if (cache->open_addressing)
+                __builtin_prefetch (&cache->table.slots
+                                    [slot_home (&cache->table, hash)]);
+        else
+                __builtin_prefetch (&cache->table.buckets
+                                    [hash_key (&cache->table, hash)]);
+}
+
+/* Second prefetch stage, run once the buckets are on their way: pulls in
+ * the node the bucket points at, finding it from the embedded hash entry
+ * so that nothing but the bucket itself is read.
+ */
+static void
+prefetch_node (lru_cache_t *cache, unsigned long hash)
+{
+        lru_hash_entry_t *entry;
+        lru_node_t *node;
+
+        if (cache->open_addressing)
+                node = cache->table.slots[slot_home (&cache->table,
+                                                     hash)].node;
+        else
+        {
+                entry = cache->table.buckets[hash_key (&cache->table, hash)];
+                node = entry == NULL ? NULL : (lru_node_t *)
+                        ((unsigned char *) entry -
+                         offsetof (lru_node_t, hash_entry));
+        }
+
+        if (node != NULL)
+        {
+                __builtin_prefetch (node);
+                __builtin_prefetch (&node->hash);
+        }
+}
+
+/* Hashes a chunk outside of any lock; invalid keys get their result set
+ * here and are skipped by run_batch().
+ */
+static void
+hash_batch (lru_batch_t *batch, size_t n, lru_hash_fn hash_fn, bool put)
+{
+        size_t  i;
+
+        for (i = 0; i < n; i++)
+        {
+                if (batch->keys[i] == NULL || batch->key_sizes[i] == 0 ||
+                    (put && (batch->put_values[i] == NULL ||
+                             batch->put_value_sizes[i] == 0)))
+                {
+                        batch->results[i] = LRU_ERROR_INVALID_ARG;
+                        continue;
+                }
+
+                batch->results[i] = LRU_SUCCESS;
+                batch->hashes[i] = hash_fn (batch->keys[i],
+                                            batch->key_sizes[i]);
+        }
+}
+
+/* Runs the members of a chunk that belong to one cache under a single
+ * lock acquisition, prefetching all their buckets and then the nodes
+ * they lead to before probing.
+ */
+static int
+run_batch (lru_cache_t *cache, lru_batch_t *batch, size_t n, bool put)
+{
+        size_t  i;
+        size_t  k;
+        int     result;
+
+        if (put)
+        {
+                result = LRU_SUCCESS;
+                if (lock_cache (cache, true) != LRU_SUCCESS)
+                        result = LRU_ERROR_LOCK;
+                else
+                        maintain_cache (cache);
+        }
+        else
+                result = lock_for_lookup (cache);
+
+        if (result != LRU_SUCCESS)
+        {
+                for (i = 0; i < n; i++)
+                        batch->results[batch->members[i]] = LRU_ERROR_LOCK;
+                return LRU_ERROR_LOCK;
+        }
+
+        for (i = 0; i < n; i++)
+                prefetch_bucket (cache, batch->hashes[batch->members[i]]);
+
+        for (i = 0; i < n; i++)
+                prefetch_node (cache, batch->hashes[batch->members[i]]);
+
+        for (i = 0; i < n; i++)
+        {
+                k = batch->members[i];
+
+                if (put)
+                        batch->results[k] =
+                                put_locked (cache, batch->hashes[k],
+                                            batch->keys[k],
+                                            batch->key_sizes[k],
+                                            batch->put_values[k],
+                                            batch->put_value_sizes[k], 0,
+                                            false, 0);
+                else
+                        batch->results[k] =
+                                get_locked (cache, batch->hashes[k],
+                                            batch->keys[k],
+                                            batch->key_sizes[k],
+                                            &batch->values[k],
+                                            batch->value_sizes != NULL ?
+                                            &batch->value_sizes[k] : NULL);
+        }
+
+        unlock_cache (cache);
+
+        return LRU_SUCCESS;
+}
+
+static int
+run_cache_batch (lru_cache_t *cache, lru_batch_t *batch, size_t n, bool put)
+{
+        size_t  members;
+        size_t  i;
+
+        hash_batch (batch, n, cache->hash_fn, put);
+
+        members = 0;
+        for (i = 0; i < n; i++)
+        {
+                if (batch->results[i] == LRU_SUCCESS)
+                        batch->members[members++] = i;
+        }
+
+        if (members == 0)
+                return LRU_SUCCESS;
+
+        return run_batch (cache, batch, members, put);
+}
+
+static int
+first_failure (const int *results, size_t n)
+{
+        size_t  i;
+
+        for (i = 0; i < n; i++)
+        {
+                if (results[i] != LRU_SUCCESS)
+                        return results[i];
+        }
+
+        return LRU_SUCCESS;
+}
+
+/* Looks up count keys taking the cache lock once per LRU_CACHE_BATCH_SIZE
+ * keys.  results[i] receives the lru_cache_get() result for keys[i]; the
+ * return value only reports argument and locking errors.
+ */
+int
+lru_cache_get_many (lru_cache_t *cache, size_t count,
+                    const void *const *keys, const size_t *key_sizes,
+                    void **values, size_t *value_sizes, int *results)
+{
+        lru_batch_t batch;
+        size_t  base;
+        size_t  n;
+        int     result;
+
+        if (cache == NULL || keys == NULL || key_sizes == NULL ||
+            values == NULL || results == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        result = LRU_SUCCESS;
+
+        for (base = 0; base < count; base += n)
+        {
+                n = count - base;
+                if (n > LRU_CACHE_BATCH_SIZE)
+                        n = LRU_CACHE_BATCH_SIZE;
+
+                batch.keys = keys + base;
+                batch.key_sizes = key_sizes + base;
+                batch.values = values + base;
+                batch.value_sizes = value_sizes != NULL ?
+                        value_sizes + base : NULL;
+                batch.results = results + base;
+
+                if (run_cache_batch (cache, &batch, n, false) != LRU_SUCCESS)
+                        result = LRU_ERROR_LOCK;
+        }
+
+        return result;
+}
+
+/* Stores count entries taking the cache lock once per LRU_CACHE_BATCH_SIZE
+ * entries.  Returns LRU_SUCCESS when every entry was stored and otherwise
+ * the first failure; results, if not NULL, receives per-entry codes.
+ */
+int
+lru_cache_put_many (lru_cache_t *cache, size_t count,
+                    const void *const *keys, const size_t *key_sizes,
+                    const void *const *values, const size_t *value_sizes,
+                    int *results)
+{
+        lru_batch_t batch;
+        size_t  base;
+        size_t  n;
+        int     result;
+
+        if (cache == NULL || keys == NULL || key_sizes == NULL ||
+            values == NULL || value_sizes == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        result = LRU_SUCCESS;
+
+        for (base = 0; base < count; base += n)
+        {
+                n = count - base;
+                if (n > LRU_CACHE_BATCH_SIZE)
+                        n = LRU_CACHE_BATCH_SIZE;
+
+                batch.keys = keys + base;
+                batch.key_sizes = key_sizes + base;
+                batch.put_values = values + base;
+                batch.put_value_sizes = value_sizes + base;
+                batch.results = results != NULL ? results + base :
+                        batch.scratch;
+
+                run_cache_batch (cache, &batch, n, true);
+
+                if (result == LRU_SUCCESS)
+                        result = first_failure (batch.results, n);
+        }
+
+        return result;
+}
+
+/* Frees the nodes of a list no longer reachable from the cache, leaving
+ * any still pinned to their last lru_cache_release().  An allocator that
+ * may not be called concurrently gets them back under the write lock, a
+ * batch at a time so other callers get in between.
+ */
+static void
+reclaim_nodes (lru_cache_t *cache, lru_node_t *node)
+{
+        lru_node_t *next;
+        size_t  n;
+
+        if (allocator_thread_safe (cache))
+        {
+                for (; node != NULL; node = next)
+                {
+                        next = node->next;
+                        if (__atomic_sub_fetch (&node->refcount, 1,
+                                                __ATOMIC_ACQ_REL) == 0)
+                                destroy_node (cache, node);
+                }
+                return;
+        }
+
+        while (node != NULL)
+        {
+                if (cache->thread_safe)
+                        pthread_rwlock_wrlock (&cache->lock);
+
+                for (n = 0; node != NULL && n < LRU_CACHE_RECLAIM_BATCH; n++)
+                {
+                        next = node->next;
+                        unref_node (cache, node);
+                        node = next;
+                }
+
+                if (cache->thread_safe)
+                        pthread_rwlock_unlock (&cache->lock);
+        }
+}
+
+/* Only swaps in an empty index and list under the lock; the old nodes
+ * and table are freed once it is dropped.
+ */
+void
+lru_cache_clear (lru_cache_t *cache)
+{
+        lru_table_t fresh;
+        lru_table_t old;
+        lru_node_t *list;
+        size_t  size;
+
+        if (cache == NULL)
+                return;
+
+        if (cache->thread_safe)
+                pthread_rwlock_wrlock (&cache->lock);
+
+        release_spent (cache);
+
+        if (cache->tier != NULL)
+                tier_clear (cache->tier);
+
+        /* The index goes first so lock-free readers can no longer reach
+         * the nodes being released.  Without memory for a fresh table
+         * the current one is emptied in place.
+         */
+        if (rehashing (cache))
+                drop_old_table (cache);
+
+        /* A resize still waiting for a migration takes effect now. */
+        size = cache->rehash_pending != 0 ? cache->rehash_pending :
+                cache->table.size;
+        cache->rehash_pending = 0;
+
+        memset (&old, 0, sizeof (lru_table_t));
+        if (init_table (cache, &fresh, size) == LRU_SUCCESS)
+        {
+                fresh.generation = cache->table.generation + 1;
+                old = cache->table;
+
+                begin_index_update (cache);
+                store_table (&cache->table, &fresh);
+                end_index_update (cache);
+        }
+        else
+                clear_table (cache, &cache->table);
+
+        if (cache->lockfree_reads)
+                synchronize_readers (cache);
+
+        list = cache->head;
+
+        if (cache->wheel != NULL)
+        {
+                memset (cache->wheel->occupied, 0,
+                        sizeof (cache->wheel->occupied));
+                memset (cache->wheel->slots, 0, sizeof (cache->wheel->slots));
+        }
+
+        cache->head = NULL;
+        cache->tail = NULL;
+        cache->window_tail = NULL;
+        cache->protected_tail = NULL;
+        memset (cache->segment_size, 0, sizeof (cache->segment_size));
+        cache->size = 0;
+        cache->bytes = 0;
+
+        if (cache->track_stats)
+                cache->stats.current_size = 0;
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        free_table (&old);
+        reclaim_nodes (cache, list);
+}
+
+void
+lru_cache_destroy (lru_cache_t *cache)
+{
+        if (cache == NULL)
+                return;
+
+        lru_cache_unregister (cache);
+
+        if (cache->tier != NULL)
+        {
+                tier_destroy (cache->tier);
+                cache->tier = NULL;
+        }
+
+        lru_cache_clear (cache);
+
+        free_retired (cache, 0);
+        free_retired (cache, 1);
+        free (cache->readers);
+        free (cache->stat_stripes);
+        free (cache->latency);
+        free (cache->sketch);
+        free (cache->wheel);
+
+        free_table (&cache->table);
+
+        if (cache->thread_safe)
+                pthread_rwlock_destroy (&cache->lock);
+
+        pthread_mutex_destroy (&cache->flight_lock);
+
+        free (cache);
+}
+
+size_t
+lru_cache_size (lru_cache_t *cache)
+{
+        size_t  size;
+
+        if (cache == NULL)
+                return 0;
+
+        if (cache->thread_safe)
+                pthread_rwlock_rdlock (&cache->lock);
+
+        size = cache->size;
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        return size;
+}
+
+size_t
+lru_cache_capacity (lru_cache_t *cache)
+{
+        if (cache == NULL)
+                return 0;
+
+        return cache->capacity;
+}
+
+int
+lru_cache_resize (lru_cache_t *cache, size_t new_capacity)
+{
+        int     result;
+
+        if (cache == NULL || new_capacity < LRU_CACHE_MIN_CAPACITY)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
+                return LRU_ERROR_LOCK;
+
+        release_spent (cache);
+
+        LRU_TRACE (cache, RESIZE, NULL, 0, new_capacity);
+
+        cache->capacity = new_capacity;
+        if (cache->byte_capacity)
+                evict_batch (cache, SIZE_MAX, new_capacity);
+        else
+                evict_batch (cache, new_capacity, SIZE_MAX);
+
+        result = start_rehash (cache, index_size_for (cache, new_capacity));
+
+        unlock_cache (cache);
+
+        return result;
+}
+
+/* Evicts least recently used entries until at least bytes of
+ * current_bytes are released, or only pinned entries are left, to
+ * relieve memory pressure without changing the capacity.  The victims go
+ * in one batch, their callbacks and freeing happen after the lock is
+ * dropped.  Returns the bytes released.
+ */
+size_t
+lru_cache_shed (lru_cache_t *cache, size_t bytes)
+{
+        size_t  released;
+
+        if (cache == NULL || bytes == 0)
+                return 0;
+
+        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
+                return 0;
+
+        release_spent (cache);
+
+        released = evict_batch (cache, SIZE_MAX, cache->bytes > bytes ?
+                                cache->bytes - bytes : 0);
+
+        unlock_cache (cache);
+
+        return released;
+}
+
+/* Caps the cache at limit bytes on top of its capacity, evicting down to
+ * it now.  The evictions and the shrink callback are queued for
+ * registry_unlock().  Without memory for the job the cap is only set,
+ * and later puts evict down to it.
+ */
+static size_t
+registry_limit (lru_registry_entry_t *entry, size_t limit)
+{
+        lru_registry_job_t *job;
+        lru_cache_t *cache;
+        size_t  released;
+
+        cache = entry->cache;
+        job = malloc (sizeof (lru_registry_job_t));
+
+        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
+        {
+                free (job);
+                return 0;
+        }
+
+        release_spent (cache);
+
+        cache->byte_limit = limit;
+        released = job != NULL && cache->bytes > limit ?
+                evict_batch (cache, SIZE_MAX, limit) : 0;
+
+        if (released > 0)
+        {
+                job->entry = entry;
+                job->evicted = cache->evicted;
+                job->last = cache->evicted_tail;
+                job->eviction_fn = cache->eviction_fn;
+                job->eviction_user_data = cache->eviction_user_data;
+                job->tier = cache->tier;
+                job->released = released;
+                cache->evicted = NULL;
+                cache->evicted_tail = NULL;
+
+                job->next = registry.jobs;
+                registry.jobs = job;
+                entry->busy++;
+                job = NULL;
+        }
+
+        unlock_cache (cache);
+
+        free (job);
+
+        entry->limited = limit != SIZE_MAX;
+
+        return released;
+}
+
+/* Runs one job taken off the queue, without the registry lock. */
+static void
+registry_run_job (lru_registry_job_t *job, lru_shrink_fn shrink_fn,
+                  void *shrink_user_data)
+{
+        if (job->evicted != NULL)
+                finish_evictions (job->entry->cache, job->evicted, job->last,
+                                  job->eviction_fn, job->eviction_user_data,
+                                  job->tier);
+
+        if (shrink_fn != NULL)
+                shrink_fn (job->entry->cache, job->released,
+                           shrink_user_data);
+}
+
+/* Drops the registry lock, then runs the queued jobs.  Callbacks may
+ * use the registry, including creating and destroying other caches;
+ * the job's own cache stays busy until they return, so destroying it
+ * from one would wait on itself.
+ */
+static void
+registry_unlock (void)
+{
+        lru_registry_job_t *job;
+        lru_shrink_fn shrink_fn;
+        void   *shrink_user_data;
+
+        while ((job = registry.jobs) != NULL)
+        {
+                registry.jobs = job->next;
+                shrink_fn = registry.shrink_fn;
+                shrink_user_data = registry.shrink_user_data;
+                pthread_mutex_unlock (&registry.lock);
+
+                registry_run_job (job, shrink_fn, shrink_user_data);
+
+                pthread_mutex_lock (&registry.lock);
+                if (--job->entry->busy == 0)
+                        pthread_cond_broadcast (&registry.idle);
+                free (job);
+        }
+
+        pthread_mutex_unlock (&registry.lock);
+}
+
+/* The marginal utility of a byte is estimated from how the hit count
+ * moved with the cache size between samples.  While the size stays put
+ * there is nothing to measure, so the estimate drifts toward the
+ * cache's average hits per byte instead.
+ */
+static void
+registry_sample (lru_registry_entry_t *entry)
+{
+        lru_cache_t *cache;
+        uint64_t hits;
+        uint64_t evictions;
+        uint64_t rate;
+        size_t  bytes;
+        double  delta;
+        double  slope;
+
+        cache = entry->cache;
+
+        if (cache->thread_safe)
+                pthread_rwlock_rdlock (&cache->lock);
+
+        bytes = cache->bytes;
+        evictions = cache->stats.evictions;
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        hits = sum_stat (cache, LRU_STAT_HITS);
+
+        /* A stats reset restarts the counters. */
+        rate = hits >= entry->hits ? hits - entry->hits : hits;
+        entry->evicted = evictions >= entry->evictions ?
+                evictions - entry->evictions : evictions;
+
+        delta = (double) bytes - (double) entry->bytes;
+        if (!entry->sampled)
+                entry->marginal = (double) rate / (double) (bytes + 1);
+        else if (delta * LRU_REGISTRY_STEP >= (double) bytes ||
+                 -delta * LRU_REGISTRY_STEP >= (double) bytes)
+        {
+                slope = ((double) rate - (double) entry->rate) / delta;
+                entry->marginal = (entry->marginal +
+                                   (slope > 0 ? slope : 0)) / 2;
+        }
+        else
+                entry->marginal += ((double) rate / (double) (bytes + 1) -
+                                    entry->marginal) / 8;
+
+        entry->hits = hits;
+        entry->evictions = evictions;
+        entry->rate = rate;
+        entry->bytes = bytes;
+        entry->sampled = true;
+}
+
+/* Every share is kept at or above 1 / (LRU_REGISTRY_MIN_SHARE * n) so
+ * that no cache is starved outright, and the shares sum to one.
+ */
+static void
+registry_normalize (void)
+{
+        lru_registry_entry_t *entry;
+        double  floor;
+        double  total;
+
+        floor = 1.0 / (LRU_REGISTRY_MIN_SHARE * (double) registry.n_entries);
+
+        total = 0;
+        for (entry = registry.entries; entry != NULL; entry = entry->next)
+        {
+                if (entry->share < floor)
+                        entry->share = floor;
+                total += entry->share;
+        }
+
+        for (entry = registry.entries; entry != NULL; entry = entry->next)
+                entry->share /= total;
+}
+
+static size_t
+registry_rebalance (void)
+{
+        lru_registry_entry_t *entry;
+        lru_registry_entry_t *donor;
+        lru_registry_entry_t *receiver;
+        size_t  total;
+        size_t  released;
+        double  step;
+        double  floor;
+
+        if (registry.n_entries == 0)
+        {
+                registry.pressured = false;
+                return 0;
+        }
+
+        total = 0;
+        for (entry = registry.entries; entry != NULL; entry = entry->next)
+        {
+                registry_sample (entry);
+                total += entry->bytes;
+        }
+
+        released = 0;
+
+        /* Without a budget, limits only hold back caches shed under
+         * pressure, until an interval passes without any.
+         */
+        if (registry.budget == 0)
+        {
+                for (entry = registry.entries; entry != NULL;
+                     entry = entry->next)
+                {
+                        if (entry->limited && !registry.pressured)
+                                registry_limit (entry, SIZE_MAX);
+                }
+                registry.pressured = false;
+                return 0;
+        }
+
+        /* A new cache starts with the part of the budget it holds. */
+        for (entry = registry.entries; entry != NULL; entry = entry->next)
+        {
+                if (entry->share == 0)
+                        entry->share = (double) (entry->bytes + 1) /
+                                (double) (total > registry.budget ?
+                                          total : registry.budget);
+        }
+        registry_normalize ();
+
+        /* Hill-climb one step: budget moves from the cache whose bytes
+         * are worth least at the margin to the most valuable one among
+         * those its limit is making evict.
+         */
+        step = 1.0 / LRU_REGISTRY_STEP;
+        floor = 1.0 / (LRU_REGISTRY_MIN_SHARE * (double) registry.n_entries);
+        donor = NULL;
+        receiver = NULL;
+        for (entry = registry.entries; entry != NULL; entry = entry->next)
+        {
+                if (entry->share - step >= floor &&
+                    (donor == NULL || entry->marginal < donor->marginal))
+                        donor = entry;
+
+                if (entry->evicted > 0 && entry->limited &&
+                    (receiver == NULL ||
+                     entry->marginal > receiver->marginal))
+                        receiver = entry;
+        }
+
+        if (donor != NULL && receiver != NULL && donor != receiver &&
+            receiver->marginal > donor->marginal)
+        {
+                donor->share -= step;
+                receiver->share += step;
+        }
+
+        for (entry = registry.entries; entry != NULL; entry = entry->next)
+                released += registry_limit (entry, (size_t)
+                                            (entry->share *
+                                             (double) registry.budget));
+
+        registry.pressured = false;
+
+        return released;
+}
+
+/* Refreshes held for every registered cache and returns their total. */
+static size_t
+registry_held (void)
+{
+        lru_registry_entry_t *entry;
+        size_t  total;
+
+        total = 0;
+        for (entry = registry.entries; entry != NULL; entry = entry->next)
+        {
+                if (entry->cache->thread_safe)
+                        pthread_rwlock_rdlock (&entry->cache->lock);
+
+                entry->held = entry->cache->bytes;
+
+                if (entry->cache->thread_safe)
+                        pthread_rwlock_unlock (&entry->cache->lock);
+
+                total += entry->held;
+                entry->shed = false;
+        }
+
+        return total;
+}
+
+/* Takes bytes from the caches whose bytes are worth least first, each
+ * capped where it is left until the next rebalance.
+ */
+static size_t
+registry_shed (size_t bytes)
+{
+        lru_registry_entry_t *entry;
+        lru_registry_entry_t *lowest;
+        size_t  released;
+        size_t  cut;
+
+        registry_held ();
+
+        released = 0;
+        while (released < bytes)
+        {
+                lowest = NULL;
+                for (entry = registry.entries; entry != NULL;
+                     entry = entry->next)
+                {
+                        if (!entry->shed && entry->held > 0 &&
+                            (lowest == NULL ||
+                             entry->marginal < lowest->marginal))
+                                lowest = entry;
+                }
+
+                if (lowest == NULL)
+                        break;
+
+                cut = bytes - released < lowest->held ?
+                        bytes - released : lowest->held;
+                released += registry_limit (lowest, lowest->held - cut);
+                lowest->shed = true;
+        }
+
+        registry.pressured = true;
+
+        return released;
+}
+
+/* Adds the cache to the process-wide registry, which from then on may
+ * cap it below its capacity to keep the registered caches within the
+ * budget set by lru_registry_set_budget() and shed from it under memory
+ * pressure.  Evictions the registry causes run their callbacks after it
+ * is unlocked.  lru_cache_destroy() unregisters the cache.
+ */
+int
+lru_cache_register (lru_cache_t *cache)
+{
+        lru_registry_entry_t *entry;
+        int     result;
+
+        if (cache == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        entry = calloc (1, sizeof (lru_registry_entry_t));
+        if (entry == NULL)
+                return LRU_ERROR_NOMEM;
+        entry->cache = cache;
+
+        pthread_mutex_lock (&registry.lock);
+
+        if (cache->registry != NULL)
+        {
+                free (entry);
+                result = LRU_ERROR_INVALID_ARG;
+        }
+        else
+        {
+                entry->next = registry.entries;
+                registry.entries = entry;
+                registry.n_entries++;
+                cache->registry = entry;
+                result = LRU_SUCCESS;
+        }
+
+        pthread_mutex_unlock (&registry.lock);
+
+        return result;
+}
+
+/* Takes the cache out of the registry and lifts any cap it set.  Jobs
+ * of the cache still queued are run here, and ones another thread is
+ * running are waited for, so the cache can be freed afterwards.
+ */
+void
+lru_cache_unregister (lru_cache_t *cache)
+{
+        lru_registry_entry_t **link;
+        lru_registry_entry_t *entry;
+        lru_registry_job_t **job_link;
+        lru_registry_job_t *job;
+        lru_shrink_fn shrink_fn;
+        void   *shrink_user_data;
+
+        if (cache == NULL)
+                return;
+
+        pthread_mutex_lock (&registry.lock);
+
+        entry = cache->registry;
+        if (entry == NULL)
+        {
+                pthread_mutex_unlock (&registry.lock);
+                return;
+        }
+
+        link = &registry.entries;
+        while (*link != entry)
+                link = &(*link)->next;
+        *link = entry->next;
+        registry.n_entries--;
+        cache->registry = NULL;
+
+        if (entry->limited)
+                registry_limit (entry, SIZE_MAX);
+
+        job_link = &registry.jobs;
+        while ((job = *job_link) != NULL)
+        {
+                if (job->entry != entry)
+                {
+                        job_link = &job->next;
+                        continue;
+                }
+
+                *job_link = job->next;
+                shrink_fn = registry.shrink_fn;
+                shrink_user_data = registry.shrink_user_data;
+                pthread_mutex_unlock (&registry.lock);
+
+                registry_run_job (job, shrink_fn, shrink_user_data);
+
+                pthread_mutex_lock (&registry.lock);
+                entry->busy--;
+                free (job);
+                job_link = &registry.jobs;
+        }
+
+        while (entry->busy > 0)
+                pthread_cond_wait (&registry.idle, &registry.lock);
+
+        registry_unlock ();
+
+        free (entry);
+}
+
+/* The budget covers current_bytes of all registered caches together;
+ * 0, the default, sets none.  It is split at once and then adjusted on
+ * every rebalance.
+ */
+void
+lru_registry_set_budget (size_t bytes)
+{
+        pthread_mutex_lock (&registry.lock);
+
+        registry.budget = bytes;
+        registry_rebalance ();
+
+        registry_unlock ();
+}
+
+/* fn runs, without the registry locked, whenever the registry makes a
+ * cache release memory.  It must not destroy or unregister that cache.
+ */
+void
+lru_registry_set_shrink_callback (lru_shrink_fn fn, void *user_data)
+{
+        pthread_mutex_lock (&registry.lock);
+
+        registry.shrink_fn = fn;
+        registry.shrink_user_data = user_data;
+
+        pthread_mutex_unlock (&registry.lock);
+}
+
+/* Samples every registered cache and moves a step of the budget from the
+ * cache with the lowest marginal utility to the highest one among those
+ * held back by their share.  Called every interval by the watcher, or by
+ * the application if it runs none.  Returns the bytes released.
+ */
+size_t
+lru_registry_rebalance (void)
+{
+        size_t  released;
+
+        pthread_mutex_lock (&registry.lock);
+        released = registry_rebalance ();
+        registry_unlock ();
+
+        return released;
+}
+
+/* Releases at least bytes across the registered caches, lowest marginal
+ * utility first, or as much as they hold.  Returns the bytes released.
+ */
+size_t
+lru_registry_shed (size_t bytes)
+{
+        size_t  released;
+
+        pthread_mutex_lock (&registry.lock);
+        released = registry_shed (bytes);
+        registry_unlock ();
+
+        return released;
+}
+
+static void *
+registry_watch (void *arg)
+{
+        struct pollfd fds[2];
+        uint64_t deadline;
+        uint64_t now;
+        nfds_t  count;
+        int     ready;
+
+        (void) arg;
+
+        fds[0].fd = registry.wake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = registry.pressure_fd;
+        fds[1].events = POLLPRI;
+        count = registry.pressure_fd >= 0 ? 2 : 1;
+
+        deadline = monotonic_ms () + registry.interval_ms;
+        for (;;)
+        {
+                now = monotonic_ms ();
+                ready = poll (fds, count, deadline > now ?
+                              (int) (deadline - now) : 0);
+                if (ready < 0 && errno != EINTR)
+                        break;
+
+                if (ready > 0 && fds[0].revents != 0)
+                        break;
+
+                pthread_mutex_lock (&registry.lock);
+
+                if (ready > 0 && (fds[1].revents & POLLPRI) != 0)
+                        registry_shed (registry_held () / 100 *
+                                       LRU_REGISTRY_PRESSURE_PERCENT);
+                else if (monotonic_ms () >= deadline)
+                {
+                        registry_rebalance ();
+                        deadline = monotonic_ms () + registry.interval_ms;
+                }
+
+                registry_unlock ();
+
+                /* The cgroup went away; keep rebalancing without it. */
+                if (ready > 0 && count == 2 &&
+                    (fds[1].revents & (POLLERR | POLLNVAL)) != 0)
+                        count = 1;
+        }
+
+        return NULL;
+}
+
+/* Starts a thread that rebalances the registry every interval_ms and,
+ * with pressure_path set to a cgroup v2 memory.pressure file, sheds
+ * LRU_REGISTRY_PRESSURE_PERCENT of the registered bytes whenever tasks
+ * in the cgroup stall on memory for LRU_REGISTRY_STALL_US within a
+ * LRU_REGISTRY_WINDOW_US window.
+ */
+int
+lru_registry_start (const char *pressure_path, unsigned int interval_ms)
+{
+        char    trigger[64];
+        int     length;
+        int     result;
+
+        if (interval_ms == 0 || interval_ms > INT32_MAX)
+                return LRU_ERROR_INVALID_ARG;
+
+        pthread_mutex_lock (&registry.lock);
+
+        if (registry.watching)
+        {
+                result = LRU_ERROR_INVALID_ARG;
+                goto cleanup;
+        }
+
+        if (pressure_path != NULL)
+        {
+                registry.pressure_fd = open (pressure_path,
+                                             O_RDWR | O_NONBLOCK | O_CLOEXEC);
+                length = snprintf (trigger, sizeof (trigger), "some %u %u",
+                                   LRU_REGISTRY_STALL_US,
+                                   LRU_REGISTRY_WINDOW_US);
+                if (registry.pressure_fd < 0 ||
+                    write (registry.pressure_fd, trigger, length + 1) < 0)
+                {
+                        result = LRU_ERROR_IO;
+                        goto fail_pressure;
+                }
+        }
+
+        if (pipe (registry.wake) != 0)
+        {
+                result = LRU_ERROR_IO;
+                goto fail_pressure;
+        }
+
+        registry.interval_ms = interval_ms;
+        if (pthread_create (&registry.watcher, NULL, registry_watch,
+                            NULL) != 0)
+        {
+                result = LRU_ERROR_NOMEM;
+                goto fail_thread;
+        }
+
+        registry.watching = true;
+        result = LRU_SUCCESS;
+        goto cleanup;
+
+      fail_thread:
+        close (registry.wake[0]);
+        close (registry.wake[1]);
+      fail_pressure:
+        if (registry.pressure_fd >= 0)
+                close (registry.pressure_fd);
+        registry.pressure_fd = -1;
+      cleanup:
+        pthread_mutex_unlock (&registry.lock);
+
+        return result;
+}
+
+void
+lru_registry_stop (void)
+{
+        pthread_mutex_lock (&registry.lock);
+
+        if (!registry.watching)
+        {
+                pthread_mutex_unlock (&registry.lock);
+                return;
+        }
+
+        registry.watching = false;
+        pthread_mutex_unlock (&registry.lock);
+
+        /* The watcher takes the lock, so it is joined without it. */
+        while (write (registry.wake[1], "", 1) < 0 && errno == EINTR)
+                ;
+        pthread_join (registry.watcher, NULL);
+
+        close (registry.wake[0]);
+        close (registry.wake[1]);
+        if (registry.pressure_fd >= 0)
+                close (registry.pressure_fd);
+        registry.pressure_fd = -1;
+}
+
+int
+lru_cache_get_stats (lru_cache_t *cache, lru_stats_t *stats)
+{
+        if (cache == NULL || stats == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (!cache->track_stats)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (cache->thread_safe && pthread_rwlock_rdlock (&cache->lock) != 0)
+                return LRU_ERROR_LOCK;
+
+        memcpy (stats, &cache->stats, sizeof (lru_stats_t));
+        stats->hits = sum_stat (cache, LRU_STAT_HITS);
+        stats->misses = sum_stat (cache, LRU_STAT_MISSES);
+        stats->collisions = sum_stat (cache, LRU_STAT_COLLISIONS);
+        stats->current_size = cache->size;
+        stats->current_bytes = cache->bytes;
+
+        if (cache->tier != NULL)
+        {
+                pthread_mutex_lock (&cache->tier->lock);
+                stats->spills = cache->tier->spills;
+                stats->tier_hits = cache->tier->hits;
+                pthread_mutex_unlock (&cache->tier->lock);
+        }
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        return LRU_SUCCESS;
+}
+
+void
+lru_cache_reset_stats (lru_cache_t *cache)
+{
+        size_t  i;
+        unsigned int counter;
+
+        if (cache == NULL || !cache->track_stats)
+                return;
+
+        if (cache->thread_safe)
+                pthread_rwlock_wrlock (&cache->lock);
+
+        memset (&cache->stats, 0, sizeof (lru_stats_t));
+        for (i = 0; i < LRU_CACHE_STAT_STRIPES; i++)
+                for (counter = 0; counter < LRU_STAT_COUNTERS; counter++)
+                        __atomic_store_n (&cache->stat_stripes[i].
+                                          counters[counter], 0,
+                                          __ATOMIC_RELAXED);
+        if (cache->latency != NULL)
+                memset (cache->latency, 0, LRU_CACHE_STAT_STRIPES *
+                        sizeof (lru_latency_stripe_t));
+        if (cache->tier != NULL)
+        {
+                pthread_mutex_lock (&cache->tier->lock);
+                cache->tier->spills = 0;
+                cache->tier->hits = 0;
+                pthread_mutex_unlock (&cache->tier->lock);
+        }
+        cache->stats.current_size = cache->size;
+        cache->stats.peak_size = cache->size;
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+}
+
+static void
+merge_histogram (lru_cache_t *cache, lru_latency_op_t op,
+                 lru_histogram_t *merged)
+{
+        lru_histogram_t *histogram;
+        size_t  i;
+        size_t  b;
+
+        for (i = 0; i < LRU_CACHE_STAT_STRIPES; i++)
+        {
+                histogram = &cache->latency[i].ops[op];
+
+                merged->total_ns += __atomic_load_n (&histogram->total_ns,
+                                                     __ATOMIC_RELAXED);
+                for (b = 0; b < LRU_HIST_BUCKETS; b++)
+                        merged->buckets[b] +=
+                                __atomic_load_n (&histogram->buckets[b],
+                                                 __ATOMIC_RELAXED);
+        }
+}
+
+static void
+summarize_histogram (const lru_histogram_t *histogram,
+                     lru_latency_t *latency)
+{
+        static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        uint64_t *targets[4];
+        uint64_t seen;
+        uint64_t rank;
+        size_t  q;
+        size_t  b;
+
+        memset (latency, 0, sizeof (lru_latency_t));
+
+        for (b = 0; b < LRU_HIST_BUCKETS; b++)
+                latency->count += histogram->buckets[b];
+
+        if (latency->count == 0)
+                return;
+
+        latency->mean_ns = histogram->total_ns / latency->count;
+
+        targets[0] = &latency->p50_ns;
+        targets[1] = &latency->p90_ns;
+        targets[2] = &latency->p99_ns;
+        targets[3] = &latency->p999_ns;
+
+        seen = 0;
+        q = 0;
+        for (b = 0; b < LRU_HIST_BUCKETS; b++)
+        {
+                if (histogram->buckets[b] == 0)
+                        continue;
+
+                seen += histogram->buckets[b];
+                while (q < 4)
+                {
+                        rank = (uint64_t) (quantiles[q] * latency->count);
+                        if (rank == 0)
+                                rank = 1;
+                        if (seen < rank)
+                                break;
+                        *targets[q++] = histogram_value (b);
+                }
+
+                latency->max_ns = histogram_value (b);
+        }
+}
+
+/* Latency summary for op since creation or the last reset; requires
+ * LRU_CACHE_FLAG_LATENCY_STATS.  Lock waits are also counted inside the
+ * operation they delay, and eviction covers only the callback.
+ */
+int
+lru_cache_get_latency (lru_cache_t *cache, lru_latency_op_t op,
+                       lru_latency_t *latency)
+{
+        lru_histogram_t *merged;
+
+        if (cache == NULL || latency == NULL || cache->latency == NULL ||
+            op >= LRU_LATENCY_OPS)
+                return LRU_ERROR_INVALID_ARG;
+
+        merged = calloc (1, sizeof (lru_histogram_t));
+        if (merged == NULL)
+                return LRU_ERROR_NOMEM;
+
+        merge_histogram (cache, op, merged);
+        summarize_histogram (merged, latency);
+
+        free (merged);
+
+        return LRU_SUCCESS;
+}
+
+#ifdef LRU_CACHE_TRACE
+int
+lru_cache_set_trace_callback (lru_cache_t *cache, lru_trace_fn trace_fn,
+                              void *user_data)
+{
+        if (cache == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        if (cache->thread_safe)
+                pthread_rwlock_wrlock (&cache->lock);
+
+        cache->trace_fn = trace_fn;
+        cache->trace_user_data = user_data;
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        return LRU_SUCCESS;
+}
+#endif
+
+static int
+write_snapshot (lru_cache_t *cache, FILE *file)
+{
+        lru_snapshot_header_t header;
+        lru_snapshot_record_t record;
+        lru_node_t *node;
+        void   *raw;
+        bool    written;
+        uint64_t now;
+
+        memset (&header, 0, sizeof (header));
+        memcpy (header.magic, LRU_SNAPSHOT_MAGIC, sizeof (LRU_SNAPSHOT_MAGIC));
+        header.version = LRU_SNAPSHOT_VERSION;
+
+        now = monotonic_ms ();
+        for (node = cache->head; node != NULL; node = node->next)
+        {
+                if (node->expires_at == 0 || node->expires_at > now)
+                        header.count++;
+        }
+
+        if (fwrite (&header, sizeof (header), 1, file) != 1)
+                return LRU_ERROR_IO;
+
+        for (node = cache->head; node != NULL; node = node->next)
+        {
+                if (node->expires_at != 0 && node->expires_at <= now)
+                        continue;
+
+                raw = raw_value (cache, node);
+                if (raw == NULL)
+                        return LRU_ERROR_NOMEM;
+
+                record.key_size = node->key_size;
+                record.value_size = raw_value_size (node);
+                record.ttl_ms = node->expires_at != 0 ?
+                        node->expires_at - now : 0;
+
+                written = fwrite (&record, sizeof (record), 1, file) == 1 &&
+                        fwrite (node->key, 1, node->key_size, file) ==
+                        node->key_size &&
+                        fwrite (raw, 1, record.value_size, file) ==
+                        record.value_size;
+
+                if (raw != node->value)
+                        free (raw);
+
+                if (!written)
+                        return LRU_ERROR_IO;
+        }
+
+        return LRU_SUCCESS;
+}
+
+/* Writes every live entry to path, MRU first.  The snapshot is written
+ * to a temporary file and renamed into place, so a crash never leaves a
+ * truncated snapshot behind.  Writers are blocked while it runs.
+ */
+int
+lru_cache_save (lru_cache_t *cache, const char *path)
+{
+        FILE   *file;
+        char   *tmp_path;
+        int     result;
+
+        if (cache == NULL || path == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        tmp_path = malloc (strlen (path) + sizeof (".tmp"));
+        if (tmp_path == NULL)
+                return LRU_ERROR_NOMEM;
+        strcpy (tmp_path, path);
+        strcat (tmp_path, ".tmp");
+
+        file = fopen (tmp_path, "wb");
+        if (file == NULL)
+        {
+                free (tmp_path);
+                return LRU_ERROR_IO;
+        }
+        setvbuf (file, NULL, _IOFBF, LRU_SNAPSHOT_BUFFER);
+
+        if (cache->thread_safe && pthread_rwlock_rdlock (&cache->lock) != 0)
+        {
+                result = LRU_ERROR_LOCK;
+                fclose (file);
+                goto cleanup;
+        }
+
+        result = write_snapshot (cache, file);
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        if (fclose (file) != 0 && result == LRU_SUCCESS)
+                result = LRU_ERROR_IO;
+
+        if (result == LRU_SUCCESS && rename (tmp_path, path) != 0)
+                result = LRU_ERROR_IO;
+
+      cleanup:
+        if (result != LRU_SUCCESS)
+                unlink (tmp_path);
+        free (tmp_path);
+
+        return result;
+}
+
+/* Walks the records once before anything is inserted, so a truncated or
+ * foreign file is rejected as a whole.
+ */
+static int
+check_snapshot (const unsigned char *data, size_t length, uint64_t *count)
+{
+        lru_snapshot_header_t header;
+        lru_snapshot_record_t record;
+        size_t  offset;
+        uint64_t i;
+
+        if (length < sizeof (header))
+                return LRU_ERROR_IO;
+
+        memcpy (&header, data, sizeof (header));
+        if (memcmp (header.magic, LRU_SNAPSHOT_MAGIC,
+                    sizeof (LRU_SNAPSHOT_MAGIC)) != 0 ||
+            header.version != LRU_SNAPSHOT_VERSION)
+                return LRU_ERROR_IO;
+
+        offset = sizeof (header);
+        for (i = 0; i < header.count; i++)
+        {
+                if (length - offset < sizeof (record))
+                        return LRU_ERROR_IO;
+                memcpy (&record, data + offset, sizeof (record));
+                offset += sizeof (record);
+
+                if (record.key_size == 0 || record.value_size == 0 ||
+                    record.key_size > length - offset ||
+                    record.value_size > length - offset - record.key_size)
+                        return LRU_ERROR_IO;
+                offset += record.key_size + record.value_size;
+        }
+
+        *count = header.count;
+
+        return LRU_SUCCESS;
+}
+
+static int
+restore_snapshot (lru_cache_t *cache, const unsigned char *data,
+                  uint64_t count)
+{
+        lru_snapshot_record_t record;
+        lru_compression_t hooks;
+        lru_node_t *node;
+        const unsigned char *key;
+        const unsigned char *value;
+        void   *compressed;
+        unsigned long hash;
+        size_t  offset;
+        size_t  size;
+        size_t  charge;
+        size_t  expected;
+        uint64_t now;
+        uint64_t i;
+        int     result;
+
+        current_compression (cache, &hooks);
+
+        /* Size the index once for everything that can fit and finish the
+         * rebuild up front instead of growing it step by step.
+         */
+        expected = cache->size + count;
+        if (!cache->byte_capacity && expected > cache->capacity)
+                expected = cache->capacity;
+        if (expected > cache->table.size * LRU_CACHE_LOAD_FACTOR)
+        {
+                result = start_rehash (cache,
+                                       calculate_hash_table_size (expected));
+                if (result != LRU_SUCCESS)
+                        return result;
+        }
+        while (rehashing (cache))
+                rehash_step (cache, cache->old_table.size);
+
+        now = monotonic_ms ();
+        offset = sizeof (lru_snapshot_header_t);
+
+        for (i = 0; i < count; i++)
+        {
+                memcpy (&record, data + offset, sizeof (record));
+                key = data + offset + sizeof (record);
+                value = key + record.key_size;
+                offset += sizeof (record) + record.key_size +
+                        record.value_size;
+
+                /* The live entry is newer than its snapshot. */
+                hash = cache->hash_fn (key, record.key_size);
+                if (find_in_hash_table (cache, hash, key, record.key_size) !=
+                    NULL)
+                        continue;
+
+                compressed = compress_value (&hooks, value, record.value_size,
+                                             &size);
+                if (compressed == NULL)
+                        size = record.value_size;
+
+                charge = entry_charge (record.key_size, size);
+                if (needs_room (cache, charge, NULL))
+                {
+                        free (compressed);
+                        if (cache->byte_capacity)
+                                continue;
+                        break;
+                }
+
+                if (compressed != NULL)
+                {
+                        node = create_node (cache, key, record.key_size,
+                                            compressed, size);
+                        free (compressed);
+                        if (node != NULL)
+                                set_raw_size (cache, node,
+                                              record.value_size);
+                }
+                else
+                        node = create_node (cache, key, record.key_size,
+                                            value, size);
+                if (node == NULL)
+                        return LRU_ERROR_NOMEM;
+
+                if (!rehashing (cache) &&
+                    cache->size + 1 > cache->table.size * LRU_CACHE_LOAD_FACTOR)
+                        start_rehash (cache, cache->table.size * 2);
+
+                node->hash = hash;
+                node->expires_at = record.ttl_ms != 0 ?
+                        now + record.ttl_ms : 0;
+                result = add_to_hash_table (cache, node, hash);
+                if (result != LRU_SUCCESS)
+                {
+                        destroy_node (cache, node);
+                        return result;
+                }
+
+                append_node (cache, node);
+                cache->size++;
+                cache->bytes += charge;
+
+                result = arm_timer (cache, node);
+                if (result != LRU_SUCCESS)
+                {
+                        unlink_node (cache, node);
+                        return result;
+                }
+
+                if (cache->track_stats)
+                        cache->stats.insertions++;
+        }
+
+        return LRU_SUCCESS;
+}
+
+/* Restores a snapshot written by lru_cache_save(), mapping the file and
+ * inserting its entries in bulk behind any already cached.  Entries that
+ * no longer fit the capacity, or whose key is already cached, are
+ * skipped.  An unreadable or malformed file yields LRU_ERROR_IO with the
+ * cache unchanged.
+ */
+int
+lru_cache_load (lru_cache_t *cache, const char *path)
+{
+        struct stat st;
+        unsigned char *data;
+        uint64_t count;
+        int     fd;
+        int     result;
+
+        if (cache == NULL || path == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        fd = open (path, O_RDONLY);
+        if (fd < 0)
+                return LRU_ERROR_IO;
+
+        if (fstat (fd, &st) != 0 || st.st_size == 0)
+        {
+                close (fd);
+                return LRU_ERROR_IO;
+        }
+
+        data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close (fd);
+        if (data == MAP_FAILED)
+                return LRU_ERROR_IO;
+
+        madvise (data, st.st_size, MADV_SEQUENTIAL);
+
+        result = check_snapshot (data, st.st_size, &count);
+        if (result != LRU_SUCCESS)
+                goto cleanup;
+
+        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
+        {
+                result = LRU_ERROR_LOCK;
+                goto cleanup;
+        }
+
+        release_spent (cache);
+
+        result = restore_snapshot (cache, data, count);
+
+        if (cache->track_stats)
+        {
+                cache->stats.current_size = cache->size;
+                if (cache->size > cache->stats.peak_size)
+                        cache->stats.peak_size = cache->size;
+        }
+
+        unlock_cache (cache);
+
+      cleanup:
+        munmap (data, st.st_size);
+
+        return result;
+}
 
-        cache->thread_safe = true;
-        cache->track_stats = true;
+lru_iterator_t *
+lru_iterator_create (lru_cache_t *cache)
+{
+        lru_iterator_t *iter;
 
-        if (pthread_rwlock_init (&cache->lock, NULL) != 0)
+        if (cache == NULL)
+                return NULL;
+
+        iter = cache->allocator.malloc_fn (sizeof (lru_iterator_t));
+        if (iter == NULL)
+                return NULL;
+
+        iter->cache = cache;
+        iter->current = NULL;
+        iter->locked = false;
+
+        if (cache->thread_safe)
+        {
+                if (pthread_rwlock_rdlock (&cache->lock) != 0)
+                {
+                        cache->allocator.free_fn (iter);
+                        return NULL;
+                }
+                iter->locked = true;
+        }
+
+        iter->current = cache->head;
+
+        return iter;
+}
+
+bool
+lru_iterator_has_next (lru_iterator_t *iter)
+{
+        if (iter == NULL)
+                return false;
+
+        return iter->current != NULL;
+}
+
+int
+lru_iterator_next (lru_iterator_t *iter, void **key, size_t *key_size,
+                   void **value, size_t *value_size)
+{
+        lru_node_t *node;
+        lru_cache_t *cache;
+
+        if (iter == NULL || iter->current == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        node = iter->current;
+        cache = iter->cache;
+
+        if (key != NULL)
+        {
+                *key = cache->allocator.copy_fn (node->key, node->key_size);
+                if (*key == NULL)
+                        return LRU_ERROR_NOMEM;
+        }
+
+        if (key_size != NULL)
+                *key_size = node->key_size;
+
+        if (value != NULL &&
+            copy_value (cache, node, value, NULL) != LRU_SUCCESS)
+        {
+                if (key != NULL && *key != NULL)
+                        cache->allocator.destroy_fn (*key);
+                return LRU_ERROR_NOMEM;
+        }
+
+        if (value_size != NULL)
+                *value_size = raw_value_size (node);
+
+        iter->current = node->next;
+
+        return LRU_SUCCESS;
+}
+
+void
+lru_iterator_destroy (lru_iterator_t *iter)
+{
+        if (iter == NULL)
+                return;
+
+        if (iter->locked && iter->cache->thread_safe)
+                pthread_rwlock_unlock (&iter->cache->lock);
+
+        iter->cache->allocator.free_fn (iter);
+}
+
+/* Cursor for lru_cache_scan(): the bucket index with its bits reversed,
+ * incremented from the high end.  Doubling or halving the table splits
+ * or merges buckets that are adjacent in this order, so a scan running
+ * across a resize still visits every entry that stays in the cache.
+ */
+static size_t
+reverse_bits (size_t v)
+{
+        v = ((v >> 1) & (SIZE_MAX / 3)) | ((v & (SIZE_MAX / 3)) << 1);
+        v = ((v >> 2) & (SIZE_MAX / 5)) | ((v & (SIZE_MAX / 5)) << 2);
+        v = ((v >> 4) & (SIZE_MAX / 17)) | ((v & (SIZE_MAX / 17)) << 4);
+        v = ((v >> 8) & (SIZE_MAX / 257)) | ((v & (SIZE_MAX / 257)) << 8);
+        v = ((v >> 16) & (SIZE_MAX / 65537)) |
+                ((v & (SIZE_MAX / 65537)) << 16);
+#if SIZE_MAX > 0xffffffffUL
+        v = (v >> 32) | (v << 32);
+#endif
+
+        return v;
+}
+
+static size_t
+next_cursor (size_t cursor, size_t mask)
+{
+        cursor |= ~mask;
+        cursor = reverse_bits (cursor);
+        cursor++;
+
+        return reverse_bits (cursor);
+}
+
+/* A compressed value whose copy cannot be made is skipped. */
+static void
+scan_node (lru_cache_t *cache, lru_node_t *node, uint64_t now,
+           lru_scan_fn fn, void *user_data)
+{
+        void   *raw;
+
+        if (node->expires_at != 0 && node->expires_at <= now)
+                return;
+
+        raw = raw_value (cache, node);
+        if (raw == NULL)
+                return;
+
+        fn (node->key, node->key_size, raw, raw_value_size (node),
+            user_data);
+
+        if (raw != node->value)
+                free (raw);
+}
+
+/* An open-addressed bucket is the run of entries whose home is that slot;
+ * Robin Hood ordering keeps them together after it.
+ */
+static void
+scan_bucket (lru_cache_t *cache, lru_table_t *table, size_t bucket,
+             uint64_t now, lru_scan_fn fn, void *user_data)
+{
+        lru_hash_entry_t *entry;
+        lru_slot_t *slot;
+        size_t  mask;
+        size_t  pos;
+        size_t  dist;
+
+        if (!cache->open_addressing)
+        {
+                for (entry = table->buckets[bucket]; entry != NULL;
+                     entry = entry->next)
+                        scan_node (cache, entry->node, now, fn,
+                                   user_data);
+                return;
+        }
+
+        mask = table->size - 1;
+        pos = bucket;
+
+        for (dist = 0; dist < table->size; dist++)
+        {
+                slot = &table->slots[pos];
+                if (slot->node == NULL ||
+                    probe_distance (table, slot->hash, pos) < dist)
+                        return;
+
+                if (probe_distance (table, slot->hash, pos) == dist)
+                        scan_node (cache, slot->node, now, fn, user_data);
+
+                pos = (pos + 1) & mask;
+        }
+}
+
+/* Visits the entries of up to count buckets starting at cursor and
+ * returns the cursor to resume from, 0 once the scan is complete; start
+ * from 0.  Only the read lock is held, and only for the one call, so
+ * writers proceed between chunks.  The scan is weakly consistent: every
+ * entry present for the whole scan is visited, entries added or removed
+ * meanwhile may or may not be, and a resize can make some appear twice.
+ * fn receives borrowed pointers that are valid only during the call and
+ * must not call back into the cache.
+ */
+size_t
+lru_cache_scan (lru_cache_t *cache, size_t cursor, size_t count,
+                lru_scan_fn fn, void *user_data)
+{
+        lru_table_t *small;
+        lru_table_t *large;
+        size_t  small_mask;
+        size_t  large_mask;
+        uint64_t now;
+
+        if (cache == NULL || fn == NULL || count == 0)
+                return 0;
+
+        if (cache->thread_safe && pthread_rwlock_rdlock (&cache->lock) != 0)
+                return cursor;
+
+        now = monotonic_ms ();
+
+        do
+        {
+                if (!rehashing (cache))
+                {
+                        small_mask = cache->table.size - 1;
+                        scan_bucket (cache, &cache->table, cursor & small_mask,
+                                     now, fn, user_data);
+                        cursor = next_cursor (cursor, small_mask);
+                        continue;
+                }
+
+                /* Mid-rehash, visit the bucket in the smaller table and
+                 * every bucket it expands to in the larger one.
+                 */
+                small = &cache->old_table;
+                large = &cache->table;
+                if (small->size > large->size)
+                {
+                        small = &cache->table;
+                        large = &cache->old_table;
+                }
+                small_mask = small->size - 1;
+                large_mask = large->size - 1;
+
+                scan_bucket (cache, small, cursor & small_mask, now, fn,
+                             user_data);
+                do
+                {
+                        scan_bucket (cache, large, cursor & large_mask, now,
+                                     fn, user_data);
+                        cursor = next_cursor (cursor, large_mask);
+                }
+                while ((cursor & (small_mask ^ large_mask)) != 0);
+        }
+        while (cursor != 0 && --count > 0);
+
+        if (cache->thread_safe)
+                pthread_rwlock_unlock (&cache->lock);
+
+        return cursor;
+}
+
+static size_t
+default_shard_count (void)
+{
+        long    cpus;
+        size_t  n_shards;
+
+        cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        if (cpus < 1)
+                cpus = 1;
+
+        n_shards = 1;
+        while (n_shards < (size_t) cpus * 4 &&
+               n_shards < LRU_SHARDED_CACHE_MAX_SHARDS)
+                n_shards <<= 1;
+
+        return n_shards;
+}
+
+/* Shards are picked from the high bits of a multiplicative mix of the
+ * hash, so the low bits each shard uses for its own buckets stay evenly
+ * distributed inside the shard.
+ */
+static size_t
+shard_index (lru_sharded_cache_t *cache, unsigned long hash)
+{
+        uint64_t mixed;
+
+        if (cache->shard_bits == 0)
+                return 0;
+
+        mixed = (uint64_t) hash * LRU_SHARD_HASH_MULTIPLIER;
+
+        return (size_t) (mixed >> (64 - cache->shard_bits));
+}
+
+static lru_cache_t *
+shard_for_hash (lru_sharded_cache_t *cache, unsigned long hash)
+{
+        return cache->shards[shard_index (cache, hash)];
+}
+
+static size_t
+shard_capacity (size_t capacity, size_t n_shards, size_t index)
+{
+        return capacity / n_shards + (index < capacity % n_shards ? 1 : 0);
+}
+
+/* With LRU_CACHE_FLAG_NUMA the shards are dealt round-robin to the
+ * online NUMA nodes.
+ */
+lru_sharded_cache_t *
+lru_sharded_cache_create_ex (size_t capacity, size_t n_shards,
+                             unsigned int flags)
+{
+        lru_sharded_cache_t *cache;
+        unsigned int n_nodes;
+        size_t  i;
+        int     node;
+
+        if (capacity < LRU_CACHE_MIN_CAPACITY)
+                capacity = LRU_CACHE_DEFAULT_CAPACITY;
+
+        if (n_shards == 0)
+                n_shards = default_shard_count ();
+
+        if (n_shards > LRU_SHARDED_CACHE_MAX_SHARDS)
+                n_shards = LRU_SHARDED_CACHE_MAX_SHARDS;
+
+        cache = calloc (1, sizeof (lru_sharded_cache_t));
+        if (cache == NULL)
+                return NULL;
+
+        while (((size_t) 2 << cache->shard_bits) <= n_shards &&
+               ((size_t) 2 << cache->shard_bits) <= capacity)
+                cache->shard_bits++;
+
+        cache->n_shards = (size_t) 1 << cache->shard_bits;
+        cache->hash_fn = default_hash;
+
+        cache->shards = calloc (cache->n_shards, sizeof (lru_cache_t *));
+        if (cache->shards == NULL)
         {
-                free (cache->hash_table);
                 free (cache);
                 return NULL;
         }
 
+        n_nodes = (flags & LRU_CACHE_FLAG_NUMA) != 0 ?
+                numa_node_count () : 1;
+
+        for (i = 0; i < cache->n_shards; i++)
+        {
+                node = n_nodes > 1 ?
+                        (int) numa_topology.nodes[i % n_nodes] :
+                        LRU_NUMA_NO_NODE;
+                cache->shards[i] =
+                        create_cache (shard_capacity
+                                      (capacity, cache->n_shards, i),
+                                      flags, node);
+                if (cache->shards[i] == NULL)
+                {
+                        while (i-- > 0)
+                                lru_cache_destroy (cache->shards[i]);
+                        free (cache->shards);
+                        free (cache);
+                        return NULL;
+                }
+        }
+
         return cache;
 }
 
+lru_sharded_cache_t *
+lru_sharded_cache_create (size_t capacity, size_t n_shards)
+{
+        return lru_sharded_cache_create_ex (capacity, n_shards,
+                                            LRU_CACHE_FLAG_NONE);
+}
+
+void
+lru_sharded_cache_destroy (lru_sharded_cache_t *cache)
+{
+        size_t  i;
+
+        if (cache == NULL)
+                return;
+
+        for (i = 0; i < cache->n_shards; i++)
+                lru_cache_destroy (cache->shards[i]);
+
+        free (cache->shards);
+        free (cache);
+}
+
+size_t
+lru_sharded_cache_shard_count (lru_sharded_cache_t *cache)
+{
+        if (cache == NULL)
+                return 0;
+
+        return cache->n_shards;
+}
+
+lru_cache_t *
+lru_sharded_cache_shard (lru_sharded_cache_t *cache, size_t index)
+{
+        if (cache == NULL || index >= cache->n_shards)
+                return NULL;
+
+        return cache->shards[index];
+}
+
+/* The node whose shard holds key, for routing requests to threads bound
+ * there with lru_numa_bind_thread(); -1 when the shards are not bound.
+ */
 int
-lru_cache_set_allocator (lru_cache_t *cache, const lru_allocator_t *allocator)
+lru_sharded_cache_key_node (lru_sharded_cache_t *cache, const void *key,
+                            size_t key_size)
 {
-        if (cache == NULL || allocator == NULL)
-                return LRU_ERROR_INVALID_ARG;
+        if (cache == NULL || key == NULL || key_size == 0)
+                return LRU_NUMA_NO_NODE;
 
-        if (cache->size > 0)
-                return LRU_ERROR_INVALID_ARG;
+        return shard_for_hash (cache, cache->hash_fn (key, key_size))->
+                numa_node;
+}
 
-        if (allocator->malloc_fn != NULL)
-                cache->allocator.malloc_fn = allocator->malloc_fn;
+size_t
+lru_sharded_cache_size (lru_sharded_cache_t *cache)
+{
+        size_t  size;
+        size_t  i;
 
-        if (allocator->free_fn != NULL)
-                cache->allocator.free_fn = allocator->free_fn;
+        if (cache == NULL)
+                return 0;
 
-        if (allocator->copy_fn != NULL)
-                cache->allocator.copy_fn = allocator->copy_fn;
+        size = 0;
+        for (i = 0; i < cache->n_shards; i++)
+                size += lru_cache_size (cache->shards[i]);
+
+        return size;
+}
+
+int
+lru_sharded_cache_set_allocator (lru_sharded_cache_t *cache,
+                                 const lru_allocator_t *allocator)
+{
+        size_t  i;
+        int     result;
+
+        if (cache == NULL || allocator == NULL)
+                return LRU_ERROR_INVALID_ARG;
 
-        if (allocator->destroy_fn != NULL)
-                cache->allocator.destroy_fn = allocator->destroy_fn;
+        if (lru_sharded_cache_size (cache) > 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        for (i = 0; i < cache->n_shards; i++)
+        {
+                result = lru_cache_set_allocator (cache->shards[i], allocator);
+                if (result != LRU_SUCCESS)
+                        return result;
+        }
 
         return LRU_SUCCESS;
 }
 
 int
-lru_cache_set_hash_function (lru_cache_t *cache, lru_hash_fn hash_fn)
+lru_sharded_cache_set_hash_function (lru_sharded_cache_t *cache,
+                                     lru_hash_fn hash_fn)
 {
+        size_t  i;
+        int     result;
+
         if (cache == NULL || hash_fn == NULL)
                 return LRU_ERROR_INVALID_ARG;
 
-        if (cache->size > 0)
+        if (lru_sharded_cache_size (cache) > 0)
                 return LRU_ERROR_INVALID_ARG;
 
+        for (i = 0; i < cache->n_shards; i++)
+        {
+                result = lru_cache_set_hash_function (cache->shards[i],
+                                                      hash_fn);
+                if (result != LRU_SUCCESS)
+                        return result;
+        }
+
         cache->hash_fn = hash_fn;
         return LRU_SUCCESS;
 }
 
 int
-lru_cache_set_compare_function (lru_cache_t *cache, lru_compare_fn compare_fn)
+lru_sharded_cache_set_compare_function (lru_sharded_cache_t *cache,
+                                        lru_compare_fn compare_fn)
 {
+        size_t  i;
+        int     result;
+
         if (cache == NULL || compare_fn == NULL)
                 return LRU_ERROR_INVALID_ARG;
 
-        if (cache->size > 0)
+        if (lru_sharded_cache_size (cache) > 0)
                 return LRU_ERROR_INVALID_ARG;
 
-        cache->compare_fn = compare_fn;
+        for (i = 0; i < cache->n_shards; i++)
+        {
+                result = lru_cache_set_compare_function (cache->shards[i],
+                                                         compare_fn);
+                if (result != LRU_SUCCESS)
+                        return result;
+        }
+
         return LRU_SUCCESS;
 }
 
+/* The callback may run concurrently from different shards. */
 int
-lru_cache_set_eviction_callback (lru_cache_t *cache,
-                                 lru_eviction_fn eviction_fn, void *user_data)
+lru_sharded_cache_set_eviction_callback (lru_sharded_cache_t *cache,
+                                         lru_eviction_fn eviction_fn,
+                                         void *user_data)
 {
+        size_t  i;
+
         if (cache == NULL)
                 return LRU_ERROR_INVALID_ARG;
 
-        cache->eviction_fn = eviction_fn;
-        cache->eviction_user_data = user_data;
+        for (i = 0; i < cache->n_shards; i++)
+                lru_cache_set_eviction_callback (cache->shards[i],
+                                                 eviction_fn, user_data);
 
         return LRU_SUCCESS;
 }
 
+/* All or nothing: every shard is write-locked, in shard order, while the
+ * hooks are checked and installed, so a shard filled or a lock failing
+ * part way leaves every shard with the hooks it had.
+ */
 int
-lru_cache_put (lru_cache_t *cache, const void *key, size_t key_size,
-               const void *value, size_t value_size)
+lru_sharded_cache_set_compression (lru_sharded_cache_t *cache,
+                                   lru_compress_fn compress_fn,
+                                   lru_decompress_fn decompress_fn,
+                                   size_t threshold, void *user_data)
 {
-        lru_node_t *node;
+        lru_cache_t *shard;
+        size_t  locked;
+        size_t  i;
         int     result;
 
-        if (cache == NULL || key == NULL || value == NULL ||
-            key_size == 0 || value_size == 0)
+        if (cache == NULL || (compress_fn == NULL) != (decompress_fn == NULL))
                 return LRU_ERROR_INVALID_ARG;
 
-        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
-                return LRU_ERROR_LOCK;
-
-        node = find_in_hash_table (cache, key, key_size, NULL);
-
-        if (node != NULL)
-        {
-                void   *new_value;
-
-                new_value = cache->allocator.copy_fn (value, value_size);
-                if (new_value == NULL)
-                {
-                        result = LRU_ERROR_NOMEM;
-                        goto cleanup;
-                }
-
-                cache->allocator.destroy_fn (node->value);
-                node->value = new_value;
-                node->value_size = value_size;
-
-                move_to_front (cache, node);
-                result = LRU_SUCCESS;
-                goto cleanup;
-        }
-
-        node = create_node (cache, key, key_size, value, value_size);
-        if (node == NULL)
-        {
-                result = LRU_ERROR_NOMEM;
-                goto cleanup;
-        }
-
-        if (cache->size >= cache->capacity)
+        result = LRU_SUCCESS;
+        for (locked = 0; locked < cache->n_shards; locked++)
         {
-                result = evict_lru (cache);
-                if (result != LRU_SUCCESS)
+                shard = cache->shards[locked];
+                if (shard->thread_safe &&
+                    pthread_rwlock_wrlock (&shard->lock) != 0)
                 {
-                        destroy_node (cache, node);
+                        result = LRU_ERROR_LOCK;
                         goto cleanup;
                 }
-        }
-
-        result = add_to_hash_table (cache, node);
-        if (result != LRU_SUCCESS)
-        {
-                destroy_node (cache, node);
-                goto cleanup;
-        }
-
-        add_to_front (cache, node);
-        cache->size++;
 
-        if (cache->track_stats)
-        {
-                cache->stats.insertions++;
-                cache->stats.current_size = cache->size;
-                if (cache->size > cache->stats.peak_size)
-                        cache->stats.peak_size = cache->size;
+                if (!compression_settable (shard))
+                        result = LRU_ERROR_INVALID_ARG;
         }
 
-        result = LRU_SUCCESS;
+        if (result == LRU_SUCCESS)
+                for (i = 0; i < cache->n_shards; i++)
+                        install_compression (cache->shards[i], compress_fn,
+                                             decompress_fn, threshold,
+                                             user_data);
 
-      cleanup:
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+cleanup:
+        for (i = 0; i < locked; i++)
+                if (cache->shards[i]->thread_safe)
+                        pthread_rwlock_unlock (&cache->shards[i]->lock);
 
         return result;
 }
 
+/* Each shard spills to its own file, path with the shard number
+ * appended, taking an equal part of capacity.
+ */
 int
-lru_cache_get (lru_cache_t *cache, const void *key, size_t key_size,
-               void **value, size_t *value_size)
+lru_sharded_cache_attach_tier (lru_sharded_cache_t *cache, const char *path,
+                               size_t capacity)
 {
-        lru_node_t *node;
+        char   *shard_path;
+        size_t  length;
+        size_t  i;
         int     result;
 
-        if (cache == NULL || key == NULL || value == NULL || key_size == 0)
+        if (cache == NULL || path == NULL || capacity < cache->n_shards)
                 return LRU_ERROR_INVALID_ARG;
 
-        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
-                return LRU_ERROR_LOCK;
-
-        node = find_in_hash_table (cache, key, key_size, NULL);
-
-        if (node == NULL)
-        {
-                if (cache->track_stats)
-                        cache->stats.misses++;
-
-                result = LRU_ERROR_NOT_FOUND;
-                goto cleanup;
-        }
-
-        move_to_front (cache, node);
+        length = strlen (path) + 8;
+        shard_path = malloc (length);
+        if (shard_path == NULL)
+                return LRU_ERROR_NOMEM;
 
-        *value = cache->allocator.copy_fn (node->value, node->value_size);
-        if (*value == NULL)
+        result = LRU_SUCCESS;
+        for (i = 0; i < cache->n_shards && result == LRU_SUCCESS; i++)
         {
-                result = LRU_ERROR_NOMEM;
-                goto cleanup;
+                snprintf (shard_path, length, "%s.%zu", path, i);
+                result = lru_cache_attach_tier (cache->shards[i], shard_path,
+                                                capacity / cache->n_shards);
         }
 
-        if (value_size != NULL)
-                *value_size = node->value_size;
-
-        if (cache->track_stats)
-                cache->stats.hits++;
-
-        result = LRU_SUCCESS;
-
-      cleanup:
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+        free (shard_path);
 
         return result;
 }
 
 int
-lru_cache_peek (lru_cache_t *cache, const void *key, size_t key_size,
-                void **value, size_t *value_size)
+lru_sharded_cache_flush_tier (lru_sharded_cache_t *cache)
 {
-        lru_node_t *node;
+        size_t  i;
         int     result;
 
-        if (cache == NULL || key == NULL || value == NULL || key_size == 0)
+        if (cache == NULL)
                 return LRU_ERROR_INVALID_ARG;
 
-        if (cache->thread_safe && pthread_rwlock_rdlock (&cache->lock) != 0)
-                return LRU_ERROR_LOCK;
-
-        node = find_in_hash_table (cache, key, key_size, NULL);
-
-        if (node == NULL)
-        {
-                result = LRU_ERROR_NOT_FOUND;
-                goto cleanup;
-        }
-
-        *value = cache->allocator.copy_fn (node->value, node->value_size);
-        if (*value == NULL)
+        for (i = 0; i < cache->n_shards; i++)
         {
-                result = LRU_ERROR_NOMEM;
-                goto cleanup;
+                result = lru_cache_flush_tier (cache->shards[i]);
+                if (result != LRU_SUCCESS)
+                        return result;
         }
 
-        if (value_size != NULL)
-                *value_size = node->value_size;
-
-        result = LRU_SUCCESS;
-
-      cleanup:
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
-
-        return result;
+        return LRU_SUCCESS;
 }
 
 int
-lru_cache_delete (lru_cache_t *cache, const void *key, size_t key_size)
+lru_sharded_cache_put (lru_sharded_cache_t *cache, const void *key,
+                       size_t key_size, const void *value, size_t value_size)
 {
-        lru_node_t *node;
-        int     result;
+        unsigned long hash;
 
-        if (cache == NULL || key == NULL || key_size == 0)
+        if (cache == NULL || key == NULL || value == NULL ||
+            key_size == 0 || value_size == 0)
                 return LRU_ERROR_INVALID_ARG;
 
-        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
-                return LRU_ERROR_LOCK;
-
-        node = find_in_hash_table (cache, key, key_size, NULL);
-
-        if (node == NULL)
-        {
-                result = LRU_ERROR_NOT_FOUND;
-                goto cleanup;
-        }
-
-        remove_from_hash_table (cache, node);
-        remove_from_list (cache, node);
-
-        cache->size--;
-
-        if (cache->track_stats)
-        {
-                cache->stats.deletions++;
-                cache->stats.current_size = cache->size;
-        }
-
-        destroy_node (cache, node);
-        result = LRU_SUCCESS;
-
-      cleanup:
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+        hash = cache->hash_fn (key, key_size);
 
-        return result;
+        return put_hashed (shard_for_hash (cache, hash), hash, key, key_size,
+                           value, value_size, 0, false);
 }
 
-bool
-lru_cache_contains (lru_cache_t *cache, const void *key, size_t key_size)
+int
+lru_sharded_cache_put_owned (lru_sharded_cache_t *cache, void *key,
+                             size_t key_size, void *value, size_t value_size)
 {
-        lru_node_t *node;
-        bool    result;
-
-        if (cache == NULL || key == NULL || key_size == 0)
-                return false;
-
-        if (cache->thread_safe && pthread_rwlock_rdlock (&cache->lock) != 0)
-                return false;
+        unsigned long hash;
 
-        node = find_in_hash_table (cache, key, key_size, NULL);
-        result = (node != NULL);
+        if (cache == NULL || key == NULL || value == NULL ||
+            key_size == 0 || value_size == 0)
+                return LRU_ERROR_INVALID_ARG;
 
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+        hash = cache->hash_fn (key, key_size);
 
-        return result;
+        return put_hashed (shard_for_hash (cache, hash), hash, key, key_size,
+                           value, value_size, 0, true);
 }
 
-void
-lru_cache_clear (lru_cache_t *cache)
+int
+lru_sharded_cache_put_ttl (lru_sharded_cache_t *cache, const void *key,
+                           size_t key_size, const void *value,
+                           size_t value_size, uint64_t ttl_ms)
 {
-        lru_node_t *node;
-        lru_node_t *next;
-        size_t  i;
-
-        if (cache == NULL)
-                return;
-
-        if (cache->thread_safe)
-                pthread_rwlock_wrlock (&cache->lock);
-
-        node = cache->head;
-        while (node != NULL)
-        {
-                next = node->next;
-                destroy_node (cache, node);
-                node = next;
-        }
-
-        for (i = 0; i < cache->hash_table_size; i++)
-        {
-                lru_hash_entry_t *entry;
-                lru_hash_entry_t *next_entry;
-
-                entry = cache->hash_table[i];
-                while (entry != NULL)
-                {
-                        next_entry = entry->next;
-                        cache->allocator.free_fn (entry);
-                        entry = next_entry;
-                }
-                cache->hash_table[i] = NULL;
-        }
+        unsigned long hash;
 
-        cache->head = NULL;
-        cache->tail = NULL;
-        cache->size = 0;
+        if (cache == NULL || key == NULL || value == NULL ||
+            key_size == 0 || value_size == 0 || ttl_ms == 0)
+                return LRU_ERROR_INVALID_ARG;
 
-        if (cache->track_stats)
-                cache->stats.current_size = 0;
+        hash = cache->hash_fn (key, key_size);
 
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+        return put_hashed (shard_for_hash (cache, hash), hash, key, key_size,
+                           value, value_size, monotonic_ms () + ttl_ms,
+                           false);
 }
 
-void
-lru_cache_destroy (lru_cache_t *cache)
+int
+lru_sharded_cache_get (lru_sharded_cache_t *cache, const void *key,
+                       size_t key_size, void **value, size_t *value_size)
 {
-        if (cache == NULL)
-                return;
-
-        lru_cache_clear (cache);
-
-        free (cache->hash_table);
-
-        if (cache->thread_safe)
-                pthread_rwlock_destroy (&cache->lock);
+        unsigned long hash;
 
-        free (cache);
-}
+        if (cache == NULL || key == NULL || value == NULL || key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
 
-size_t
-lru_cache_size (lru_cache_t *cache)
-{
-        size_t  size;
+        hash = cache->hash_fn (key, key_size);
 
-        if (cache == NULL)
-                return 0;
+        return get_hashed (shard_for_hash (cache, hash), hash, key, key_size,
+                           value, value_size);
+}
 
-        if (cache->thread_safe)
-                pthread_rwlock_rdlock (&cache->lock);
+int
+lru_sharded_cache_get_or_load (lru_sharded_cache_t *cache, const void *key,
+                               size_t key_size, lru_loader_fn loader,
+                               void *ctx, void **value, size_t *value_size)
+{
+        unsigned long hash;
 
-        size = cache->size;
+        if (cache == NULL || key == NULL || key_size == 0 || loader == NULL ||
+            value == NULL)
+                return LRU_ERROR_INVALID_ARG;
 
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+        hash = cache->hash_fn (key, key_size);
 
-        return size;
+        return get_or_load_hashed (shard_for_hash (cache, hash), hash, key,
+                                   key_size, loader, ctx, value, value_size);
 }
 
-size_t
-lru_cache_capacity (lru_cache_t *cache)
+int
+lru_sharded_cache_peek (lru_sharded_cache_t *cache, const void *key,
+                        size_t key_size, void **value, size_t *value_size)
 {
-        if (cache == NULL)
-                return 0;
+        unsigned long hash;
 
-        return cache->capacity;
+        if (cache == NULL || key == NULL || value == NULL || key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        hash = cache->hash_fn (key, key_size);
+
+        return peek_hashed (shard_for_hash (cache, hash), hash, key, key_size,
+                            value, value_size);
 }
 
 int
-lru_cache_resize (lru_cache_t *cache, size_t new_capacity)
+lru_sharded_cache_acquire (lru_sharded_cache_t *cache, const void *key,
+                           size_t key_size, const void **value,
+                           size_t *value_size, lru_handle_t **handle)
 {
-        if (cache == NULL || new_capacity < LRU_CACHE_MIN_CAPACITY)
-                return LRU_ERROR_INVALID_ARG;
+        unsigned long hash;
 
-        if (cache->thread_safe && pthread_rwlock_wrlock (&cache->lock) != 0)
-                return LRU_ERROR_LOCK;
+        if (cache == NULL || key == NULL || value == NULL || handle == NULL ||
+            key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
 
-        cache->capacity = new_capacity;
+        hash = cache->hash_fn (key, key_size);
 
-        while (cache->size > cache->capacity)
-                evict_lru (cache);
+        return acquire_hashed (shard_for_hash (cache, hash), hash, key,
+                               key_size, value, value_size, handle);
+}
 
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+void
+lru_sharded_cache_release (lru_sharded_cache_t *cache, lru_handle_t *handle)
+{
+        if (cache == NULL || handle == NULL)
+                return;
 
-        return LRU_SUCCESS;
+        lru_cache_release (shard_for_hash (cache, handle->hash), handle);
 }
 
 int
-lru_cache_get_stats (lru_cache_t *cache, lru_stats_t *stats)
+lru_sharded_cache_delete (lru_sharded_cache_t *cache, const void *key,
+                          size_t key_size)
 {
-        if (cache == NULL || stats == NULL)
-                return LRU_ERROR_INVALID_ARG;
+        unsigned long hash;
 
-        if (!cache->track_stats)
+        if (cache == NULL || key == NULL || key_size == 0)
                 return LRU_ERROR_INVALID_ARG;
 
-        if (cache->thread_safe && pthread_rwlock_rdlock (&cache->lock) != 0)
-                return LRU_ERROR_LOCK;
+        hash = cache->hash_fn (key, key_size);
 
-        memcpy (stats, &cache->stats, sizeof (lru_stats_t));
+        return delete_hashed (shard_for_hash (cache, hash), hash, key,
+                              key_size);
+}
 
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+int
+lru_sharded_cache_take (lru_sharded_cache_t *cache, const void *key,
+                        size_t key_size, void **value, size_t *value_size)
+{
+        unsigned long hash;
 
-        return LRU_SUCCESS;
+        if (cache == NULL || key == NULL || value == NULL || key_size == 0)
+                return LRU_ERROR_INVALID_ARG;
+
+        hash = cache->hash_fn (key, key_size);
+
+        return take_hashed (shard_for_hash (cache, hash), hash, key, key_size,
+                            value, value_size);
 }
 
-void
-lru_cache_reset_stats (lru_cache_t *cache)
+bool
+lru_sharded_cache_contains (lru_sharded_cache_t *cache, const void *key,
+                            size_t key_size)
 {
-        if (cache == NULL || !cache->track_stats)
-                return;
+        unsigned long hash;
 
-        if (cache->thread_safe)
-                pthread_rwlock_wrlock (&cache->lock);
+        if (cache == NULL || key == NULL || key_size == 0)
+                return false;
 
-        memset (&cache->stats, 0, sizeof (lru_stats_t));
-        cache->stats.current_size = cache->size;
-        cache->stats.peak_size = cache->size;
+        hash = cache->hash_fn (key, key_size);
 
-        if (cache->thread_safe)
-                pthread_rwlock_unlock (&cache->lock);
+        return contains_hashed (shard_for_hash (cache, hash), hash, key,
+                                key_size);
 }
 
-lru_iterator_t *
-lru_iterator_create (lru_cache_t *cache)
+/* Groups a chunk by shard so each shard's lock is taken once. */
+static int
+run_sharded_batch (lru_sharded_cache_t *cache, lru_batch_t *batch, size_t n,
+                   bool put)
 {
-        lru_iterator_t *iter;
+        bool    done[LRU_CACHE_BATCH_SIZE];
+        size_t  members;
+        size_t  shard;
+        size_t  i;
+        size_t  j;
+        int     result;
 
-        if (cache == NULL)
-                return NULL;
+        hash_batch (batch, n, cache->hash_fn, put);
 
-        iter = cache->allocator.malloc_fn (sizeof (lru_iterator_t));
-        if (iter == NULL)
-                return NULL;
+        for (i = 0; i < n; i++)
+        {
+                done[i] = batch->results[i] != LRU_SUCCESS;
+                if (!done[i])
+                        batch->shards[i] = shard_index (cache,
+                                                        batch->hashes[i]);
+        }
 
-        iter->cache = cache;
-        iter->current = NULL;
-        iter->locked = false;
+        result = LRU_SUCCESS;
 
-        if (cache->thread_safe)
+        for (i = 0; i < n; i++)
         {
-                if (pthread_rwlock_rdlock (&cache->lock) != 0)
+                if (done[i])
+                        continue;
+
+                shard = batch->shards[i];
+                members = 0;
+                for (j = i; j < n; j++)
                 {
-                        cache->allocator.free_fn (iter);
-                        return NULL;
+                        if (!done[j] && batch->shards[j] == shard)
+                        {
+                                batch->members[members++] = j;
+                                done[j] = true;
+                        }
                 }
-                iter->locked = true;
-        }
 
-        iter->current = cache->head;
+                if (run_batch (cache->shards[shard], batch, members, put) !=
+                    LRU_SUCCESS)
+                        result = LRU_ERROR_LOCK;
+        }
 
-        return iter;
+        return result;
 }
 
-bool
-lru_iterator_has_next (lru_iterator_t *iter)
+int
+lru_sharded_cache_get_many (lru_sharded_cache_t *cache, size_t count,
+                            const void *const *keys, const size_t *key_sizes,
+                            void **values, size_t *value_sizes, int *results)
 {
-        if (iter == NULL)
-                return false;
+        lru_batch_t batch;
+        size_t  base;
+        size_t  n;
+        int     result;
 
-        return iter->current != NULL;
+        if (cache == NULL || keys == NULL || key_sizes == NULL ||
+            values == NULL || results == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        result = LRU_SUCCESS;
+
+        for (base = 0; base < count; base += n)
+        {
+                n = count - base;
+                if (n > LRU_CACHE_BATCH_SIZE)
+                        n = LRU_CACHE_BATCH_SIZE;
+
+                batch.keys = keys + base;
+                batch.key_sizes = key_sizes + base;
+                batch.values = values + base;
+                batch.value_sizes = value_sizes != NULL ?
+                        value_sizes + base : NULL;
+                batch.results = results + base;
+
+                if (run_sharded_batch (cache, &batch, n, false) !=
+                    LRU_SUCCESS)
+                        result = LRU_ERROR_LOCK;
+        }
+
+        return result;
 }
 
 int
-lru_iterator_next (lru_iterator_t *iter, void **key, size_t *key_size,
-                   void **value, size_t *value_size)
+lru_sharded_cache_put_many (lru_sharded_cache_t *cache, size_t count,
+                            const void *const *keys, const size_t *key_sizes,
+                            const void *const *values,
+                            const size_t *value_sizes, int *results)
 {
-        lru_node_t *node;
-        lru_cache_t *cache;
+        lru_batch_t batch;
+        size_t  base;
+        size_t  n;
+        int     result;
 
-        if (iter == NULL || iter->current == NULL)
+        if (cache == NULL || keys == NULL || key_sizes == NULL ||
+            values == NULL || value_sizes == NULL)
                 return LRU_ERROR_INVALID_ARG;
 
-        node = iter->current;
-        cache = iter->cache;
+        result = LRU_SUCCESS;
 
-        if (key != NULL)
+        for (base = 0; base < count; base += n)
         {
-                *key = cache->allocator.copy_fn (node->key, node->key_size);
-                if (*key == NULL)
-                        return LRU_ERROR_NOMEM;
-        }
-
-        if (key_size != NULL)
-                *key_size = node->key_size;
+                n = count - base;
+                if (n > LRU_CACHE_BATCH_SIZE)
+                        n = LRU_CACHE_BATCH_SIZE;
 
-        if (value != NULL)
-        {
-                *value = cache->allocator.copy_fn (node->value,
-                                                   node->value_size);
-                if (*value == NULL)
-                {
-                        if (key != NULL && *key != NULL)
-                                cache->allocator.destroy_fn (*key);
-                        return LRU_ERROR_NOMEM;
-                }
-        }
+                batch.keys = keys + base;
+                batch.key_sizes = key_sizes + base;
+                batch.put_values = values + base;
+                batch.put_value_sizes = value_sizes + base;
+                batch.results = results != NULL ? results + base :
+                        batch.scratch;
 
-        if (value_size != NULL)
-                *value_size = node->value_size;
+                run_sharded_batch (cache, &batch, n, true);
 
-        iter->current = node->next;
+                if (result == LRU_SUCCESS)
+                        result = first_failure (batch.results, n);
+        }
 
-        return LRU_SUCCESS;
+        return result;
 }
 
 void
-lru_iterator_destroy (lru_iterator_t *iter)
+lru_sharded_cache_clear (lru_sharded_cache_t *cache)
 {
-        if (iter == NULL)
-                return;
+        size_t  i;
 
-        if (iter->locked && iter->cache->thread_safe)
-                pthread_rwlock_unlock (&iter->cache->lock);
+        if (cache == NULL)
+                return;
 
-        iter->cache->allocator.free_fn (iter);
+        for (i = 0; i < cache->n_shards; i++)
+                lru_cache_clear (cache->shards[i]);
 }
 
-static void
-example_eviction_callback (const void *key, size_t key_size,
-                           void *value, size_t value_size, void *user_data)
+size_t
+lru_sharded_cache_expire (lru_sharded_cache_t *cache)
 {
-        int    *eviction_count;
+        size_t  expired;
+        size_t  i;
+
+        if (cache == NULL)
+                return 0;
 
-        eviction_count = (int *) user_data;
-        (*eviction_count)++;
+        expired = 0;
+        for (i = 0; i < cache->n_shards; i++)
+                expired += lru_cache_expire (cache->shards[i]);
 
-        printf ("Evicting key: %.*s\n", (int) key_size, (const char *) key);
+        return expired;
 }
 
-static void
-print_cache_stats (lru_cache_t *cache)
+size_t
+lru_sharded_cache_capacity (lru_sharded_cache_t *cache)
 {
-        lru_stats_t stats;
+        size_t  capacity;
+        size_t  i;
 
-        if (lru_cache_get_stats (cache, &stats) == LRU_SUCCESS)
-        {
-                printf ("\nCache Statistics:\n");
-                printf ("  Hits:        %lu\n", stats.hits);
-                printf ("  Misses:      %lu\n", stats.misses);
-                printf ("  Evictions:   %lu\n", stats.evictions);
-                printf ("  Insertions:  %lu\n", stats.insertions);
-                printf ("  Deletions:   %lu\n", stats.deletions);
-                printf ("  Collisions:  %lu\n", stats.collisions);
-                printf ("  Current Size: %zu\n", stats.current_size);
-                printf ("  Peak Size:   %zu\n", stats.peak_size);
+        if (cache == NULL)
+                return 0;
 
-                if (stats.hits + stats.misses > 0)
-                {
-                        double  hit_rate;
-                        hit_rate =
-                                (double) stats.hits / (stats.hits +
-                                                       stats.misses) * 100.0;
-                        printf ("  Hit Rate:    %.2f%%\n", hit_rate);
-                }
-        }
+        capacity = 0;
+        for (i = 0; i < cache->n_shards; i++)
+                capacity += lru_cache_capacity (cache->shards[i]);
+
+        return capacity;
 }
 
 int
-main (void)
+lru_sharded_cache_resize (lru_sharded_cache_t *cache, size_t new_capacity)
 {
-        lru_cache_t *cache;
-        int     eviction_count;
-        char   *value;
-        size_t  value_size;
-        int     i;
-        char    key_buf[32];
-        char    value_buf[64];
+        size_t  i;
+        int     result;
 
-        printf ("=================================\n\n");
+        if (cache == NULL || new_capacity < cache->n_shards)
+                return LRU_ERROR_INVALID_ARG;
 
-        cache = lru_cache_create (5);
-        if (cache == NULL)
+        for (i = 0; i < cache->n_shards; i++)
         {
-                fprintf (stderr, "Failed to create cache\n");
-                return 1;
+                result = lru_cache_resize (cache->shards[i],
+                                           shard_capacity (new_capacity,
+                                                           cache->n_shards,
+                                                           i));
+                if (result != LRU_SUCCESS)
+                        return result;
         }
 
-        printf ("Created cache with capacity: %zu\n",
-                lru_cache_capacity (cache));
+        return LRU_SUCCESS;
+}
 
-        eviction_count = 0;
-        lru_cache_set_eviction_callback (cache, example_eviction_callback,
-                                         &eviction_count);
+/* Every shard sheds an equal part of bytes. */
+size_t
+lru_sharded_cache_shed (lru_sharded_cache_t *cache, size_t bytes)
+{
+        size_t  released;
+        size_t  i;
 
-        printf ("\nAdding entries to cache:\n");
-        for (i = 1; i <= 7; i++)
-        {
-                snprintf (key_buf, sizeof (key_buf), "key%d", i);
-                snprintf (value_buf, sizeof (value_buf), "value_%d", i);
+        if (cache == NULL)
+                return 0;
 
-                printf ("  Put: %s -> %s\n", key_buf, value_buf);
-                lru_cache_put (cache, key_buf, strlen (key_buf) + 1,
-                               value_buf, strlen (value_buf) + 1);
-        }
+        released = 0;
+        for (i = 0; i < cache->n_shards; i++)
+                released += lru_cache_shed (cache->shards[i],
+                                            shard_capacity (bytes,
+                                                            cache->n_shards,
+                                                            i));
 
-        printf ("\nCache size: %zu / %zu\n",
-                lru_cache_size (cache), lru_cache_capacity (cache));
-        printf ("Total evictions: %d\n", eviction_count);
+        return released;
+}
 
-        printf ("\nTesting retrieval:\n");
+/* Each shard is registered as a cache of its own. */
+int
+lru_sharded_cache_register (lru_sharded_cache_t *cache)
+{
+        size_t  i;
+        int     result;
 
-        if (lru_cache_get (cache, "key3", 5, (void **) &value, &value_size)
-            == LRU_SUCCESS)
-        {
-                printf ("  Get key3: %s\n", value);
-                free (value);
-        }
-        else
-        {
-                printf ("  Get key3: NOT FOUND (evicted)\n");
-        }
+        if (cache == NULL)
+                return LRU_ERROR_INVALID_ARG;
 
-        if (lru_cache_get (cache, "key6", 5, (void **) &value, &value_size)
-            == LRU_SUCCESS)
+        for (i = 0; i < cache->n_shards; i++)
         {
-                printf ("  Get key6: %s\n", value);
-                free (value);
+                result = lru_cache_register (cache->shards[i]);
+                if (result != LRU_SUCCESS)
+                {
+                        while (i-- > 0)
+                                lru_cache_unregister (cache->shards[i]);
+                        return result;
+                }
         }
-        else
+
+        return LRU_SUCCESS;
+}
+
+void
+lru_sharded_cache_unregister (lru_sharded_cache_t *cache)
+{
+        size_t  i;
+
+        if (cache == NULL)
+                return;
+
+        for (i = 0; i < cache->n_shards; i++)
+                lru_cache_unregister (cache->shards[i]);
+}
+
+/* Counters are summed across shards.  peak_size is the sum of the
+ * per-shard peaks, which bounds the true peak from above.
+ */
+int
+lru_sharded_cache_get_stats (lru_sharded_cache_t *cache, lru_stats_t *stats)
+{
+        lru_stats_t shard_stats;
+        size_t  i;
+        int     result;
+
+        if (cache == NULL || stats == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        memset (stats, 0, sizeof (lru_stats_t));
+
+        for (i = 0; i < cache->n_shards; i++)
         {
-                printf ("  Get key6: NOT FOUND\n");
+                result = lru_cache_get_stats (cache->shards[i], &shard_stats);
+                if (result != LRU_SUCCESS)
+                        return result;
+
+                stats->hits += shard_stats.hits;
+                stats->misses += shard_stats.misses;
+                stats->evictions += shard_stats.evictions;
+                stats->expirations += shard_stats.expirations;
+                stats->insertions += shard_stats.insertions;
+                stats->deletions += shard_stats.deletions;
+                stats->collisions += shard_stats.collisions;
+                stats->current_size += shard_stats.current_size;
+                stats->peak_size += shard_stats.peak_size;
+                stats->current_bytes += shard_stats.current_bytes;
+                stats->spills += shard_stats.spills;
+                stats->tier_hits += shard_stats.tier_hits;
         }
 
-        printf ("\nIterating through cache (MRU to LRU):\n");
-        {
-                lru_iterator_t *iter;
-                char   *key;
-                size_t  key_size;
+        return LRU_SUCCESS;
+}
 
-                iter = lru_iterator_create (cache);
-                if (iter != NULL)
-                {
-                        while (lru_iterator_has_next (iter))
-                        {
-                                if (lru_iterator_next
-                                    (iter, (void **) &key, &key_size,
-                                     (void **) &value,
-                                     &value_size) == LRU_SUCCESS)
-                                {
-                                        printf ("  %s -> %s\n", key, value);
-                                        free (key);
-                                        free (value);
-                                }
-                        }
-                        lru_iterator_destroy (iter);
-                }
-        }
+int
+lru_sharded_cache_get_latency (lru_sharded_cache_t *cache,
+                               lru_latency_op_t op, lru_latency_t *latency)
+{
+        lru_histogram_t *merged;
+        size_t  i;
+
+        if (cache == NULL || latency == NULL || op >= LRU_LATENCY_OPS ||
+            cache->shards[0]->latency == NULL)
+                return LRU_ERROR_INVALID_ARG;
+
+        merged = calloc (1, sizeof (lru_histogram_t));
+        if (merged == NULL)
+                return LRU_ERROR_NOMEM;
 
-        print_cache_stats (cache);
+        for (i = 0; i < cache->n_shards; i++)
+                merge_histogram (cache->shards[i], op, merged);
+        summarize_histogram (merged, latency);
 
-        printf ("\nResizing cache to capacity 3:\n");
-        lru_cache_resize (cache, 3);
-        printf ("New size: %zu / %zu\n",
-                lru_cache_size (cache), lru_cache_capacity (cache));
-        printf ("Total evictions: %d\n", eviction_count);
+        free (merged);
 
-        lru_cache_destroy (cache);
+        return LRU_SUCCESS;
+}
+
+void
+lru_sharded_cache_reset_stats (lru_sharded_cache_t *cache)
+{
+        size_t  i;
 
-        printf ("\nCache destroyed successfully.\n");
+        if (cache == NULL)
+                return;
 
-        return 0;
+        for (i = 0; i < cache->n_shards; i++)
+                lru_cache_reset_stats (cache->shards[i]);
 }
@@ -0,0 +1,307 @@
+/* lru_cache.h - Public interface of the LRU cache library
+ *
+ * Keys and values are opaque byte strings copied into the cache with the
+ * allocator's copy_fn; lookups that return a value hand the caller a copy
+ * to release with the allocator's destroy_fn (free() by default), except
+ * lru_cache_acquire(), which pins the entry instead.
+ */
+
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef enum
+{
+        LRU_SUCCESS = 0,
+        LRU_ERROR_NOMEM = -1,
+        LRU_ERROR_INVALID_ARG = -2,
+        LRU_ERROR_NOT_FOUND = -3,
+        LRU_ERROR_LOCK = -4,
+        LRU_ERROR_FULL = -5,
+        LRU_ERROR_IO = -6
+} lru_error_t;
+
+typedef enum
+{
+        LRU_CACHE_FLAG_NONE = 0,
+        LRU_CACHE_FLAG_OPEN_ADDRESSING = 1 << 0,
+        LRU_CACHE_FLAG_INLINE_NODES = 1 << 1,
+        LRU_CACHE_FLAG_BYTE_CAPACITY = 1 << 2,
+        LRU_CACHE_FLAG_DEFERRED_PROMOTION = 1 << 3,
+        LRU_CACHE_FLAG_LOCKFREE_READS = 1 << 4,
+        LRU_CACHE_FLAG_SEGMENTED = 1 << 5,
+        LRU_CACHE_FLAG_TINYLFU = 1 << 6,
+        LRU_CACHE_FLAG_LATENCY_STATS = 1 << 7,
+        LRU_CACHE_FLAG_NUMA = 1 << 8,
+        LRU_CACHE_FLAG_HUGE_PAGES = 1 << 9
+} lru_cache_flag_t;
+
+typedef enum
+{
+        LRU_LATENCY_GET,
+        LRU_LATENCY_PUT,
+        LRU_LATENCY_DELETE,
+        LRU_LATENCY_EVICT,
+        LRU_LATENCY_LOCK_WAIT,
+        LRU_LATENCY_OPS
+} lru_latency_op_t;
+
+typedef enum
+{
+        LRU_TRACE_LOOKUP,
+        LRU_TRACE_INSERT,
+        LRU_TRACE_EVICT,
+        LRU_TRACE_RESIZE
+} lru_trace_event_t;
+
+typedef struct lru_cache lru_cache_t;
+typedef struct lru_sharded_cache lru_sharded_cache_t;
+typedef struct lru_node lru_handle_t;
+typedef struct lru_iterator lru_iterator_t;
+
+typedef void *(*lru_malloc_fn) (size_t size);
+typedef void (*lru_free_fn) (void *ptr);
+typedef void *(*lru_copy_fn) (const void *data, size_t size);
+typedef void (*lru_destroy_fn) (void *data);
+typedef unsigned long (*lru_hash_fn) (const void *key, size_t key_size);
+typedef int (*lru_compare_fn) (const void *key1, size_t size1,
+                               const void *key2, size_t size2);
+typedef void (*lru_eviction_fn) (const void *key, size_t key_size,
+                                 void *value, size_t value_size,
+                                 void *user_data);
+typedef int (*lru_loader_fn) (const void *key, size_t key_size,
+                              void **value, size_t *value_size, void *ctx);
+typedef void (*lru_trace_fn) (lru_trace_event_t event, const void *key,
+                              size_t key_size, size_t arg, void *user_data);
+typedef void (*lru_scan_fn) (const void *key, size_t key_size,
+                             const void *value, size_t value_size,
+                             void *user_data);
+typedef size_t (*lru_compress_fn) (const void *src, size_t src_size,
+                                   void *dst, size_t dst_capacity,
+                                   void *user_data);
+typedef size_t (*lru_decompress_fn) (const void *src, size_t src_size,
+                                     void *dst, size_t dst_size,
+                                     void *user_data);
+/* A shrink callback may use the registry and other caches, but must not
+ * destroy or unregister the cache it is handed: the registry holds that
+ * cache until the callback returns.
+ */
+typedef void (*lru_shrink_fn) (lru_cache_t *cache, size_t released,
+                               void *user_data);
+
+typedef struct lru_allocator
+{
+        lru_malloc_fn malloc_fn;
+        lru_free_fn free_fn;
+        lru_copy_fn copy_fn;
+        lru_destroy_fn destroy_fn;
+} lru_allocator_t;
+
+/* Latency summary for one operation, in nanoseconds.  Percentiles and
+ * the maximum are bucket upper bounds, within 1/8 of the true value.
+ */
+typedef struct lru_latency
+{
+        uint64_t count;
+        uint64_t mean_ns;
+        uint64_t p50_ns;
+        uint64_t p90_ns;
+        uint64_t p99_ns;
+        uint64_t p999_ns;
+        uint64_t max_ns;
+} lru_latency_t;
+
+typedef struct lru_stats
+{
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t expirations;
+        uint64_t insertions;
+        uint64_t deletions;
+        uint64_t collisions;
+        size_t  current_size;
+        size_t  peak_size;
+        size_t  current_bytes;
+        uint64_t spills;
+        uint64_t tier_hits;
+} lru_stats_t;
+
+const lru_allocator_t *lru_slab_allocator (void);
+
+int lru_numa_node_count (void);
+int lru_numa_current_node (void);
+int lru_numa_bind_thread (int node);
+
+lru_cache_t *lru_cache_create_ex (size_t capacity, unsigned int flags);
+lru_cache_t *lru_cache_create (size_t capacity);
+int lru_cache_set_allocator (lru_cache_t *cache,
+                             const lru_allocator_t *allocator);
+int lru_cache_set_hash_function (lru_cache_t *cache, lru_hash_fn hash_fn);
+int lru_cache_set_compare_function (lru_cache_t *cache,
+                                    lru_compare_fn compare_fn);
+int lru_cache_set_eviction_callback (lru_cache_t *cache,
+                                     lru_eviction_fn eviction_fn,
+                                     void *user_data);
+int lru_cache_set_compression (lru_cache_t *cache,
+                               lru_compress_fn compress_fn,
+                               lru_decompress_fn decompress_fn,
+                               size_t threshold, void *user_data);
+int lru_cache_attach_tier (lru_cache_t *cache, const char *path,
+                           size_t capacity);
+int lru_cache_flush_tier (lru_cache_t *cache);
+int lru_cache_put (lru_cache_t *cache, const void *key, size_t key_size,
+                   const void *value, size_t value_size);
+int lru_cache_put_ttl (lru_cache_t *cache, const void *key, size_t key_size,
+                       const void *value, size_t value_size, uint64_t ttl_ms);
+int lru_cache_put_owned (lru_cache_t *cache, void *key, size_t key_size,
+                         void *value, size_t value_size);
+size_t lru_cache_expire (lru_cache_t *cache);
+int lru_cache_get (lru_cache_t *cache, const void *key, size_t key_size,
+                   void **value, size_t *value_size);
+int lru_cache_peek (lru_cache_t *cache, const void *key, size_t key_size,
+                    void **value, size_t *value_size);
+int lru_cache_get_or_load (lru_cache_t *cache, const void *key,
+                           size_t key_size, lru_loader_fn loader, void *ctx,
+                           void **value, size_t *value_size);
+int lru_cache_acquire (lru_cache_t *cache, const void *key, size_t key_size,
+                       const void **value, size_t *value_size,
+                       lru_handle_t **handle);
+void lru_cache_release (lru_cache_t *cache, lru_handle_t *handle);
+int lru_cache_delete (lru_cache_t *cache, const void *key, size_t key_size);
+int lru_cache_take (lru_cache_t *cache, const void *key, size_t key_size,
+                    void **value, size_t *value_size);
+bool lru_cache_contains (lru_cache_t *cache, const void *key, size_t key_size);
+int lru_cache_get_many (lru_cache_t *cache, size_t count,
+                        const void *const *keys, const size_t *key_sizes,
+                        void **values, size_t *value_sizes, int *results);
+int lru_cache_put_many (lru_cache_t *cache, size_t count,
+                        const void *const *keys, const size_t *key_sizes,
+                        const void *const *values, const size_t *value_sizes,
+                        int *results);
+void lru_cache_clear (lru_cache_t *cache);
+void lru_cache_destroy (lru_cache_t *cache);
+size_t lru_cache_size (lru_cache_t *cache);
+size_t lru_cache_capacity (lru_cache_t *cache);
+int lru_cache_resize (lru_cache_t *cache, size_t new_capacity);
+size_t lru_cache_shed (lru_cache_t *cache, size_t bytes);
+int lru_cache_register (lru_cache_t *cache);
+void lru_cache_unregister (lru_cache_t *cache);
+int lru_cache_get_stats (lru_cache_t *cache, lru_stats_t *stats);
+void lru_cache_reset_stats (lru_cache_t *cache);
+int lru_cache_get_latency (lru_cache_t *cache, lru_latency_op_t op,
+                           lru_latency_t *latency);
+#ifdef LRU_CACHE_TRACE
+int lru_cache_set_trace_callback (lru_cache_t *cache, lru_trace_fn trace_fn,
+                                  void *user_data);
+#endif
+int lru_cache_save (lru_cache_t *cache, const char *path);
+int lru_cache_load (lru_cache_t *cache, const char *path);
+
+lru_iterator_t *lru_iterator_create (lru_cache_t *cache);
+bool lru_iterator_has_next (lru_iterator_t *iter);
+int lru_iterator_next (lru_iterator_t *iter, void **key, size_t *key_size,
+                       void **value, size_t *value_size);
+void lru_iterator_destroy (lru_iterator_t *iter);
+size_t lru_cache_scan (lru_cache_t *cache, size_t cursor, size_t count,
+                       lru_scan_fn fn, void *user_data);
+
+lru_sharded_cache_t *lru_sharded_cache_create_ex (size_t capacity,
+                                                  size_t n_shards,
+                                                  unsigned int flags);
+lru_sharded_cache_t *lru_sharded_cache_create (size_t capacity,
+                                               size_t n_shards);
+void lru_sharded_cache_destroy (lru_sharded_cache_t *cache);
+size_t lru_sharded_cache_shard_count (lru_sharded_cache_t *cache);
+lru_cache_t *lru_sharded_cache_shard (lru_sharded_cache_t *cache,
+                                      size_t index);
+int lru_sharded_cache_key_node (lru_sharded_cache_t *cache, const void *key,
+                                size_t key_size);
+size_t lru_sharded_cache_size (lru_sharded_cache_t *cache);
+int lru_sharded_cache_set_allocator (lru_sharded_cache_t *cache,
+                                     const lru_allocator_t *allocator);
+int lru_sharded_cache_set_hash_function (lru_sharded_cache_t *cache,
+                                         lru_hash_fn hash_fn);
+int lru_sharded_cache_set_compare_function (lru_sharded_cache_t *cache,
+                                            lru_compare_fn compare_fn);
+int lru_sharded_cache_set_eviction_callback (lru_sharded_cache_t *cache,
+                                             lru_eviction_fn eviction_fn,
+                                             void *user_data);
+int lru_sharded_cache_set_compression (lru_sharded_cache_t *cache,
+                                       lru_compress_fn compress_fn,
+                                       lru_decompress_fn decompress_fn,
+                                       size_t threshold, void *user_data);
+int lru_sharded_cache_attach_tier (lru_sharded_cache_t *cache,
+                                   const char *path, size_t capacity);
+int lru_sharded_cache_flush_tier (lru_sharded_cache_t *cache);
+int lru_sharded_cache_put (lru_sharded_cache_t *cache, const void *key,
+                           size_t key_size, const void *value,
+                           size_t value_size);
+int lru_sharded_cache_put_ttl (lru_sharded_cache_t *cache, const void *key,
+                               size_t key_size, const void *value,
+                               size_t value_size, uint64_t ttl_ms);
+int lru_sharded_cache_put_owned (lru_sharded_cache_t *cache, void *key,
+                                 size_t key_size, void *value,
+                                 size_t value_size);
+int lru_sharded_cache_get (lru_sharded_cache_t *cache, const void *key,
+                           size_t key_size, void **value, size_t *value_size);
+int lru_sharded_cache_get_or_load (lru_sharded_cache_t *cache, const void *key,
+                                   size_t key_size, lru_loader_fn loader,
+                                   void *ctx, void **value,
+                                   size_t *value_size);
+int lru_sharded_cache_peek (lru_sharded_cache_t *cache, const void *key,
+                            size_t key_size, void **value, size_t *value_size);
+int lru_sharded_cache_acquire (lru_sharded_cache_t *cache, const void *key,
+                               size_t key_size, const void **value,
+                               size_t *value_size, lru_handle_t **handle);
+void lru_sharded_cache_release (lru_sharded_cache_t *cache,
+                                lru_handle_t *handle);
+int lru_sharded_cache_delete (lru_sharded_cache_t *cache, const void *key,
+                              size_t key_size);
+int lru_sharded_cache_take (lru_sharded_cache_t *cache, const void *key,
+                            size_t key_size, void **value, size_t *value_size);
+bool lru_sharded_cache_contains (lru_sharded_cache_t *cache, const void *key,
+                                 size_t key_size);
+int lru_sharded_cache_get_many (lru_sharded_cache_t *cache, size_t count,
+                                const void *const *keys,
+                                const size_t *key_sizes, void **values,
+                                size_t *value_sizes, int *results);
+int lru_sharded_cache_put_many (lru_sharded_cache_t *cache, size_t count,
+                                const void *const *keys,
+                                const size_t *key_sizes,
+                                const void *const *values,
+                                const size_t *value_sizes, int *results);
+void lru_sharded_cache_clear (lru_sharded_cache_t *cache);
+size_t lru_sharded_cache_expire (lru_sharded_cache_t *cache);
+size_t lru_sharded_cache_capacity (lru_sharded_cache_t *cache);
+int lru_sharded_cache_resize (lru_sharded_cache_t *cache, size_t new_capacity);
+size_t lru_sharded_cache_shed (lru_sharded_cache_t *cache, size_t bytes);
+int lru_sharded_cache_register (lru_sharded_cache_t *cache);
+void lru_sharded_cache_unregister (lru_sharded_cache_t *cache);
+int lru_sharded_cache_get_stats (lru_sharded_cache_t *cache,
+                                 lru_stats_t *stats);
+int lru_sharded_cache_get_latency (lru_sharded_cache_t *cache,
+                                   lru_latency_op_t op,
+                                   lru_latency_t *latency);
+void lru_sharded_cache_reset_stats (lru_sharded_cache_t *cache);
+
+void lru_registry_set_budget (size_t bytes);
+void lru_registry_set_shrink_callback (lru_shrink_fn fn, void *user_data);
+size_t lru_registry_rebalance (void);
+size_t lru_registry_shed (size_t bytes);
+int lru_registry_start (const char *pressure_path, unsigned int interval_ms);
+void lru_registry_stop (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LRU_CACHE_H */
@@ -0,0 +1,351 @@
+/* lru_cache_define.h - Compile-time specialized fixed-size LRU caches
+ *
+ * LRU_CACHE_DEFINE (name, key_type, value_type, hash, eq) generates a
+ * cache type name_t whose nodes hold the key and value by value, so
+ * lookups call hash and eq inline instead of through function pointers
+ * and no per-entry allocation or copy_fn is involved.  hash (key)
+ * returns an integer and eq (a, b) is nonzero for equal keys; either
+ * may be a function or a function-like macro.  Keys and values are
+ * copied by assignment, so they should be plain data such as integers
+ * or small structs.
+ *
+ * All nodes are allocated at create time and the capacity is fixed.
+ * Each cache has its own mutex.  The generated functions are
+ *
+ *   name_t *name_create (size_t capacity);
+ *   void name_destroy (name_t *cache);
+ *   int name_get (name_t *cache, key_type key, value_type *value);
+ *   bool name_contains (name_t *cache, key_type key);
+ *   int name_put (name_t *cache, key_type key, value_type value);
+ *   int name_delete (name_t *cache, key_type key);
+ *   size_t name_size (name_t *cache);
+ *   int name_get_stats (name_t *cache, lru_stats_t *stats);
+ *
+ * returning the lru_error_t codes of lru_cache.h.  For example
+ *
+ *   LRU_CACHE_DEFINE (id_cache, uint64_t, uint64_t, lru_hash_u64,
+ *                     LRU_EQ_SCALAR)
+ */
+
+#ifndef LRU_CACHE_DEFINE_H
+#define LRU_CACHE_DEFINE_H
+
+#include "lru_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LRU_DEFINE_NONE UINT32_MAX
+
+#define LRU_EQ_SCALAR(a, b) ((a) == (b))
+
+/* Finalizer from MurmurHash3, for integer keys. */
+static inline uint64_t
+lru_hash_u64 (uint64_t key)
+{
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+
+        return key;
+}
+
+/* Fibonacci hashing takes the high bits, so even a weak hash such as the
+ * identity spreads over the buckets.
+ */
+static inline size_t
+lru_define_bucket (uint64_t hash, unsigned int shift)
+{
+        return (size_t) ((hash * 0x9E3779B97F4A7C15ULL) >> shift);
+}
+
+#define LRU_CACHE_DEFINE(name, key_type, value_type, hash, eq)               \
+typedef struct name##_node                                                   \
+{                                                                            \
+        key_type key;                                                        \
+        value_type value;                                                    \
+        uint32_t prev;                                                       \
+        uint32_t next;                                                       \
+        uint32_t chain;                                                      \
+} name##_node_t;                                                             \
+                                                                             \
+typedef struct name                                                          \
+{                                                                            \
+        pthread_mutex_t lock;                                                \
+        name##_node_t *nodes;                                                \
+        uint32_t *buckets;                                                   \
+        unsigned int bucket_shift;                                           \
+        size_t  capacity;                                                    \
+        size_t  size;                                                        \
+        uint32_t head;                                                       \
+        uint32_t tail;                                                       \
+        uint32_t free;                                                       \
+        lru_stats_t stats;                                                   \
+} name##_t;                                                                  \
+                                                                             \
+static inline uint32_t *                                                     \
+name##_find_link (name##_t *cache, key_type key)                             \
+{                                                                            \
+        uint32_t *link;                                                      \
+                                                                             \
+        link = &cache->buckets[lru_define_bucket ((uint64_t) (hash (key)),   \
+                                                  cache->bucket_shift)];     \
+        while (*link != LRU_DEFINE_NONE &&                                   \
+               !(eq (cache->nodes[*link].key, key)))                         \
+                link = &cache->nodes[*link].chain;                           \
+                                                                             \
+        return link;                                                         \
+}                                                                            \
+                                                                             \
+static inline void                                                           \
+name##_unlink_node (name##_t *cache, uint32_t index)                         \
+{                                                                            \
+        name##_node_t *node;                                                 \
+                                                                             \
+        node = &cache->nodes[index];                                         \
+        if (node->prev != LRU_DEFINE_NONE)                                   \
+                cache->nodes[node->prev].next = node->next;                  \
+        else                                                                 \
+                cache->head = node->next;                                    \
+                                                                             \
+        if (node->next != LRU_DEFINE_NONE)                                   \
+                cache->nodes[node->next].prev = node->prev;                  \
+        else                                                                 \
+                cache->tail = node->prev;                                    \
+}                                                                            \
+                                                                             \
+static inline void                                                           \
+name##_push_front (name##_t *cache, uint32_t index)                          \
+{                                                                            \
+        name##_node_t *node;                                                 \
+                                                                             \
+        node = &cache->nodes[index];                                         \
+        node->prev = LRU_DEFINE_NONE;                                        \
+        node->next = cache->head;                                            \
+        if (cache->head != LRU_DEFINE_NONE)                                  \
+                cache->nodes[cache->head].prev = index;                      \
+        else                                                                 \
+                cache->tail = index;                                         \
+        cache->head = index;                                                 \
+}                                                                            \
+                                                                             \
+static inline name##_t *                                                     \
+name##_create (size_t capacity)                                              \
+{                                                                            \
+        name##_t *cache;                                                     \
+        size_t  buckets;                                                     \
+        size_t  i;                                                           \
+                                                                             \
+        if (capacity == 0 || capacity >= LRU_DEFINE_NONE)                    \
+                return NULL;                                                 \
+                                                                             \
+        cache = calloc (1, sizeof (name##_t));                               \
+        if (cache == NULL)                                                   \
+                return NULL;                                                 \
+                                                                             \
+        buckets = 2;                                                         \
+        cache->bucket_shift = 63;                                            \
+        while (buckets < capacity)                                           \
+        {                                                                    \
+                buckets <<= 1;                                               \
+                cache->bucket_shift--;                                       \
+        }                                                                    \
+                                                                             \
+        cache->nodes = malloc (capacity * sizeof (name##_node_t));           \
+        cache->buckets = malloc (buckets * sizeof (uint32_t));               \
+        if (cache->nodes == NULL || cache->buckets == NULL ||                \
+            pthread_mutex_init (&cache->lock, NULL) != 0)                    \
+        {                                                                    \
+                free (cache->nodes);                                         \
+                free (cache->buckets);                                       \
+                free (cache);                                                \
+                return NULL;                                                 \
+        }                                                                    \
+                                                                             \
+        memset (cache->buckets, 0xff, buckets * sizeof (uint32_t));          \
+        for (i = 0; i < capacity; i++)                                       \
+                cache->nodes[i].next = i + 1 < capacity ?                    \
+                        (uint32_t) (i + 1) : LRU_DEFINE_NONE;                \
+                                                                             \
+        cache->capacity = capacity;                                          \
+        cache->head = LRU_DEFINE_NONE;                                       \
+        cache->tail = LRU_DEFINE_NONE;                                       \
+        cache->free = 0;                                                     \
+                                                                             \
+        return cache;                                                        \
+}                                                                            \
+                                                                             \
+static inline void                                                           \
+name##_destroy (name##_t *cache)                                             \
+{                                                                            \
+        if (cache == NULL)                                                   \
+                return;                                                      \
+                                                                             \
+        pthread_mutex_destroy (&cache->lock);                                \
+        free (cache->nodes);                                                 \
+        free (cache->buckets);                                               \
+        free (cache);                                                        \
+}                                                                            \
+                                                                             \
+static inline int                                                            \
+name##_get (name##_t *cache, key_type key, value_type *value)                \
+{                                                                            \
+        uint32_t index;                                                      \
+                                                                             \
+        if (cache == NULL || value == NULL)                                  \
+                return LRU_ERROR_INVALID_ARG;                                \
+                                                                             \
+        pthread_mutex_lock (&cache->lock);                                   \
+        index = *name##_find_link (cache, key);                              \
+        if (index == LRU_DEFINE_NONE)                                        \
+        {                                                                    \
+                cache->stats.misses++;                                       \
+                pthread_mutex_unlock (&cache->lock);                         \
+                return LRU_ERROR_NOT_FOUND;                                  \
+        }                                                                    \
+                                                                             \
+        *value = cache->nodes[index].value;                                  \
+        if (cache->head != index)                                            \
+        {                                                                    \
+                name##_unlink_node (cache, index);                           \
+                name##_push_front (cache, index);                            \
+        }                                                                    \
+        cache->stats.hits++;                                                 \
+        pthread_mutex_unlock (&cache->lock);                                 \
+                                                                             \
+        return LRU_SUCCESS;                                                  \
+}                                                                            \
+                                                                             \
+static inline bool                                                           \
+name##_contains (name##_t *cache, key_type key)                              \
+{                                                                            \
+        bool    found;                                                       \
+                                                                             \
+        if (cache == NULL)                                                   \
+                return false;                                                \
+                                                                             \
+        pthread_mutex_lock (&cache->lock);                                   \
+        found = *name##_find_link (cache, key) != LRU_DEFINE_NONE;           \
+        pthread_mutex_unlock (&cache->lock);                                 \
+                                                                             \
+        return found;                                                        \
+}                                                                            \
+                                                                             \
+static inline int                                                            \
+name##_put (name##_t *cache, key_type key, value_type value)                 \
+{                                                                            \
+        uint32_t *link;                                                      \
+        uint32_t index;                                                      \
+                                                                             \
+        if (cache == NULL)                                                   \
+                return LRU_ERROR_INVALID_ARG;                                \
+                                                                             \
+        pthread_mutex_lock (&cache->lock);                                   \
+        link = name##_find_link (cache, key);                                \
+        index = *link;                                                       \
+        if (index != LRU_DEFINE_NONE)                                        \
+        {                                                                    \
+                cache->nodes[index].value = value;                           \
+                if (cache->head != index)                                    \
+                {                                                            \
+                        name##_unlink_node (cache, index);                   \
+                        name##_push_front (cache, index);                    \
+                }                                                            \
+                pthread_mutex_unlock (&cache->lock);                         \
+                return LRU_SUCCESS;                                          \
+        }                                                                    \
+                                                                             \
+        index = cache->free;                                                 \
+        if (index != LRU_DEFINE_NONE)                                        \
+                cache->free = cache->nodes[index].next;                      \
+        else                                                                 \
+        {                                                                    \
+                index = cache->tail;                                         \
+                link = name##_find_link (cache, cache->nodes[index].key);    \
+                *link = cache->nodes[index].chain;                           \
+                name##_unlink_node (cache, index);                           \
+                cache->size--;                                               \
+                cache->stats.evictions++;                                    \
+        }                                                                    \
+                                                                             \
+        link = &cache->buckets[lru_define_bucket ((uint64_t) (hash (key)),   \
+                                                  cache->bucket_shift)];     \
+        cache->nodes[index].key = key;                                       \
+        cache->nodes[index].value = value;                                   \
+        cache->nodes[index].chain = *link;                                   \
+        *link = index;                                                       \
+        name##_push_front (cache, index);                                    \
+                                                                             \
+        cache->size++;                                                       \
+        cache->stats.insertions++;                                           \
+        if (cache->size > cache->stats.peak_size)                            \
+                cache->stats.peak_size = cache->size;                        \
+        pthread_mutex_unlock (&cache->lock);                                 \
+                                                                             \
+        return LRU_SUCCESS;                                                  \
+}                                                                            \
+                                                                             \
+static inline int                                                            \
+name##_delete (name##_t *cache, key_type key)                                \
+{                                                                            \
+        uint32_t *link;                                                      \
+        uint32_t index;                                                      \
+                                                                             \
+        if (cache == NULL)                                                   \
+                return LRU_ERROR_INVALID_ARG;                                \
+                                                                             \
+        pthread_mutex_lock (&cache->lock);                                   \
+        link = name##_find_link (cache, key);                                \
+        index = *link;                                                       \
+        if (index == LRU_DEFINE_NONE)                                        \
+        {                                                                    \
+                pthread_mutex_unlock (&cache->lock);                         \
+                return LRU_ERROR_NOT_FOUND;                                  \
+        }                                                                    \
+                                                                             \
+        *link = cache->nodes[index].chain;                                   \
+        name##_unlink_node (cache, index);                                   \
+        cache->nodes[index].next = cache->free;                              \
+        cache->free = index;                                                 \
+        cache->size--;                                                       \
+        cache->stats.deletions++;                                            \
+        pthread_mutex_unlock (&cache->lock);                                 \
+                                                                             \
+        return LRU_SUCCESS;                                                  \
+}                                                                            \
+                                                                             \
+static inline size_t                                                         \
+name##_size (name##_t *cache)                                                \
+{                                                                            \
+        size_t  size;                                                        \
+                                                                             \
+        if (cache == NULL)                                                   \
+                return 0;                                                    \
+                                                                             \
+        pthread_mutex_lock (&cache->lock);                                   \
+        size = cache->size;                                                  \
+        pthread_mutex_unlock (&cache->lock);                                 \
+                                                                             \
+        return size;                                                         \
+}                                                                            \
+                                                                             \
+static inline int                                                            \
+name##_get_stats (name##_t *cache, lru_stats_t *stats)                       \
+{                                                                            \
+        if (cache == NULL || stats == NULL)                                  \
+                return LRU_ERROR_INVALID_ARG;                                \
+                                                                             \
+        pthread_mutex_lock (&cache->lock);                                   \
+        *stats = cache->stats;                                               \
+        stats->current_size = cache->size;                                   \
+        pthread_mutex_unlock (&cache->lock);                                 \
+                                                                             \
+        return LRU_SUCCESS;                                                  \
+}
+
+#endif /* LRU_CACHE_DEFINE_H */
@@ -0,0 +1,156 @@
+/* lru_demo.c - Walkthrough of the basic lru_cache API */
+
+#include "lru_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+example_eviction_callback (const void *key, size_t key_size,
+                           void *value, size_t value_size, void *user_data)
+{
+        int    *eviction_count;
+
+        (void) value;
+        (void) value_size;
+
+        eviction_count = (int *) user_data;
+        (*eviction_count)++;
+
+        printf ("Evicting key: %.*s\n", (int) key_size, (const char *) key);
+}
+
+static void
+print_cache_stats (lru_cache_t *cache)
+{
+        lru_stats_t stats;
+
+        if (lru_cache_get_stats (cache, &stats) == LRU_SUCCESS)
+        {
+                printf ("\nCache Statistics:\n");
+                printf ("  Hits:        %lu\n", stats.hits);
+                printf ("  Misses:      %lu\n", stats.misses);
+                printf ("  Evictions:   %lu\n", stats.evictions);
+                printf ("  Insertions:  %lu\n", stats.insertions);
+                printf ("  Deletions:   %lu\n", stats.deletions);
+                printf ("  Collisions:  %lu\n", stats.collisions);
+                printf ("  Current Size: %zu\n", stats.current_size);
+                printf ("  Peak Size:   %zu\n", stats.peak_size);
+
+                if (stats.hits + stats.misses > 0)
+                {
+                        double  hit_rate;
+                        hit_rate =
+                                (double) stats.hits / (stats.hits +
+                                                       stats.misses) * 100.0;
+                        printf ("  Hit Rate:    %.2f%%\n", hit_rate);
+                }
+        }
+}
+
+int
+main (void)
+{
+        lru_cache_t *cache;
+        int     eviction_count;
+        char   *value;
+        size_t  value_size;
+        int     i;
+        char    key_buf[32];
+        char    value_buf[64];
+
+        printf ("=================================\n\n");
+
+        cache = lru_cache_create (5);
+        if (cache == NULL)
+        {
+                fprintf (stderr, "Failed to create cache\n");
+                return 1;
+        }
+
+        printf ("Created cache with capacity: %zu\n",
+                lru_cache_capacity (cache));
+
+        eviction_count = 0;
+        lru_cache_set_eviction_callback (cache, example_eviction_callback,
+                                         &eviction_count);
+
+        printf ("\nAdding entries to cache:\n");
+        for (i = 1; i <= 7; i++)
+        {
+                snprintf (key_buf, sizeof (key_buf), "key%d", i);
+                snprintf (value_buf, sizeof (value_buf), "value_%d", i);
+
+                printf ("  Put: %s -> %s\n", key_buf, value_buf);
+                lru_cache_put (cache, key_buf, strlen (key_buf) + 1,
+                               value_buf, strlen (value_buf) + 1);
+        }
+
+        printf ("\nCache size: %zu / %zu\n",
+                lru_cache_size (cache), lru_cache_capacity (cache));
+        printf ("Total evictions: %d\n", eviction_count);
+
+        printf ("\nTesting retrieval:\n");
+
+        if (lru_cache_get (cache, "key3", 5, (void **) &value, &value_size)
+            == LRU_SUCCESS)
+        {
+                printf ("  Get key3: %s\n", value);
+                free (value);
+        }
+        else
+        {
+                printf ("  Get key3: NOT FOUND (evicted)\n");
+        }
+
+        if (lru_cache_get (cache, "key6", 5, (void **) &value, &value_size)
+            == LRU_SUCCESS)
+        {
+                printf ("  Get key6: %s\n", value);
+                free (value);
+        }
+        else
+        {
+                printf ("  Get key6: NOT FOUND\n");
+        }
+
+        printf ("\nIterating through cache (MRU to LRU):\n");
+        {
+                lru_iterator_t *iter;
+                char   *key;
+                size_t  key_size;
+
+                iter = lru_iterator_create (cache);
+                if (iter != NULL)
+                {
+                        while (lru_iterator_has_next (iter))
+                        {
+                                if (lru_iterator_next
+                                    (iter, (void **) &key, &key_size,
+                                     (void **) &value,
+                                     &value_size) == LRU_SUCCESS)
+                                {
+                                        printf ("  %s -> %s\n", key, value);
+                                        free (key);
+                                        free (value);
+                                }
+                        }
+                        lru_iterator_destroy (iter);
+                }
+        }
+
+        print_cache_stats (cache);
+
+        printf ("\nResizing cache to capacity 3:\n");
+        lru_cache_resize (cache, 3);
+        printf ("New size: %zu / %zu\n",
+                lru_cache_size (cache), lru_cache_capacity (cache));
+        printf ("Total evictions: %d\n", eviction_count);
+
+        lru_cache_destroy (cache);
+
+        printf ("\nCache destroyed successfully.\n");
+
+        return 0;
+}
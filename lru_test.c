@@ -0,0 +1,914 @@
+/* lru_test.c - Behavior checks for the lru_cache library, run by make check
+ *
+ * Every test is deterministic: no sleeps stand in for synchronization
+ * and no outcome depends on thread scheduling.  Pass test names to run
+ * only those.
+ */
+
+#include "lru_cache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int failures;
+
+#define CHECK(cond) \
+        do \
+        { \
+                if (!(cond)) \
+                { \
+                        fprintf (stderr, "%s:%d: check failed: %s\n", \
+                                 __FILE__, __LINE__, #cond); \
+                        failures++; \
+                } \
+        } while (0)
+
+typedef struct test_case
+{
+        const char *name;
+        void    (*fn) (void);
+} test_case_t;
+
+static int
+put_str (lru_cache_t *cache, const char *key, const char *value)
+{
+        return lru_cache_put (cache, key, strlen (key), value,
+                              strlen (value) + 1);
+}
+
+/* True when key is cached with exactly value. */
+static bool
+has_str (lru_cache_t *cache, const char *key, const char *value)
+{
+        char   *found;
+        size_t  found_size;
+        bool    same;
+
+        if (lru_cache_get (cache, key, strlen (key), (void **) &found,
+                           &found_size) != LRU_SUCCESS)
+                return false;
+
+        same = found_size == strlen (value) + 1 &&
+                memcmp (found, value, found_size) == 0;
+        free (found);
+
+        return same;
+}
+
+static void
+test_eviction_order (void)
+{
+        lru_cache_t *cache;
+
+        cache = lru_cache_create (3);
+        CHECK (cache != NULL);
+        if (cache == NULL)
+                return;
+
+        CHECK (put_str (cache, "a", "1") == LRU_SUCCESS);
+        CHECK (put_str (cache, "b", "2") == LRU_SUCCESS);
+        CHECK (put_str (cache, "c", "3") == LRU_SUCCESS);
+
+        /* A read makes "a" the most recent, so "b" goes first. */
+        CHECK (has_str (cache, "a", "1"));
+        CHECK (put_str (cache, "d", "4") == LRU_SUCCESS);
+
+        CHECK (lru_cache_size (cache) == 3);
+        CHECK (!lru_cache_contains (cache, "b", 1));
+        CHECK (has_str (cache, "a", "1"));
+        CHECK (has_str (cache, "c", "3"));
+        CHECK (has_str (cache, "d", "4"));
+
+        lru_cache_destroy (cache);
+}
+
+/* Two resizes in a row, the second arriving while the first is still
+ * migrating, then enough puts to fill the larger capacity.
+ */
+static void
+test_resize_during_rehash (void)
+{
+        static const unsigned int flags[] = {
+                LRU_CACHE_FLAG_NONE,
+                LRU_CACHE_FLAG_OPEN_ADDRESSING
+        };
+        lru_cache_t *cache;
+        char    key[32];
+        size_t  f;
+        size_t  i;
+        size_t  missing;
+
+        for (f = 0; f < sizeof (flags) / sizeof (flags[0]); f++)
+        {
+                cache = lru_cache_create_ex (1000, flags[f]);
+                CHECK (cache != NULL);
+                if (cache == NULL)
+                        continue;
+
+                for (i = 0; i < 1000; i++)
+                {
+                        snprintf (key, sizeof (key), "old%zu", i);
+                        put_str (cache, key, key);
+                }
+
+                CHECK (lru_cache_resize (cache, 20000) == LRU_SUCCESS);
+                CHECK (lru_cache_resize (cache, 100000) == LRU_SUCCESS);
+
+                missing = 0;
+                for (i = 0; i < 100000; i++)
+                {
+                        snprintf (key, sizeof (key), "new%zu", i);
+                        CHECK (put_str (cache, key, key) == LRU_SUCCESS);
+                }
+                for (i = 0; i < 100000; i++)
+                {
+                        snprintf (key, sizeof (key), "new%zu", i);
+                        if (!has_str (cache, key, key))
+                                missing++;
+                }
+                CHECK (missing == 0);
+                CHECK (lru_cache_size (cache) == 100000);
+
+                lru_cache_destroy (cache);
+        }
+}
+
+/* Puts hot keys, reads each of them a few times, then streams scan
+ * keys that are each put once.  Returns how many hot keys survive.
+ */
+static size_t
+hot_after_scan (lru_cache_t *cache, size_t hot, size_t scan)
+{
+        char    key[32];
+        size_t  round;
+        size_t  i;
+        size_t  kept;
+
+        for (i = 0; i < hot; i++)
+        {
+                snprintf (key, sizeof (key), "hot%zu", i);
+                put_str (cache, key, key);
+        }
+        for (round = 0; round < 4; round++)
+        {
+                for (i = 0; i < hot; i++)
+                {
+                        snprintf (key, sizeof (key), "hot%zu", i);
+                        has_str (cache, key, key);
+                }
+        }
+
+        for (i = 0; i < scan; i++)
+        {
+                snprintf (key, sizeof (key), "scan%zu", i);
+                put_str (cache, key, key);
+        }
+
+        kept = 0;
+        for (i = 0; i < hot; i++)
+        {
+                snprintf (key, sizeof (key), "hot%zu", i);
+                if (lru_cache_contains (cache, key, strlen (key)))
+                        kept++;
+        }
+
+        return kept;
+}
+
+/* A scan flushes plain LRU, while under SLRU the re-read keys sit in
+ * protected and the scan only cycles through probation.
+ */
+static void
+test_slru_scan_resistance (void)
+{
+        lru_cache_t *cache;
+
+        cache = lru_cache_create_ex (100, LRU_CACHE_FLAG_NONE);
+        CHECK (cache != NULL);
+        if (cache != NULL)
+        {
+                CHECK (hot_after_scan (cache, 50, 1000) == 0);
+                lru_cache_destroy (cache);
+        }
+
+        cache = lru_cache_create_ex (100, LRU_CACHE_FLAG_SEGMENTED);
+        CHECK (cache != NULL);
+        if (cache != NULL)
+        {
+                CHECK (hot_after_scan (cache, 50, 1000) == 50);
+                CHECK (lru_cache_size (cache) == 100);
+                lru_cache_destroy (cache);
+        }
+
+        cache = lru_cache_create_ex (100, LRU_CACHE_FLAG_SEGMENTED |
+                                     LRU_CACHE_FLAG_DEFERRED_PROMOTION);
+        CHECK (cache != NULL);
+        if (cache != NULL)
+        {
+                CHECK (hot_after_scan (cache, 50, 1000) == 50);
+                lru_cache_destroy (cache);
+        }
+}
+
+/* Under W-TinyLFU a key leaving the window only displaces the main
+ * victim when the sketch has seen it more often.
+ */
+static void
+test_tinylfu_admission (void)
+{
+        lru_cache_t *cache;
+        int     i;
+
+        cache = lru_cache_create_ex (100, LRU_CACHE_FLAG_TINYLFU);
+        CHECK (cache != NULL);
+        if (cache == NULL)
+                return;
+
+        CHECK (hot_after_scan (cache, 50, 1000) == 50);
+
+        /* Every put of "x" counts, so it beats the main victim... */
+        for (i = 0; i < 10; i++)
+                CHECK (put_str (cache, "x", "x") == LRU_SUCCESS);
+        CHECK (put_str (cache, "y", "y") == LRU_SUCCESS);
+        CHECK (lru_cache_contains (cache, "x", 1));
+
+        /* ...while "y", seen once, is turned away by the next key. */
+        CHECK (put_str (cache, "z", "z") == LRU_SUCCESS);
+        CHECK (!lru_cache_contains (cache, "y", 1));
+        CHECK (lru_cache_contains (cache, "z", 1));
+        CHECK (lru_cache_size (cache) == 100);
+
+        lru_cache_destroy (cache);
+}
+
+/* Only used to let TTLs run out, never to wait for another thread. */
+static void
+wait_ms (long ms)
+{
+        struct timespec ts;
+
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000;
+        while (nanosleep (&ts, &ts) != 0)
+                ;
+}
+
+static void
+put_group (lru_cache_t *cache, const char *prefix, uint64_t ttl_ms)
+{
+        char    key[32];
+        int     i;
+
+        for (i = 0; i < 10; i++)
+        {
+                snprintf (key, sizeof (key), "%s%d", prefix, i);
+                if (ttl_ms == 0)
+                        CHECK (put_str (cache, key, key) == LRU_SUCCESS);
+                else
+                        CHECK (lru_cache_put_ttl (cache, key, strlen (key),
+                                                  key, strlen (key) + 1,
+                                                  ttl_ms) == LRU_SUCCESS);
+        }
+}
+
+static size_t
+count_group (lru_cache_t *cache, const char *prefix)
+{
+        char    key[32];
+        size_t  found;
+        int     i;
+
+        found = 0;
+        for (i = 0; i < 10; i++)
+        {
+                snprintf (key, sizeof (key), "%s%d", prefix, i);
+                if (lru_cache_contains (cache, key, strlen (key)))
+                        found++;
+        }
+
+        return found;
+}
+
+/* TTLs that land in the first wheel level and in the second, which has
+ * to cascade down before firing, next to entries that must not expire.
+ */
+static void
+test_ttl_expiry (void)
+{
+        lru_cache_t *cache;
+        lru_stats_t stats;
+
+        cache = lru_cache_create (100);
+        CHECK (cache != NULL);
+        if (cache == NULL)
+                return;
+
+        CHECK (lru_cache_put_ttl (cache, "k", 1, "v", 2, 0) ==
+               LRU_ERROR_INVALID_ARG);
+
+        put_group (cache, "short", 5);
+        put_group (cache, "mid", 100);
+        put_group (cache, "long", 3600 * 1000);
+        put_group (cache, "plain", 0);
+        CHECK (lru_cache_size (cache) == 40);
+
+        wait_ms (300);
+
+        /* Expired entries are hidden before the wheel gets to them. */
+        CHECK (!has_str (cache, "short0", "short0"));
+        CHECK (count_group (cache, "mid") == 0);
+
+        lru_cache_expire (cache);
+        CHECK (lru_cache_expire (cache) == 0);
+        CHECK (lru_cache_size (cache) == 20);
+        CHECK (count_group (cache, "long") == 10);
+        CHECK (count_group (cache, "plain") == 10);
+
+        CHECK (lru_cache_get_stats (cache, &stats) == LRU_SUCCESS);
+        CHECK (stats.expirations == 20);
+
+        lru_cache_destroy (cache);
+}
+
+#define LOAD_THREADS 8
+
+/* The loader holds its load open until main releases it, so the first
+ * caller is still loading while the others arrive.
+ */
+typedef struct load_state
+{
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+        pthread_barrier_t start;
+        lru_cache_t *cache;
+        int     calls;
+        bool    loading;
+        bool    released;
+        int     result;
+} load_state_t;
+
+static int
+blocking_loader (const void *key, size_t key_size, void **value,
+                 size_t *value_size, void *ctx)
+{
+        load_state_t *state;
+
+        (void) key;
+        (void) key_size;
+
+        state = ctx;
+        pthread_mutex_lock (&state->lock);
+        state->calls++;
+        state->loading = true;
+        pthread_cond_broadcast (&state->changed);
+        while (!state->released)
+                pthread_cond_wait (&state->changed, &state->lock);
+        pthread_mutex_unlock (&state->lock);
+
+        if (state->result != LRU_SUCCESS)
+                return state->result;
+
+        *value = strdup ("loaded");
+        if (*value == NULL)
+                return LRU_ERROR_NOMEM;
+        *value_size = strlen ("loaded") + 1;
+
+        return LRU_SUCCESS;
+}
+
+static void *
+load_worker (void *arg)
+{
+        load_state_t *state;
+        char   *value;
+        size_t  value_size;
+        int     result;
+
+        state = arg;
+        pthread_barrier_wait (&state->start);
+
+        result = lru_cache_get_or_load (state->cache, "key", 3,
+                                        blocking_loader, state,
+                                        (void **) &value, &value_size);
+        if (result != LRU_SUCCESS)
+                return (void *) (intptr_t) result;
+
+        if (value_size != strlen ("loaded") + 1 || strcmp (value, "loaded"))
+                result = LRU_ERROR_INVALID_ARG;
+        free (value);
+
+        return (void *) (intptr_t) result;
+}
+
+/* Whether a caller waits on the running load or finds the value it
+ * stored, the loader runs once for all of them.
+ */
+static void
+test_get_or_load_coalescing (void)
+{
+        load_state_t state;
+        pthread_t first;
+        pthread_t others[LOAD_THREADS];
+        void   *result;
+        char   *value;
+        size_t  value_size;
+        int     i;
+
+        memset (&state, 0, sizeof (state));
+        pthread_mutex_init (&state.lock, NULL);
+        pthread_cond_init (&state.changed, NULL);
+        state.cache = lru_cache_create (10);
+        CHECK (state.cache != NULL);
+        if (state.cache == NULL)
+                return;
+
+        /* The first caller is inside the loader before the rest start. */
+        pthread_barrier_init (&state.start, NULL, 1);
+        CHECK (pthread_create (&first, NULL, load_worker, &state) == 0);
+        pthread_mutex_lock (&state.lock);
+        while (!state.loading)
+                pthread_cond_wait (&state.changed, &state.lock);
+        pthread_mutex_unlock (&state.lock);
+        pthread_barrier_destroy (&state.start);
+
+        pthread_barrier_init (&state.start, NULL, LOAD_THREADS + 1);
+        for (i = 0; i < LOAD_THREADS; i++)
+                CHECK (pthread_create (&others[i], NULL, load_worker,
+                                       &state) == 0);
+        pthread_barrier_wait (&state.start);
+
+        pthread_mutex_lock (&state.lock);
+        state.released = true;
+        pthread_cond_broadcast (&state.changed);
+        pthread_mutex_unlock (&state.lock);
+
+        pthread_join (first, &result);
+        CHECK ((intptr_t) result == LRU_SUCCESS);
+        for (i = 0; i < LOAD_THREADS; i++)
+        {
+                pthread_join (others[i], &result);
+                CHECK ((intptr_t) result == LRU_SUCCESS);
+        }
+        pthread_barrier_destroy (&state.start);
+
+        CHECK (state.calls == 1);
+        CHECK (has_str (state.cache, "key", "loaded"));
+
+        /* A failed load is handed back and nothing is cached, so the
+         * next miss loads again.
+         */
+        state.result = LRU_ERROR_IO;
+        CHECK (lru_cache_get_or_load (state.cache, "other", 5,
+                                      blocking_loader, &state,
+                                      (void **) &value, &value_size) ==
+               LRU_ERROR_IO);
+        CHECK (!lru_cache_contains (state.cache, "other", 5));
+        CHECK (lru_cache_get_or_load (state.cache, "other", 5,
+                                      blocking_loader, &state,
+                                      (void **) &value, &value_size) ==
+               LRU_ERROR_IO);
+        CHECK (state.calls == 3);
+
+        lru_cache_destroy (state.cache);
+        pthread_cond_destroy (&state.changed);
+        pthread_mutex_destroy (&state.lock);
+}
+
+/* Snapshot layout as lru_cache_save() writes it: a 24-byte header of
+ * magic, version, reserved and count, then per entry a 24-byte record of
+ * key size, value size and TTL followed by the key and value bytes.
+ */
+#define SNAPSHOT_VERSION_AT 8
+#define SNAPSHOT_COUNT_AT 16
+#define SNAPSHOT_RECORD_AT 24
+
+static unsigned char *
+read_file (const char *path, size_t *length)
+{
+        unsigned char *data;
+        FILE   *file;
+        long    end;
+
+        data = NULL;
+        file = fopen (path, "rb");
+        if (file == NULL)
+                return NULL;
+
+        if (fseek (file, 0, SEEK_END) == 0 && (end = ftell (file)) > 0 &&
+            fseek (file, 0, SEEK_SET) == 0)
+        {
+                *length = (size_t) end;
+                data = malloc (*length);
+                if (data != NULL && fread (data, 1, *length, file) != *length)
+                {
+                        free (data);
+                        data = NULL;
+                }
+        }
+        fclose (file);
+
+        return data;
+}
+
+static bool
+write_file (const char *path, const unsigned char *data, size_t length)
+{
+        FILE   *file;
+        bool    written;
+
+        file = fopen (path, "wb");
+        if (file == NULL)
+                return false;
+
+        written = fwrite (data, 1, length, file) == length;
+
+        return fclose (file) == 0 && written;
+}
+
+static void
+put_u64 (unsigned char *data, size_t offset, uint64_t value)
+{
+        memcpy (data + offset, &value, sizeof (value));
+}
+
+/* Loads a damaged copy of a good snapshot and expects it rejected with
+ * the target cache left as it was.
+ */
+static void
+check_rejected (const char *path, const unsigned char *data, size_t length)
+{
+        lru_cache_t *cache;
+
+        cache = lru_cache_create (10);
+        CHECK (cache != NULL);
+        if (cache == NULL)
+                return;
+
+        CHECK (put_str (cache, "keep", "kept") == LRU_SUCCESS);
+        CHECK (write_file (path, data, length));
+        CHECK (lru_cache_load (cache, path) == LRU_ERROR_IO);
+        CHECK (lru_cache_size (cache) == 1);
+        CHECK (has_str (cache, "keep", "kept"));
+
+        lru_cache_destroy (cache);
+}
+
+static void
+test_snapshot_check (void)
+{
+        char    path[] = "/tmp/lru_test.XXXXXX";
+        lru_cache_t *cache;
+        unsigned char *good;
+        unsigned char *bad;
+        uint64_t count;
+        size_t  length;
+        int     fd;
+
+        fd = mkstemp (path);
+        CHECK (fd >= 0);
+        if (fd < 0)
+                return;
+        close (fd);
+
+        cache = lru_cache_create (10);
+        CHECK (cache != NULL);
+        if (cache == NULL)
+                goto cleanup;
+        put_str (cache, "a", "alpha");
+        put_str (cache, "b", "beta");
+        put_str (cache, "c", "gamma");
+        CHECK (lru_cache_save (cache, path) == LRU_SUCCESS);
+        lru_cache_destroy (cache);
+
+        /* A good file loads behind what is cached, which wins. */
+        cache = lru_cache_create (10);
+        CHECK (cache != NULL);
+        if (cache == NULL)
+                goto cleanup;
+        put_str (cache, "a", "mine");
+        CHECK (lru_cache_load (cache, path) == LRU_SUCCESS);
+        CHECK (lru_cache_size (cache) == 3);
+        CHECK (has_str (cache, "a", "mine"));
+        CHECK (has_str (cache, "b", "beta"));
+        CHECK (has_str (cache, "c", "gamma"));
+        lru_cache_destroy (cache);
+
+        good = read_file (path, &length);
+        CHECK (good != NULL);
+        if (good == NULL)
+                goto cleanup;
+        bad = malloc (length);
+        CHECK (bad != NULL);
+        if (bad == NULL)
+        {
+                free (good);
+                goto cleanup;
+        }
+
+        check_rejected (path, good, 0);
+        check_rejected (path, good, SNAPSHOT_RECORD_AT - 1);
+        check_rejected (path, good, SNAPSHOT_RECORD_AT + 8);
+        check_rejected (path, good, length - 1);
+
+        memcpy (bad, good, length);
+        bad[0] ^= 0xff;
+        check_rejected (path, bad, length);
+
+        memcpy (bad, good, length);
+        bad[SNAPSHOT_VERSION_AT]++;
+        check_rejected (path, bad, length);
+
+        memcpy (bad, good, length);
+        memcpy (&count, good + SNAPSHOT_COUNT_AT, sizeof (count));
+        put_u64 (bad, SNAPSHOT_COUNT_AT, count + 1);
+        check_rejected (path, bad, length);
+
+        /* One otherwise well-formed record with an empty key. */
+        memcpy (bad, good, length);
+        put_u64 (bad, SNAPSHOT_COUNT_AT, 1);
+        put_u64 (bad, SNAPSHOT_RECORD_AT, 0);
+        put_u64 (bad, SNAPSHOT_RECORD_AT + 8, 2);
+        put_u64 (bad, SNAPSHOT_RECORD_AT + 16, 0);
+        memcpy (bad + 2 * SNAPSHOT_RECORD_AT, "v", 2);
+        check_rejected (path, bad, 2 * SNAPSHOT_RECORD_AT + 2);
+
+        /* Sizes that would wrap the offset past the end of the file. */
+        memcpy (bad, good, length);
+        put_u64 (bad, SNAPSHOT_RECORD_AT, UINT64_MAX);
+        check_rejected (path, bad, length);
+
+        memcpy (bad, good, length);
+        put_u64 (bad, SNAPSHOT_RECORD_AT + 8, UINT64_MAX - 1);
+        check_rejected (path, bad, length);
+
+        free (bad);
+        free (good);
+
+      cleanup:
+        unlink (path);
+
+        cache = lru_cache_create (10);
+        if (cache != NULL)
+        {
+                CHECK (lru_cache_load (cache, path) == LRU_ERROR_IO);
+                lru_cache_destroy (cache);
+        }
+}
+
+#define SCAN_KEYS 3000
+
+static void
+mark_seen (const void *key, size_t key_size, const void *value,
+           size_t value_size, void *user_data)
+{
+        unsigned char *seen;
+        char    text[32];
+        int     index;
+
+        (void) value;
+        (void) value_size;
+
+        seen = user_data;
+        if (key_size >= sizeof (text))
+                return;
+        memcpy (text, key, key_size);
+        text[key_size] = '\0';
+
+        if (sscanf (text, "k%d", &index) == 1 && index >= 0 &&
+            index < SCAN_KEYS && seen[index] < UINT8_MAX)
+                seen[index]++;
+}
+
+/* An entry present for the whole scan is visited at least once, even
+ * when the index grows and then shrinks between chunks and other keys
+ * come and go.
+ */
+static void
+test_scan_across_resize (void)
+{
+        static const unsigned int flags[] = {
+                LRU_CACHE_FLAG_NONE,
+                LRU_CACHE_FLAG_OPEN_ADDRESSING
+        };
+        unsigned char seen[SCAN_KEYS];
+        lru_cache_t *cache;
+        char    key[32];
+        size_t  cursor;
+        size_t  calls;
+        size_t  missed;
+        size_t  f;
+        size_t  i;
+
+        for (f = 0; f < sizeof (flags) / sizeof (flags[0]); f++)
+        {
+                cache = lru_cache_create_ex (10000, flags[f]);
+                CHECK (cache != NULL);
+                if (cache == NULL)
+                        continue;
+
+                for (i = 0; i < SCAN_KEYS; i++)
+                {
+                        snprintf (key, sizeof (key), "k%zu", i);
+                        put_str (cache, key, key);
+                }
+
+                memset (seen, 0, sizeof (seen));
+                cursor = 0;
+                calls = 0;
+                do
+                {
+                        cursor = lru_cache_scan (cache, cursor, 8, mark_seen,
+                                                 seen);
+                        calls++;
+
+                        if (calls == 20)
+                                CHECK (lru_cache_resize (cache, 50000) ==
+                                       LRU_SUCCESS);
+                        if (calls == 60)
+                                CHECK (lru_cache_resize (cache, 5000) ==
+                                       LRU_SUCCESS);
+
+                        /* Churn that keeps the rehash moving. */
+                        snprintf (key, sizeof (key), "extra%zu", calls);
+                        put_str (cache, key, key);
+                        if (calls % 2 == 0)
+                        {
+                                snprintf (key, sizeof (key), "extra%zu",
+                                          calls - 1);
+                                lru_cache_delete (cache, key, strlen (key));
+                        }
+                } while (cursor != 0 && calls < 1000000);
+
+                CHECK (cursor == 0);
+
+                missed = 0;
+                for (i = 0; i < SCAN_KEYS; i++)
+                {
+                        if (seen[i] == 0)
+                                missed++;
+                }
+                CHECK (missed == 0);
+
+                lru_cache_destroy (cache);
+        }
+}
+
+/* Pushes everything cached out to the tier and waits for the writes. */
+static void
+spill_all (lru_cache_t *cache, size_t capacity)
+{
+        static int filler;
+        char    key[32];
+        size_t  i;
+
+        for (i = 0; i < capacity; i++)
+        {
+                snprintf (key, sizeof (key), "filler%d", filler++);
+                put_str (cache, key, key);
+        }
+        CHECK (lru_cache_flush_tier (cache) == LRU_SUCCESS);
+}
+
+/* The tier may keep older copies of a key; only the newest version may
+ * be served, and none once the key is deleted or taken.
+ */
+static void
+test_tier_versions (void)
+{
+        char    path[] = "/tmp/lru_test_tier.XXXXXX";
+        lru_cache_t *cache;
+        lru_stats_t stats;
+        char   *value;
+        size_t  value_size;
+        int     fd;
+
+        fd = mkstemp (path);
+        CHECK (fd >= 0);
+        if (fd < 0)
+                return;
+        close (fd);
+
+        cache = lru_cache_create (4);
+        CHECK (cache != NULL);
+        if (cache == NULL)
+                goto cleanup;
+        CHECK (lru_cache_attach_tier (cache, path, 1 << 20) == LRU_SUCCESS);
+
+        /* A spilled entry comes back from the tier. */
+        put_str (cache, "a", "a1");
+        spill_all (cache, 4);
+        CHECK (!lru_cache_contains (cache, "a", 1));
+        CHECK (has_str (cache, "a", "a1"));
+
+        /* A put over a spilled copy makes it stale, so once the new
+         * value is taken out of memory the old one must not come back.
+         */
+        put_str (cache, "b", "b1");
+        spill_all (cache, 4);
+        put_str (cache, "b", "b2");
+        CHECK (has_str (cache, "b", "b2"));
+        value = NULL;
+        CHECK (lru_cache_take (cache, "b", 1, (void **) &value,
+                               &value_size) == LRU_SUCCESS);
+        CHECK (value != NULL && strcmp (value, "b2") == 0);
+        free (value);
+        CHECK (!has_str (cache, "b", "b1"));
+
+        /* A delete drops a spilled copy as well. */
+        put_str (cache, "e", "e1");
+        spill_all (cache, 4);
+        CHECK (lru_cache_delete (cache, "e", 1) == LRU_SUCCESS);
+        CHECK (!has_str (cache, "e", "e1"));
+
+        /* Of two spilled versions only the later one is served. */
+        put_str (cache, "c", "c1");
+        spill_all (cache, 4);
+        put_str (cache, "c", "c2");
+        spill_all (cache, 4);
+        CHECK (has_str (cache, "c", "c2"));
+
+        /* Taking a spilled entry removes it from the tier too. */
+        put_str (cache, "d", "d1");
+        spill_all (cache, 4);
+        value = NULL;
+        CHECK (lru_cache_take (cache, "d", 1, (void **) &value,
+                               &value_size) == LRU_SUCCESS);
+        if (value != NULL)
+        {
+                CHECK (value_size == 3 && strcmp (value, "d1") == 0);
+                free (value);
+        }
+        value = NULL;
+        CHECK (lru_cache_take (cache, "d", 1, (void **) &value,
+                               &value_size) == LRU_ERROR_NOT_FOUND);
+        CHECK (!has_str (cache, "d", "d1"));
+
+        CHECK (lru_cache_get_stats (cache, &stats) == LRU_SUCCESS);
+        CHECK (stats.spills > 0);
+        CHECK (stats.tier_hits == 3);
+
+        lru_cache_destroy (cache);
+
+      cleanup:
+        unlink (path);
+}
+
+static const test_case_t tests[] = {
+        {"eviction_order", test_eviction_order},
+        {"resize_during_rehash", test_resize_during_rehash},
+        {"slru_scan_resistance", test_slru_scan_resistance},
+        {"tinylfu_admission", test_tinylfu_admission},
+        {"ttl_expiry", test_ttl_expiry},
+        {"get_or_load_coalescing", test_get_or_load_coalescing},
+        {"snapshot_check", test_snapshot_check},
+        {"scan_across_resize", test_scan_across_resize},
+        {"tier_versions", test_tier_versions},
+};
+
+static bool
+selected (int argc, char **argv, const char *name)
+{
+        int     i;
+
+        if (argc < 2)
+                return true;
+
+        for (i = 1; i < argc; i++)
+        {
+                if (strcmp (argv[i], name) == 0)
+                        return true;
+        }
+
+        return false;
+}
+
+int
+main (int argc, char **argv)
+{
+        size_t  i;
+        int     before;
+        int     failed;
+
+        failed = 0;
+        for (i = 0; i < sizeof (tests) / sizeof (tests[0]); i++)
+        {
+                if (!selected (argc, argv, tests[i].name))
+                        continue;
+
+                before = failures;
+                tests[i].fn ();
+                if (failures == before)
+                        printf ("ok   %s\n", tests[i].name);
+                else
+                {
+                        printf ("FAIL %s\n", tests[i].name);
+                        failed++;
+                }
+        }
+
+        return failed == 0 ? 0 : 1;
+}